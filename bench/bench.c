@@ -0,0 +1,427 @@
+#include "../training/training.h"
+
+/*
+  annc-bench times the hot paths of training and evaluation, feedforward,
+  backprop, update_mini_batch, init_set_loader and evaluate, and the fused
+  bias_activate kernel with the sigmoid and the fast sigmoid, over a grid of
+  hidden layer widths and batch sizes. The products of every
+  SPECIALIZED_SHAPES layer are timed with dgemm and with the specialized
+  kernels for each batch size. The networks have one hidden layer,
+  784 x width x 10, with the activation and cost annc trains with. Each
+  case runs warmup times untimed and is then timed reps times, the median
+  and the 95th percentile of the repetitions are reported.
+
+  The results go to stdout as a table and to a JSON file. Given a baseline,
+  a JSON file of an earlier run, every case gets its change against the
+  baseline median in percent and annc-bench exits with 1 if any case got
+  slower by more than the threshold.
+
+  usage: annc-bench [-n reps] [-w warmup] [-l widths] [-s batch sizes]
+                    [-f filter] [-o output.json] [-c baseline.json] [-t percent]
+
+  widths and batch sizes are comma separated lists, filter runs only the
+  cases whose name contains it. The cases on the MNIST sets are skipped
+  when the data files are missing.
+*/
+
+#define BENCH_REPS 21
+#define BENCH_WARMUP 3
+#define BENCH_WIDTHS "30,100,300"
+#define BENCH_BATCHES "1,10,100"
+#define BENCH_OUTPUT "bench.json"
+// percent a median may grow over its baseline before it is a regression
+#define BENCH_THRESHOLD 5.0
+#define BENCH_ETA 0.5
+#define MAX_GRID 16
+#define MAX_RESULTS 256
+#define NAME_SIZE 32
+
+typedef struct result {
+  char name[NAME_SIZE];
+  int width;      // hidden layer width, 0 where it does not apply
+  int batch;      // batch size, 0 where it does not apply
+  double median;  // seconds per repetition
+  double p95;
+  double baseline; // median of the baseline run, 0 if it has none
+} result_t;
+
+/*
+  A bench case is one network and the inputs its cases run on
+*/
+typedef struct bench_case {
+  network_t *net;
+  gsl_matrix *input;
+  gsl_matrix *target;
+  slab_t *velocity;
+  set_loader_t *loader;
+  int batch;
+  af_t *activation;
+  gsl_matrix *z, *a, *sp, *bias; // hidden layer x batch inputs of bias_activate
+  gsl_matrix *w, *x, *y, *dy, *dx, *dw; // products of one specialized shape
+} bench_case_t;
+
+typedef void (*bench_fn_t)(bench_case_t *c);
+
+static int reps = BENCH_REPS;
+static int warmup = BENCH_WARMUP;
+static const char *filter = NULL;
+static result_t results[MAX_RESULTS];
+static int num_results = 0;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+/*
+  quiet sends stdout to /dev/null while on, the set loader reports on
+  stdout and would fill the table
+*/
+static void quiet(bool on) {
+  static int saved = -1;
+  fflush(stdout);
+  if (on) {
+    int null = Open("/dev/null", O_WRONLY, 0);
+    saved = dup(STDOUT_FILENO);
+    Dup2(null, STDOUT_FILENO);
+    Close(null);
+  } else {
+    Dup2(saved, STDOUT_FILENO);
+    Close(saved);
+  }
+}
+
+/*
+  run times f on c and records the result under name, width and batch
+*/
+static void run(const char *name, int width, int batch, bench_fn_t f, bench_case_t *c) {
+  if (filter != NULL && strstr(name, filter) == NULL) return;
+  assert(num_results < MAX_RESULTS);
+  double *times = (double*) malloc(reps * sizeof(double));
+  for (int i = 0; i < warmup; i++) f(c);
+  for (int i = 0; i < reps; i++) {
+    double start = now();
+    f(c);
+    times[i] = now() - start;
+  }
+  qsort(times, reps, sizeof(double), compare_doubles);
+  result_t *r = &results[num_results++];
+  snprintf(r->name, NAME_SIZE, "%s", name);
+  r->width = width;
+  r->batch = batch;
+  r->median = (reps % 2) ? times[reps/2] : (times[reps/2 - 1] + times[reps/2]) / 2;
+  r->p95 = times[(int)ceil(0.95 * reps) - 1];
+  r->baseline = 0;
+  free(times);
+}
+
+// BEGIN CASES
+
+static void bench_feedforward(bench_case_t *c) {
+  feedforward(c->net, c->input);
+}
+
+static void bench_backprop(bench_case_t *c) {
+  backprop(c->net, c->target);
+}
+
+static void bench_update_mini_batch(bench_case_t *c) {
+  if (c->loader->idx + c->batch > c->loader->total) c->loader->idx = 0;
+  update_mini_batch(c->net, c->loader, c->velocity->weights, c->velocity->biases,
+                      c->batch, BENCH_ETA);
+}
+
+static void bench_evaluate(bench_case_t *c) {
+  evaluate(c->net, c->loader);
+}
+
+static void bench_bias_activate(bench_case_t *c) {
+  bias_activate(c->activation, c->z, c->bias, c->a, c->sp);
+}
+
+static void bench_init_set_loader(bench_case_t *c) {
+  set_loader_free(init_set_loader(TRAIN_IMAGES, TRAIN_LABELS));
+}
+
+/*
+  bench_dgemm and bench_specialized run the forward, backward and weight
+  gradient products of a layer
+*/
+static void bench_dgemm(bench_case_t *c) {
+  gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, c->w, c->x, 0.0, c->y);
+  gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, c->w, c->dy, 0.0, c->dx);
+  gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, c->dy, c->x, 0.0, c->dw);
+}
+
+static void bench_specialized(bench_case_t *c) {
+  specialized_forward(c->w, c->x, c->y);
+  specialized_backward(c->w, c->dy, c->dx);
+  specialized_weight_grad(c->dy, c->x, c->dw);
+}
+
+static network_t *bench_network(int width) {
+  int layers[] = {28*28, width, NUM_CLASSES};
+  return init_network(layers, 3, use_sigmoid(), use_softmax_cross_entropy_cost());
+}
+
+/*
+  run_grid runs every case on a network of each width, train and test are
+  NULL without the MNIST data
+*/
+static void run_grid(int widths[], int num_widths, int batches[], int num_batches,
+                      set_loader_t *train, set_loader_t *test) {
+  bench_case_t c;
+  af_t *exact = use_sigmoid();
+  af_t *fast = use_fast_sigmoid();
+  for (int w = 0; w < num_widths; w++) {
+    c.net = bench_network(widths[w]);
+    c.velocity = init_slab(c.net);
+    // a zero bias leaves z as it is, every repetition sees the same inputs
+    c.bias = gsl_matrix_calloc(widths[w], 1);
+    for (int b = 0; b < num_batches; b++) {
+      c.batch = batches[b];
+      c.input = rand_gaussian_matrix(28*28, c.batch);
+      c.target = gsl_matrix_calloc(NUM_CLASSES, c.batch);
+      for (int j = 0; j < c.batch; j++) gsl_matrix_set(c.target, j % NUM_CLASSES, j, 1);
+      run("feedforward", widths[w], c.batch, bench_feedforward, &c);
+      feedforward(c.net, c.input);
+      run("backprop", widths[w], c.batch, bench_backprop, &c);
+      c.z = rand_gaussian_matrix(widths[w], c.batch);
+      c.a = gsl_matrix_alloc(widths[w], c.batch);
+      c.sp = gsl_matrix_alloc(widths[w], c.batch);
+      c.activation = exact;
+      run("sigmoid", widths[w], c.batch, bench_bias_activate, &c);
+      c.activation = fast;
+      run("fast_sigmoid", widths[w], c.batch, bench_bias_activate, &c);
+      gsl_matrix_free(c.z);
+      gsl_matrix_free(c.a);
+      gsl_matrix_free(c.sp);
+      if (train != NULL) {
+        c.loader = train;
+        shuffle(train);
+        run("update_mini_batch", widths[w], c.batch, bench_update_mini_batch, &c);
+      }
+      gsl_matrix_free(c.input);
+      gsl_matrix_free(c.target);
+    }
+    if (test != NULL) {
+      c.loader = test;
+      run("evaluate", widths[w], EVAL_BATCH_SIZE, bench_evaluate, &c);
+    }
+    gsl_matrix_free(c.bias);
+    free_slab(c.velocity);
+    free_network(c.net);
+  }
+  free(exact);
+  free(fast);
+  if (train != NULL) {
+    quiet(true);
+    run("init_set_loader", 0, 0, bench_init_set_loader, &c);
+    quiet(false);
+  }
+}
+
+#define SHAPE_ENTRY(in, out) {in, out},
+
+/*
+  run_shapes times dgemm and the specialized kernels on every
+  SPECIALIZED_SHAPES layer, the specialized cases are skipped on cpus
+  without them
+*/
+static void run_shapes(int batches[], int num_batches) {
+  const size_t shapes[][2] = { SPECIALIZED_SHAPES(SHAPE_ENTRY) };
+  char name[NAME_SIZE];
+  bench_case_t c;
+  for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+    size_t in = shapes[s][0], out = shapes[s][1];
+    c.w = rand_gaussian_matrix(out, in);
+    c.dw = gsl_matrix_alloc(out, in);
+    for (int b = 0; b < num_batches; b++) {
+      c.x = rand_gaussian_matrix(in, batches[b]);
+      c.dy = rand_gaussian_matrix(out, batches[b]);
+      c.y = gsl_matrix_alloc(out, batches[b]);
+      c.dx = gsl_matrix_alloc(in, batches[b]);
+      snprintf(name, NAME_SIZE, "dgemm_%zux%zu", in, out);
+      run(name, 0, batches[b], bench_dgemm, &c);
+      if (specialized_forward(c.w, c.x, c.y)) {
+        snprintf(name, NAME_SIZE, "specialized_%zux%zu", in, out);
+        run(name, 0, batches[b], bench_specialized, &c);
+      }
+      gsl_matrix_free(c.x);
+      gsl_matrix_free(c.dy);
+      gsl_matrix_free(c.y);
+      gsl_matrix_free(c.dx);
+    }
+    gsl_matrix_free(c.w);
+    gsl_matrix_free(c.dw);
+  }
+}
+
+// BEGIN REPORTING
+
+/*
+  parse_list reads a comma separated list of up to MAX_GRID positive ints
+  into list and returns their number, or 0 if s is not such a list
+*/
+static int parse_list(const char *s, int list[]) {
+  int n = 0;
+  char *end;
+  while (*s && n < MAX_GRID) {
+    long x = strtol(s, &end, 10);
+    if (end == s || x <= 0) return 0;
+    list[n++] = x;
+    s = (*end == ',') ? end + 1 : end;
+  }
+  return (*s == '\0') ? n : 0;
+}
+
+/*
+  load_baseline sets the baseline of every result that has a match in the
+  JSON file written by an earlier run at path. The file is read one result
+  per line, as write_json lays it out. It returns the number of matches, or
+  -1 if the file can not be read.
+*/
+static int load_baseline(const char *path) {
+  char line[BUFFER_SIZE];
+  char name[NAME_SIZE];
+  int width, batch, matches = 0;
+  double median;
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, " {\"name\": \"%31[^\"]\", \"width\": %d, \"batch\": %d, \"median_us\": %lf",
+                name, &width, &batch, &median) != 4) continue;
+    for (int i = 0; i < num_results; i++) {
+      result_t *r = &results[i];
+      if (!strcmp(r->name, name) && r->width == width && r->batch == batch) {
+        r->baseline = median * 1e-6;
+        matches++;
+      }
+    }
+  }
+  fclose(f);
+  return matches;
+}
+
+static double delta_percent(result_t *r) {
+  return 100.0 * (r->median - r->baseline) / r->baseline;
+}
+
+/*
+  write_json writes the results to path, one result per line
+*/
+static int write_json(const char *path) {
+  const char *isas[] = {"scalar", "avx2", "avx512"};
+  FILE *f = fopen(path, "w");
+  if (f == NULL) return -1;
+  fprintf(f, "{\n  \"isa\": \"%s\",\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"results\": [\n",
+            isas[kernel_isa()], warmup, reps);
+  for (int i = 0; i < num_results; i++) {
+    result_t *r = &results[i];
+    fprintf(f, "    {\"name\": \"%s\", \"width\": %d, \"batch\": %d, \"median_us\": %.3f, \"p95_us\": %.3f",
+              r->name, r->width, r->batch, r->median * 1e6, r->p95 * 1e6);
+    if (r->baseline > 0) {
+      fprintf(f, ", \"baseline_us\": %.3f, \"delta_pct\": %.2f", r->baseline * 1e6, delta_percent(r));
+    }
+    fprintf(f, "}%s\n", (i < num_results - 1) ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  return (fclose(f) == 0) ? 0 : -1;
+}
+
+/*
+  print_table prints the results and returns the number of regressions
+  beyond threshold percent
+*/
+static int print_table(double threshold) {
+  int regressions = 0;
+  printf("%-18s %6s %6s %12s %12s %12s %8s\n",
+            "case", "width", "batch", "median us", "p95 us", "baseline us", "delta");
+  for (int i = 0; i < num_results; i++) {
+    result_t *r = &results[i];
+    printf("%-18s %6d %6d %12.3f %12.3f", r->name, r->width, r->batch, r->median * 1e6, r->p95 * 1e6);
+    if (r->baseline > 0) {
+      double delta = delta_percent(r);
+      bool regressed = delta > threshold;
+      regressions += regressed;
+      printf(" %12.3f %+7.1f%%%s", r->baseline * 1e6, delta, regressed ? "  REGRESSION" : "");
+    }
+    printf("\n");
+  }
+  return regressions;
+}
+
+int main(int argc, char **argv) {
+  int widths[MAX_GRID], batches[MAX_GRID];
+  int num_widths = parse_list(BENCH_WIDTHS, widths);
+  int num_batches = parse_list(BENCH_BATCHES, batches);
+  const char *output = BENCH_OUTPUT;
+  const char *baseline = NULL;
+  double threshold = BENCH_THRESHOLD;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:w:l:s:f:o:c:t:")) != -1) {
+    switch (opt) {
+      case 'n': reps = atoi(optarg); break;
+      case 'w': warmup = atoi(optarg); break;
+      case 'l': num_widths = parse_list(optarg, widths); break;
+      case 's': num_batches = parse_list(optarg, batches); break;
+      case 'f': filter = optarg; break;
+      case 'o': output = optarg; break;
+      case 'c': baseline = optarg; break;
+      case 't': threshold = atof(optarg); break;
+      default: num_widths = 0;
+    }
+  }
+  if (reps < 1 || warmup < 0 || num_widths == 0 || num_batches == 0 || optind != argc) {
+    fprintf(stderr, "usage: %s [-n reps] [-w warmup] [-l widths] [-s batch sizes] [-f filter] "
+                      "[-o output.json] [-c baseline.json] [-t percent]\n", argv[0]);
+    return 2;
+  }
+
+  set_loader_t *train = NULL;
+  set_loader_t *test = NULL;
+  if (verify_data()) {
+    // the loaders are set up the way annc trains with them
+    quiet(true);
+    train = init_set_loader(TRAIN_IMAGES, TRAIN_LABELS);
+    test = init_set_loader(TEST_IMAGES, TEST_LABELS);
+    set_loader_cache(train, LOADER_CACHE_DOUBLE);
+    set_loader_cache(test, LOADER_CACHE_DOUBLE);
+    set_loader_sparse(train);
+    set_loader_sparse(test);
+    quiet(false);
+  } else {
+    fprintf(stderr, "%s\n", "MNIST data not found, skipping the cases on the data sets");
+  }
+
+  run_grid(widths, num_widths, batches, num_batches, train, test);
+  run_shapes(batches, num_batches);
+
+  if (baseline != NULL && load_baseline(baseline) < 0) {
+    fprintf(stderr, "%s: %s\n", baseline, "can not read the baseline");
+    return 2;
+  }
+  int regressions = print_table(threshold);
+  if (write_json(output) < 0) {
+    fprintf(stderr, "%s: %s\n", output, "can not write the results");
+    return 2;
+  }
+  if (train != NULL) {
+    set_loader_free(train);
+    set_loader_free(test);
+  }
+  if (regressions) {
+    printf("\n%d of %d cases more than %.1f%% slower than %s\n", regressions, num_results,
+              threshold, baseline);
+    return 1;
+  }
+  return 0;
+}
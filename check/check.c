@@ -0,0 +1,517 @@
+#include "../network/network.h"
+#include <float.h>
+
+/*
+  annc-check tests the numerical bounds the kernels promise. Every check
+  prints the largest error it saw next to its bound, annc-check exits with
+  1 if any error is over its bound. make check runs it once for each
+  instruction set ANNC_ISA can force, so every kernel path is covered.
+*/
+
+// inputs the sigmoid checks sweep, past FAST_EXP_LIMIT on both sides
+#define SIGMOID_RANGE 60.0
+#define SIGMOID_STEP 1e-4
+#define SIGMOID_ROWS 30
+// the specialized kernels sum in another order than dgemm
+#define SPECIALIZED_MAX_ERROR 1e-12
+// outputs of the softmax checks, like the MNIST classes
+#define SOFTMAX_ROWS 10
+// the sparse first layer sums in another order than the dense one
+#define SPARSE_CHECK_LAYERS {784, 30, 10}
+#define SPARSE_MAX_ERROR 1e-12
+// parameters of the optimizer checks, a vector body and a tail on every
+// instruction set, and the few ulps fused multiply adds may differ by
+#define SGD_CHECK_SIZE 103
+#define SGD_MAX_ULPS 4
+// random network the int8 model is checked on, its layers are not
+// multiples of the kernel widths so every tail runs
+#define QUANT_CHECK_LAYERS {100, 37, 10}
+#define QUANT_CHECK_SAMPLES 1000
+// the int8 model must agree on the samples the double model separates
+#define QUANT_CHECK_MARGIN 0.25
+#define QUANT_CHECK_MAX_ERROR 1e-9
+
+static int failures = 0;
+
+/*
+  report prints the result of the check name and counts it as a failure if
+  err is not below bound
+*/
+static void report(const char *name, double err, double bound) {
+  bool ok = err < bound;
+  printf("%-40s max error %-12g bound %-12g %s\n", name, err, bound, ok ? "ok" : "FAILED");
+  failures += !ok;
+}
+
+/*
+  sweep fills z column major with SIGMOID_STEP spaced inputs from
+  -SIGMOID_RANGE, so the fused kernels see whole rows of them
+*/
+static gsl_matrix *sweep() {
+  size_t n = 2 * SIGMOID_RANGE / SIGMOID_STEP + 1;
+  gsl_matrix *z = gsl_matrix_alloc(SIGMOID_ROWS, (n + SIGMOID_ROWS - 1) / SIGMOID_ROWS);
+  for (size_t k = 0; k < z->size1 * z->size2; k++) {
+    z->data[k] = -SIGMOID_RANGE + k * SIGMOID_STEP;
+  }
+  return z;
+}
+
+// BEGIN CHECKS
+
+/*
+  check_fast_sigmoid checks the fast sigmoid against the libm sigmoid in
+  both precisions, on its own and through the fused kernels
+*/
+static void check_fast_sigmoid() {
+  double err = 0, err_float = 0;
+  for (double x = -SIGMOID_RANGE; x <= SIGMOID_RANGE; x += SIGMOID_STEP) {
+    double s = sigmoid(x);
+    err = fmax(err, fabs(fast_sigmoid(x) - s));
+    err_float = fmax(err_float, fabs((1.0f / (1.0f + fast_exp_float((float)-x))) - s));
+  }
+  report("fast_sigmoid", err, FAST_SIGMOID_MAX_ERROR);
+  report("fast_exp_float sigmoid", err_float, FAST_SIGMOID_MAX_ERROR_FLOAT);
+
+  af_t *fast = use_fast_sigmoid();
+  gsl_matrix *z = sweep();
+  gsl_matrix *a = gsl_matrix_alloc(z->size1, z->size2);
+  gsl_matrix *sp = gsl_matrix_alloc(z->size1, z->size2);
+  gsl_matrix *b = gsl_matrix_calloc(z->size1, 1);
+  gsl_matrix_float *zf = gsl_matrix_float_alloc(z->size1, z->size2);
+  gsl_matrix_float *af = gsl_matrix_float_alloc(z->size1, z->size2);
+  gsl_matrix_float *spf = gsl_matrix_float_alloc(z->size1, z->size2);
+  gsl_matrix_float *bf = gsl_matrix_float_calloc(z->size1, 1);
+  for (size_t k = 0; k < z->size1 * z->size2; k++) zf->data[k] = z->data[k];
+  bias_activate(fast, z, b, a, sp);
+  bias_activate_float(fast, zf, bf, af, spf);
+  err = err_float = 0;
+  for (size_t k = 0; k < z->size1 * z->size2; k++) {
+    double s = sigmoid(z->data[k]);
+    err = fmax(err, fabs(a->data[k] - s));
+    err_float = fmax(err_float, fabs(af->data[k] - sigmoid(zf->data[k])));
+  }
+  report("bias_activate fast_sigmoid", err, FAST_SIGMOID_MAX_ERROR);
+  report("bias_activate_float fast_sigmoid", err_float, FAST_SIGMOID_MAX_ERROR_FLOAT);
+
+  gsl_matrix_free(z);
+  gsl_matrix_free(a);
+  gsl_matrix_free(sp);
+  gsl_matrix_free(b);
+  gsl_matrix_float_free(zf);
+  gsl_matrix_float_free(af);
+  gsl_matrix_float_free(spf);
+  gsl_matrix_float_free(bf);
+  free(fast);
+}
+
+/*
+  check_sigmoid checks the sigmoid kernels against the libm sigmoid in both
+  precisions, in relative error, over the sweep and the far tails
+*/
+static void check_sigmoid() {
+  af_t *exact = use_sigmoid();
+  gsl_matrix *z = sweep();
+  size_t len = z->size1 * z->size2;
+  // the last row goes out to where exp overflows
+  for (size_t j = 0; j < z->size2; j++) {
+    z->data[len - z->size2 + j] = -800.0 + 1600.0 * j / (z->size2 - 1);
+  }
+  gsl_matrix *a = gsl_matrix_alloc(z->size1, z->size2);
+  gsl_matrix *sp = gsl_matrix_alloc(z->size1, z->size2);
+  gsl_matrix *b = gsl_matrix_calloc(z->size1, 1);
+  gsl_matrix_float *zf = gsl_matrix_float_alloc(z->size1, z->size2);
+  gsl_matrix_float *af = gsl_matrix_float_alloc(z->size1, z->size2);
+  gsl_matrix_float *spf = gsl_matrix_float_alloc(z->size1, z->size2);
+  gsl_matrix_float *bf = gsl_matrix_float_calloc(z->size1, 1);
+  for (size_t k = 0; k < len; k++) zf->data[k] = z->data[k];
+  bias_activate(exact, z, b, a, sp);
+  bias_activate_float(exact, zf, bf, af, spf);
+  double err = 0, err_float = 0, err_prime = 0;
+  for (size_t k = 0; k < len; k++) {
+    double s = sigmoid(z->data[k]);
+    double sf = sigmoid(zf->data[k]);
+    // results too small to hold full precision only count in absolute error
+    err = fmax(err, fabs(a->data[k] - s) / fmax(s, GSL_DBL_MIN / GSL_DBL_EPSILON));
+    err_float = fmax(err_float, fabs(af->data[k] - sf) / fmax(sf, FLT_MIN / FLT_EPSILON));
+    err_prime = fmax(err_prime, fabs(sp->data[k] - sigmoid_prime(z->data[k])));
+  }
+  report("bias_activate sigmoid", err, SIGMOID_MAX_ERROR);
+  report("bias_activate_float sigmoid", err_float, SIGMOID_MAX_ERROR_FLOAT);
+  report("bias_activate sigmoid_prime", err_prime, SIGMOID_MAX_ERROR);
+
+  gsl_matrix_free(z);
+  gsl_matrix_free(a);
+  gsl_matrix_free(sp);
+  gsl_matrix_free(b);
+  gsl_matrix_float_free(zf);
+  gsl_matrix_float_free(af);
+  gsl_matrix_float_free(spf);
+  gsl_matrix_float_free(bf);
+  free(exact);
+}
+
+static double max_abs_diff(gsl_matrix *a, gsl_matrix *b) {
+  double err = 0;
+  for (size_t i = 0; i < a->size1; i++) {
+    for (size_t j = 0; j < a->size2; j++) {
+      err = fmax(err, fabs(gsl_matrix_get(a, i, j) - gsl_matrix_get(b, i, j)));
+    }
+  }
+  return err;
+}
+
+#define SHAPE_ENTRY(in, out) {in, out},
+
+/*
+  check_specialized checks the forward, backward and weight gradient
+  kernels of every SPECIALIZED_SHAPES layer against gsl_blas_dgemm, for
+  batch sizes that leave every tail of the register blocking
+*/
+static void check_specialized() {
+  const size_t shapes[][2] = { SPECIALIZED_SHAPES(SHAPE_ENTRY) };
+  const size_t batch_sizes[] = {1, 2, 3, 4, 5, 7, 8, 10, 17, 100, 1000};
+  for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+    size_t in = shapes[s][0], out = shapes[s][1];
+    double err = 0;
+    bool specialized = true;
+    for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+      size_t n = batch_sizes[b];
+      gsl_matrix *w = rand_gaussian_matrix(out, in);
+      gsl_matrix *a = rand_gaussian_matrix(in, n);
+      gsl_matrix *delta = rand_gaussian_matrix(out, n);
+      gsl_matrix *z[2], *da[2], *g[2];
+      for (int k = 0; k < 2; k++) {
+        z[k] = gsl_matrix_alloc(out, n);
+        da[k] = gsl_matrix_alloc(in, n);
+        g[k] = gsl_matrix_alloc(out, in);
+      }
+      gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, w, a, 0.0, z[0]);
+      gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, w, delta, 0.0, da[0]);
+      gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, delta, a, 0.0, g[0]);
+      specialized = specialized_forward(w, a, z[1]) && specialized_backward(w, delta, da[1])
+                      && specialized_weight_grad(delta, a, g[1]);
+      if (specialized) {
+        err = fmax(err, fmax(max_abs_diff(z[0], z[1]),
+                               fmax(max_abs_diff(da[0], da[1]), max_abs_diff(g[0], g[1]))));
+      }
+      for (int k = 0; k < 2; k++) {
+        gsl_matrix_free(z[k]);
+        gsl_matrix_free(da[k]);
+        gsl_matrix_free(g[k]);
+      }
+      gsl_matrix_free(w);
+      gsl_matrix_free(a);
+      gsl_matrix_free(delta);
+      if (!specialized) break;
+    }
+    char name[BUFFER_SIZE];
+    snprintf(name, BUFFER_SIZE, "specialized %zu x %zu", in, out);
+    if (specialized) {
+      report(name, err, SPECIALIZED_MAX_ERROR);
+    } else {
+      printf("%-40s skipped, no specialized kernels for this instruction set\n", name);
+    }
+  }
+}
+
+/*
+  check_softmax checks bias_softmax and softmax_cross_entropy against a
+  libm softmax, for batch widths that leave every tail of the vector
+  kernels and the SOFTMAX_CHUNK blocking. Some columns hold outputs around
+  +-100, so the largest output is far from the others.
+*/
+static void check_softmax() {
+  const size_t batch_sizes[] = {1, 3, 4, 5, 7, 8, 9, 13, 15, 17, 100, 130, 1000};
+  size_t rows = SOFTMAX_ROWS;
+  double err_a = 0, err_lse = 0, err_delta = 0, err_cost = 0;
+  for (size_t t = 0; t < sizeof(batch_sizes) / sizeof(batch_sizes[0]); t++) {
+    size_t n = batch_sizes[t];
+    gsl_matrix *z = rand_gaussian_matrix(rows, n);
+    gsl_matrix *b = rand_gaussian_matrix(rows, 1);
+    gsl_matrix *zb = gsl_matrix_alloc(rows, n);
+    gsl_matrix *a = gsl_matrix_alloc(rows, n);
+    gsl_matrix *y = gsl_matrix_calloc(rows, n);
+    gsl_matrix *delta = gsl_matrix_alloc(rows, n);
+    double *lse = (double*) malloc(n * sizeof(double));
+    for (size_t j = 0; j < n; j++) {
+      // every third column is spread out to +-100
+      for (size_t i = 0; i < rows && j % 3 == 1; i++) {
+        gsl_matrix_set(z, i, j, (i % 2) ? 100.0 - i : -100.0 + i);
+      }
+      gsl_matrix_set(y, rand() % rows, j, 1);
+    }
+    for (size_t i = 0; i < rows; i++) {
+      for (size_t j = 0; j < n; j++) {
+        gsl_matrix_set(zb, i, j, gsl_matrix_get(z, i, j) + gsl_matrix_get(b, i, 0));
+      }
+    }
+    bias_softmax(z, b, a, lse);
+    double cost = softmax_cross_entropy(z, lse, a, y, delta);
+
+    double cost_ref = 0;
+    for (size_t j = 0; j < n; j++) {
+      double m = gsl_matrix_get(zb, 0, j);
+      for (size_t i = 1; i < rows; i++) m = fmax(m, gsl_matrix_get(zb, i, j));
+      double s = 0;
+      for (size_t i = 0; i < rows; i++) s += exp(gsl_matrix_get(zb, i, j) - m);
+      double lse_ref = m + log(s);
+      err_lse = fmax(err_lse, fabs(lse[j] - lse_ref));
+      for (size_t i = 0; i < rows; i++) {
+        double a_ref = exp(gsl_matrix_get(zb, i, j) - lse_ref);
+        double yij = gsl_matrix_get(y, i, j);
+        err_a = fmax(err_a, fabs(gsl_matrix_get(a, i, j) - a_ref));
+        err_delta = fmax(err_delta, fabs(gsl_matrix_get(delta, i, j) - (a_ref - yij)));
+        cost_ref += yij * (lse_ref - gsl_matrix_get(zb, i, j));
+      }
+    }
+    cost_ref /= rows;
+    err_cost = fmax(err_cost, fabs(cost - cost_ref) / cost_ref);
+
+    gsl_matrix_free(z);
+    gsl_matrix_free(b);
+    gsl_matrix_free(zb);
+    gsl_matrix_free(a);
+    gsl_matrix_free(y);
+    gsl_matrix_free(delta);
+    free(lse);
+  }
+  report("bias_softmax", err_a, SOFTMAX_MAX_ERROR);
+  report("bias_softmax lse", err_lse, SOFTMAX_MAX_ERROR);
+  report("softmax_cross_entropy delta", err_delta, SOFTMAX_MAX_ERROR);
+  report("softmax_cross_entropy cost (relative)", err_cost, SOFTMAX_MAX_ERROR);
+}
+
+/*
+  check_sparse_input checks that a batch loaded with load_sparse gives the
+  same first layer outputs, through activate_sparse, and the same first
+  layer weight gradient, through weight_grad, as the same batch fed in
+  densely. The inputs are mostly zero like MNIST images.
+*/
+static void check_sparse_input() {
+  int layers[] = SPARSE_CHECK_LAYERS;
+  int num_layers = sizeof(layers) / sizeof(layers[0]);
+  const size_t batch_sizes[] = {1, 7, 100};
+  network_t *net = init_network(layers, num_layers, use_sigmoid(), use_softmax_cross_entropy_cost());
+  double err_z = 0, err_grad = 0;
+  for (size_t t = 0; t < sizeof(batch_sizes) / sizeof(batch_sizes[0]); t++) {
+    size_t n = batch_sizes[t];
+    gsl_matrix *x = gsl_matrix_calloc(layers[0], n);
+    gsl_matrix *y = gsl_matrix_calloc(layers[num_layers-1], n);
+    for (size_t j = 0; j < n; j++) {
+      for (int i = 0; i < layers[0]; i++) {
+        if (rand() % 5 == 0) gsl_matrix_set(x, i, j, (double)rand() / RAND_MAX);
+      }
+      gsl_matrix_set(y, rand() % layers[num_layers-1], j, 1);
+    }
+    feedforward(net, x);
+    backprop(net, y);
+    gsl_matrix *z = matrix_copy(net->outputs->data[0]);
+    gsl_matrix *g = matrix_copy(net->delta_weight_grads->data[0]);
+
+    sparse_t *sx = sparse_alloc(n, layers[0] * n);
+    size_t p = 0;
+    for (size_t j = 0; j < n; j++) {
+      sx->start[j] = p;
+      for (int i = 0; i < layers[0]; i++) {
+        if (gsl_matrix_get(x, i, j) == 0) continue;
+        sx->index[p] = i;
+        sx->value[p++] = gsl_matrix_get(x, i, j);
+      }
+    }
+    sx->start[n] = p;
+    sx->n = n;
+    load_sparse(net, sx);
+    // the dense input must not be read on the sparse path
+    gsl_matrix_set_zero(net->activations->data[0]);
+    feedforward(net, net->activations->data[0]);
+    backprop(net, y);
+    err_z = fmax(err_z, max_abs_diff(z, net->outputs->data[0]));
+    err_grad = fmax(err_grad, max_abs_diff(g, net->delta_weight_grads->data[0]));
+
+    sparse_free(sx);
+    gsl_matrix_free(x);
+    gsl_matrix_free(y);
+    gsl_matrix_free(z);
+    gsl_matrix_free(g);
+  }
+  report("activate_sparse", err_z, SPARSE_MAX_ERROR);
+  report("weight_grad sparse", err_grad, SPARSE_MAX_ERROR);
+  free_network(net);
+}
+
+/*
+  uniform returns a random double in [-1, 1]
+*/
+static double uniform() {
+  return 2.0 * rand() / RAND_MAX - 1.0;
+}
+
+/*
+  check_sgd_update checks the optimizer kernels against the update rule
+  written out in scalar code, for both optimizers and both precisions, on
+  SGD_CHECK_SIZE parameters so the vector body and its tail both run. The
+  vector kernels fuse multiplies and adds, so the error is counted in ulps
+  of the largest term of each sum, which is what rounding can move it by.
+*/
+static void check_sgd_update() {
+  const int optimizers[] = {OPTIMIZER_MOMENTUM, OPTIMIZER_NESTEROV};
+  const char *names[] = {"momentum", "nesterov"};
+  size_t n = SGD_CHECK_SIZE;
+  double w[SGD_CHECK_SIZE], v[SGD_CHECK_SIZE], g[SGD_CHECK_SIZE];
+  float wf[SGD_CHECK_SIZE], vf[SGD_CHECK_SIZE], gf[SGD_CHECK_SIZE];
+  double decay = 0.9996, mu = 0.9, eta = 0.05;
+  float decayf = decay, muf = mu, etaf = eta;
+  for (int o = 0; o < 2; o++) {
+    bool nesterov = (optimizers[o] == OPTIMIZER_NESTEROV);
+    double err = 0, err_float = 0;
+    for (size_t i = 0; i < n; i++) {
+      w[i] = wf[i] = uniform();
+      v[i] = vf[i] = 0.1 * uniform();
+      g[i] = gf[i] = uniform();
+    }
+    double w0[SGD_CHECK_SIZE], v0[SGD_CHECK_SIZE];
+    memcpy(w0, w, sizeof(w));
+    memcpy(v0, v, sizeof(v));
+    sgd_update(optimizers[o], w, v, g, n, decay, mu, eta);
+    sgd_update_float(optimizers[o], wf, vf, gf, n, decayf, muf, etaf);
+    for (size_t i = 0; i < n; i++) {
+      double vi = mu * v0[i] - eta * g[i];
+      double step = nesterov ? mu * vi - eta * g[i] : vi;
+      double wi = decay * w0[i] + step;
+      double v_scale = fmax(fabs(mu * v0[i]), fabs(eta * g[i]));
+      double w_scale = fmax(fabs(decay * w0[i]), fabs(step) + fabs(mu * vi));
+      err = fmax(err, fabs(v[i] - vi) / (v_scale * GSL_DBL_EPSILON));
+      err = fmax(err, fabs(w[i] - wi) / (w_scale * GSL_DBL_EPSILON));
+      float vfi = muf * (float)v0[i] - etaf * gf[i];
+      float stepf = nesterov ? muf * vfi - etaf * gf[i] : vfi;
+      float wfi = decayf * (float)w0[i] + stepf;
+      err_float = fmax(err_float, fabs(vf[i] - vfi) / (v_scale * FLT_EPSILON));
+      err_float = fmax(err_float, fabs(wf[i] - wfi) / (w_scale * FLT_EPSILON));
+    }
+    char name[BUFFER_SIZE];
+    snprintf(name, BUFFER_SIZE, "sgd_update %s (ulps)", names[o]);
+    report(name, err, SGD_MAX_ULPS);
+    snprintf(name, BUFFER_SIZE, "sgd_update_float %s (ulps)", names[o]);
+    report(name, err_float, SGD_MAX_ULPS);
+  }
+}
+
+/*
+  check_dot_u8s8 checks the int8 dot product kernels against a plain int32
+  loop. The inputs at 255 and weights at +-QUANT_WEIGHT_MAX are the worst
+  case for the int16 lanes of vpmaddubsw, the lengths leave every tail.
+  The kernels must be exact, so the bound is 1.
+*/
+static void check_dot_u8s8() {
+  const size_t lengths[] = {1, 7, 31, 33, 63, 65, 100, 127, 129, 200, 784};
+  size_t rows = 3, n = 4, kmax = 784;
+  int8_t *w = (int8_t*) malloc(rows * kmax);
+  uint8_t *x = (uint8_t*) malloc(n * kmax);
+  int32_t c[3 * 4];
+  double err = 0;
+  for (size_t r = 0; r < rows * kmax; r++) {
+    // same sign runs, alternating signs and random weights
+    int sign = (r / kmax == 0) ? 1 : (r / kmax == 1) ? ((r % 2) ? 1 : -1) : ((rand() % 2) ? 1 : -1);
+    w[r] = sign * ((r / kmax == 2) ? rand() % (QUANT_WEIGHT_MAX + 1) : QUANT_WEIGHT_MAX);
+  }
+  for (size_t i = 0; i < n * kmax; i++) x[i] = (i / kmax < 2) ? QUANT_ACTIVATION_MAX : rand() % 256;
+  for (size_t t = 0; t < sizeof(lengths) / sizeof(lengths[0]); t++) {
+    size_t k = lengths[t];
+    dot_u8s8(w, kmax, rows, x, kmax, n, k, c, n);
+    for (size_t r = 0; r < rows; r++) {
+      for (size_t j = 0; j < n; j++) {
+        int32_t ref = 0;
+        for (size_t i = 0; i < k; i++) ref += (int32_t)x[j * kmax + i] * w[r * kmax + i];
+        err = fmax(err, abs(c[r * n + j] - ref));
+      }
+    }
+  }
+  report("dot_u8s8", err, 1);
+  free(w);
+  free(x);
+}
+
+/*
+  check_qmodel checks that the int8 model of a small random network
+  predicts the same class as its double model, for every sample whose top
+  two double outputs are QUANT_CHECK_MARGIN apart. The error is the share
+  of those samples that disagree.
+*/
+static void check_qmodel() {
+  int layers[] = QUANT_CHECK_LAYERS;
+  int num_layers = sizeof(layers) / sizeof(layers[0]);
+  size_t len = layers[0], n = QUANT_CHECK_SAMPLES;
+  double scale = 1.0 / QUANT_ACTIVATION_MAX;
+  network_t *net = init_network(layers, num_layers, use_sigmoid(), use_softmax_cross_entropy_cost());
+  // zero biases and zero mean unit variance weight rows, so the outputs
+  // depend on the inputs rather than on the parameters, are far apart and
+  // spread over the classes
+  for (int l = 0; l < num_layers - 1; l++) {
+    gsl_matrix *w = net->weights[l];
+    double gain = sqrt(w->size2);
+    gsl_matrix_set_zero(net->biases[l]);
+    for (size_t r = 0; r < w->size1; r++) {
+      double mean = 0;
+      for (size_t i = 0; i < w->size2; i++) mean += gsl_matrix_get(w, r, i) / w->size2;
+      for (size_t i = 0; i < w->size2; i++) {
+        gsl_matrix_set(w, r, i, gain * (gsl_matrix_get(w, r, i) - mean));
+      }
+    }
+  }
+  uint8_t *pixels = (uint8_t*) malloc(n * len);
+  for (size_t k = 0; k < n * len; k++) pixels[k] = (rand() % 2) ? QUANT_ACTIVATION_MAX : rand() % 256;
+  gsl_matrix *input = gsl_matrix_alloc(len, n);
+  for (size_t j = 0; j < n; j++) {
+    for (size_t i = 0; i < len; i++) gsl_matrix_set(input, i, j, scale * pixels[j * len + i]);
+  }
+  qmodel_t *qm = quantize_network(net, scale, input);
+  model_t *m = freeze_network(net);
+  scratch_t *s = init_scratch(m, n);
+  qscratch_t *qs = init_qscratch(qm, n);
+  gsl_matrix *out = model_predict(m, s, input);
+  gsl_matrix *qout = qmodel_predict(qm, qs, pixels, n);
+  size_t clear = 0, differ = 0;
+  for (size_t j = 0; j < n; j++) {
+    size_t best = 0, qbest = 0;
+    for (size_t k = 1; k < out->size1; k++) {
+      if (gsl_matrix_get(out, k, j) > gsl_matrix_get(out, best, j)) best = k;
+      if (gsl_matrix_get(qout, k, j) > gsl_matrix_get(qout, qbest, j)) qbest = k;
+    }
+    double second = -1;
+    for (size_t k = 0; k < out->size1; k++) {
+      if (k != best && gsl_matrix_get(out, k, j) > second) second = gsl_matrix_get(out, k, j);
+    }
+    if (gsl_matrix_get(out, best, j) - second < QUANT_CHECK_MARGIN) continue;
+    clear++;
+    differ += (best != qbest);
+  }
+  char name[BUFFER_SIZE];
+  snprintf(name, BUFFER_SIZE, "qmodel_predict argmax (%zu samples)", clear);
+  report(name, clear ? (double)differ / clear : 1, QUANT_CHECK_MAX_ERROR);
+
+  free_qscratch(qs);
+  free_scratch(s);
+  free_qmodel(qm);
+  free_model(m);
+  gsl_matrix_free(input);
+  free(pixels);
+  free_network(net);
+}
+
+int main(int argc, char **argv) {
+  const char *isas[] = {"scalar", "avx2", "avx512"};
+  printf("kernels: %s\n", isas[kernel_isa()]);
+  check_fast_sigmoid();
+  check_sigmoid();
+  check_specialized();
+  check_softmax();
+  check_sparse_input();
+  check_sgd_update();
+  check_dot_u8s8();
+  check_qmodel();
+  if (failures) {
+    printf("%d checks FAILED\n", failures);
+    return 1;
+  }
+  return 0;
+}
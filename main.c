@@ -1,21 +1,147 @@
 #include "training/training.h"
+#include <limits.h>
 
 #define EPOCHS 100
 #define ETA 0.5
 #define MINI_BATCH_SIZE 1000
 #define LAYERS {(28*28), 30, 30, 10}
 #define NUM_LAYERS 4
+#define THREADS 1
+// LOADER_UINT8 keeps only the mapped pixels, for hosts short on memory,
+// it is always used with SPARSE_INPUT
+#define LOADER_MODE LOADER_CACHE_DOUBLE
+// feed the first layer only the nonzero pixels of each image
+#define SPARSE_INPUT true
+// training images the int8 activation scales are calibrated on
+#define CALIBRATION_SAMPLES 1000
+// fine tuning epochs after pruning
+#define PRUNE_EPOCHS 1
 
 static int net_example();
-static int train_mnist();
+static int train_mnist(int num_threads, bool hogwild);
+static int train_mnist_float();
 static int mnist_example_load();
+static int parallel_benchmark(int num_threads, int target);
+static int quantize_benchmark(const char *checkpoint);
+static int prune_benchmark(const char *checkpoint, double sparsity, int epochs);
 
-int main() {
-  train_mnist();
+/*
+  parse_count parses s as a decimal int of at least min into x and returns
+  0, or -1 if s is anything else
+*/
+static int parse_count(const char *s, int min, int *x) {
+  char *end;
+  errno = 0;
+  long v = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE || v < min || v > INT_MAX) return -1;
+  *x = (int)v;
   return 0;
 }
 
-int train_mnist() {
+/*
+  parse_fraction parses s as a number in [0, 1) into x and returns 0, or -1
+  if s is anything else
+*/
+static int parse_fraction(const char *s, double *x) {
+  char *end;
+  errno = 0;
+  double v = strtod(s, &end);
+  if (end == s || *end != '\0' || errno == ERANGE || !(v >= 0 && v < 1)) return -1;
+  *x = v;
+  return 0;
+}
+
+/*
+  usage: annc [-H] [-b target] [threads]
+         annc -f
+         annc -q checkpoint
+         annc -p sparsity [-e epochs] checkpoint
+
+  annc trains a network on MNIST with threads threads and saves it. -H
+  trains with the Hogwild trainer instead of the synchronous one. -b
+  trains with both instead and reports the time each needs to get target
+  test images right. -f trains the single precision network instead, on
+  one thread and without saving it. -q compares the int8 quantization of a saved network
+  with the network itself, -p prunes a saved network to sparsity, fine
+  tunes it for epochs epochs and compares the CSR export with it.
+*/
+int main(int argc, char **argv) {
+  int num_threads = THREADS;
+  int target = 0;
+  int epochs = -1;
+  double sparsity = -1;
+  const char *quantize = NULL;
+  bool hogwild = false, float32 = false, usage = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "Hfb:q:p:e:")) != -1) {
+    switch (opt) {
+      case 'H': hogwild = true; break;
+      case 'f': float32 = true; break;
+      case 'b': usage |= parse_count(optarg, 1, &target) < 0; break;
+      case 'q': quantize = optarg; break;
+      case 'p': usage |= parse_fraction(optarg, &sparsity) < 0; break;
+      case 'e': usage |= parse_count(optarg, 0, &epochs) < 0; break;
+      default: usage = true;
+    }
+  }
+  bool train = (quantize == NULL && sparsity < 0);
+  if (train) {
+    if (epochs >= 0) usage = true;
+    if (float32 && (hogwild || target > 0 || optind < argc)) usage = true;
+    if (optind < argc - 1 || (optind == argc - 1 && parse_count(argv[optind], 1, &num_threads) < 0)) {
+      usage = true;
+    }
+  } else {
+    // the checkpoint modes take no training options
+    if (hogwild || float32 || target > 0 || (quantize != NULL && sparsity >= 0)) usage = true;
+    if (sparsity >= 0 && optind != argc - 1) usage = true;
+    if (quantize != NULL && (epochs >= 0 || optind != argc)) usage = true;
+  }
+  if (usage) {
+    fprintf(stderr, "usage: %s [-H] [-b target] [threads]\n"
+                      "       %s -f\n"
+                      "       %s -q checkpoint\n"
+                      "       %s -p sparsity [-e epochs] checkpoint\n",
+                      argv[0], argv[0], argv[0], argv[0]);
+    return 2;
+  }
+  if (quantize != NULL) return quantize_benchmark(quantize);
+  if (sparsity >= 0) return prune_benchmark(argv[optind], sparsity, (epochs < 0) ? PRUNE_EPOCHS : epochs);
+  if (target > 0) return parallel_benchmark(num_threads, target);
+  if (float32) return train_mnist_float();
+  return train_mnist(num_threads, hogwild);
+}
+
+/*
+  load_sets opens the MNIST sets the way annc trains on them, for the
+  single precision network if float32. It returns -1 if the data files
+  are missing.
+*/
+static int load_sets(set_loader_t **train_set, set_loader_t **test_set, bool float32) {
+  if (verify_data()) {
+    printf("%s\n", "woohoo, verified");
+  } else {
+    printf("%s\n", "whoops, not verified");
+    return -1;
+  }
+  *train_set = init_set_loader(TRAIN_IMAGES, TRAIN_LABELS);
+  *test_set = init_set_loader(TEST_IMAGES, TEST_LABELS);
+  // the single precision network has no sparse first layer
+  bool sparse = SPARSE_INPUT && !float32;
+  // sparse batches scale the few nonzero pixels themselves, a dense cache
+  // would only cost memory
+  int mode = float32 ? LOADER_CACHE_FLOAT : sparse ? LOADER_UINT8 : LOADER_MODE;
+  set_loader_cache(*train_set, mode);
+  set_loader_cache(*test_set, mode);
+  if (sparse) {
+    set_loader_sparse(*train_set);
+    set_loader_sparse(*test_set);
+  }
+  return 0;
+}
+
+int train_mnist(int num_threads, bool hogwild) {
   set_loader_t *train_set;
   set_loader_t *test_set;
   network_t *net;
@@ -23,29 +149,65 @@ int train_mnist() {
   int layers[] = LAYERS;
   printf("%s\n", "Initializing network");
 
-  cf_t *cost = use_cross_entropy_cost();
+  cf_t *cost = use_softmax_cross_entropy_cost();
   af_t *activation = use_sigmoid();
 
   net = init_network(layers, num_layers, activation, cost);
 
-  if (verify_data()) {
-    printf("%s\n", "woohoo, verified");
-  } else {
-    printf("%s\n", "whoops, not verified");
+  if (load_sets(&train_set, &test_set, false) < 0) {
+    free_network(net);
     return 1;
   }
-  train_set = init_set_loader(TRAIN_IMAGES, TRAIN_LABELS);
-  test_set = init_set_loader(TEST_IMAGES, TEST_LABELS);
 
-  printf("\nEpochs: %d, Eta: %4f, MBS: %d\n\n", EPOCHS, ETA, MINI_BATCH_SIZE);
+  printf("\nEpochs: %d, Eta: %4f, MBS: %d, Threads: %d%s\n\n", EPOCHS, ETA, MINI_BATCH_SIZE,
+            num_threads, hogwild ? ", Hogwild" : "");
 
-  stochastic_gradient_descent(net, train_set, test_set, MINI_BATCH_SIZE, EPOCHS, ETA);
+  if (hogwild) {
+    hogwild_stochastic_gradient_descent(net, train_set, test_set, MINI_BATCH_SIZE, EPOCHS, ETA, num_threads);
+  } else if (num_threads > 1) {
+    parallel_stochastic_gradient_descent(net, train_set, test_set, MINI_BATCH_SIZE, EPOCHS, ETA, num_threads);
+  } else {
+    stochastic_gradient_descent(net, train_set, test_set, MINI_BATCH_SIZE, EPOCHS, ETA);
+  }
+  int confusion[NUM_CLASSES][NUM_CLASSES] = {{0}};
+  int correct = parallel_evaluate(net, test_set, num_threads, confusion);
+  printf("\nFinal accuracy %d / %zu\n", correct, test_set->total);
+  print_confusion(confusion);
+  save(net);
   set_loader_free(train_set);
   set_loader_free(test_set);
   free_network(net);
   return 0;
 }
 
+/*
+  train_mnist_float trains the single precision network on one thread.
+  There is no single precision checkpoint, the network is not saved.
+*/
+int train_mnist_float() {
+  set_loader_t *train_set;
+  set_loader_t *test_set;
+  int layers[] = LAYERS;
+  printf("%s\n", "Initializing single precision network");
+
+  // softmax outputs have no single precision kernel
+  network_float_t *net = init_network_float(layers, NUM_LAYERS, use_sigmoid(),
+                                              use_cross_entropy_cost());
+  if (net == NULL) return 1;
+  if (load_sets(&train_set, &test_set, true) < 0) {
+    free_network_float(net);
+    return 1;
+  }
+
+  printf("\nEpochs: %d, Eta: %4f, MBS: %d, float32\n\n", EPOCHS, ETA, MINI_BATCH_SIZE);
+  stochastic_gradient_descent_float(net, train_set, test_set, MINI_BATCH_SIZE, EPOCHS, ETA);
+  printf("\nFinal accuracy %d / %zu\n", evaluate_float(net, test_set), test_set->total);
+  set_loader_free(train_set);
+  set_loader_free(test_set);
+  free_network_float(net);
+  return 0;
+}
+
 int mnist_example_load() {
     set_loader_t *train_set;
     set_loader_t *test_set;
@@ -66,10 +228,16 @@ int mnist_example_load() {
     train_set = init_set_loader(TRAIN_IMAGES, TRAIN_LABELS);
     test_set = init_set_loader(TEST_IMAGES, TEST_LABELS);
     printf("%s\n", "No shuffle");
-    for (int i = 0; i < 5; i++) image_print(get_next_image(train_set), train_set->height);
+    for (int i = 0; i < 5; i++) {
+      image_t img = get_next_image(train_set);
+      image_print(&img, train_set->height);
+    }
     shuffle(train_set);
     printf("%s\n", "Post shuffle");
-    for (int i = 0; i < 5; i++) image_print(get_next_image(train_set), train_set->height);
+    for (int i = 0; i < 5; i++) {
+      image_t img = get_next_image(train_set);
+      image_print(&img, train_set->height);
+    }
 
     set_loader_free(train_set);
     set_loader_free(test_set);
@@ -142,3 +310,184 @@ int net_example() {
 
   return 0;
 }
+
+/*
+  parallel_benchmark trains a fresh network with the synchronous and the
+  Hogwild trainers and reports the training time each needs to get target
+  test images right, giving up after EPOCHS epochs. It prints the accuracy
+  and the training time after every epoch, so the trainers can also be
+  compared at equal time when one of them never gets there.
+*/
+int parallel_benchmark(int num_threads, int target) {
+  int layers[] = LAYERS;
+  const char *names[] = {"synchronous", "hogwild"};
+  set_loader_t *train_set;
+  set_loader_t *test_set;
+  if (load_sets(&train_set, &test_set, false) < 0) return 1;
+  for (int k = 0; k < 2; k++) {
+    network_t *net = init_network(layers, NUM_LAYERS, use_sigmoid(), use_softmax_cross_entropy_cost());
+    double secs = 0;
+    int correct = 0, e = 0;
+    while (correct < target && e < EPOCHS) {
+      struct timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      if (k == 0) {
+        parallel_stochastic_gradient_descent(net, train_set, test_set, MINI_BATCH_SIZE, 1, ETA, num_threads);
+      } else {
+        hogwild_stochastic_gradient_descent(net, train_set, test_set, MINI_BATCH_SIZE, 1, ETA, num_threads);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      secs += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+      correct = parallel_evaluate(net, test_set, num_threads, NULL);
+      e++;
+      printf("%s epoch %d: %d / %zu after %.3fs of training\n", names[k], e, correct,
+                test_set->total, secs);
+    }
+    printf("%s: %s %d / %zu after %d epochs, %.3fs\n", names[k],
+              (correct >= target) ? "reached" : "stopped at", correct, test_set->total, e, secs);
+    free_network(net);
+  }
+  set_loader_free(train_set);
+  set_loader_free(test_set);
+  return 0;
+}
+
+/*
+  predict_set runs the test set through whichever of model, the int8
+  qmodel and the pruned smodel is not NULL, in batches of batch_size
+  images, and returns the number of correct predictions. secs gets the
+  time spent, including the pixel conversion the double models need.
+*/
+static int predict_set(model_t *model, qmodel_t *qmodel, sparse_model_t *smodel,
+                          set_loader_t *set, size_t batch_size, double *secs) {
+  size_t len = set->width * set->height;
+  scratch_t *s = model ? init_scratch(model, batch_size)
+                  : smodel ? init_sparse_scratch(smodel, batch_size) : NULL;
+  qscratch_t *qs = qmodel ? init_qscratch(qmodel, batch_size) : NULL;
+  int correct = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t first = 0; first < set->total; first += batch_size) {
+    size_t n = (set->total - first < batch_size) ? set->total - first : batch_size;
+    const uint8_t *pixels = set->data + first * len;
+    gsl_matrix *out;
+    if (s) {
+      gsl_matrix *input = scratch_input(s, n);
+      for (size_t j = 0; j < n; j++) {
+        for (size_t i = 0; i < len; i++) {
+          input->data[i * input->tda + j] = PIXEL_SCALE * pixels[j * len + i];
+        }
+      }
+      out = model ? model_predict(model, s, input) : sparse_model_predict(smodel, s, input);
+    } else {
+      out = qmodel_predict(qmodel, qs, pixels, n);
+    }
+    for (size_t j = 0; j < n; j++) {
+      size_t prediction = 0;
+      for (size_t k = 1; k < out->size1; k++) {
+        if (gsl_matrix_get(out, k, j) > gsl_matrix_get(out, prediction, j)) prediction = k;
+      }
+      if (prediction == set->labels[first + j]) correct++;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  *secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  if (s) free_scratch(s);
+  if (qs) free_qscratch(qs);
+  return correct;
+}
+
+/*
+  quantize_benchmark quantizes the network in checkpoint to int8,
+  calibrated on the first CALIBRATION_SAMPLES training images, and
+  compares it with the double precision model on the test set: accuracy,
+  latency of single images and throughput of EVAL_BATCH_SIZE batches
+*/
+int quantize_benchmark(const char *checkpoint) {
+  network_t *net = load_network(checkpoint);
+  if (net == NULL) return 1;
+  if (!verify_data()) {
+    printf("%s\n", "whoops, not verified");
+    free_network(net);
+    return 1;
+  }
+  set_loader_t *train_set = init_set_loader(TRAIN_IMAGES, TRAIN_LABELS);
+  set_loader_t *test_set = init_set_loader(TEST_IMAGES, TEST_LABELS);
+  gsl_matrix *calibration = gsl_matrix_alloc(net->layers[0], CALIBRATION_SAMPLES);
+  gsl_matrix *target = gsl_matrix_alloc(NUM_CLASSES, CALIBRATION_SAMPLES);
+  fill_batch(train_set, 0, CALIBRATION_SAMPLES, calibration, target);
+  qmodel_t *qmodel = quantize_network(net, PIXEL_SCALE, calibration);
+  gsl_matrix_free(calibration);
+  gsl_matrix_free(target);
+  set_loader_free(train_set);
+  if (qmodel == NULL) {
+    free_network(net);
+    set_loader_free(test_set);
+    return 1;
+  }
+  model_t *model = freeze_network(net);
+
+  size_t batch_sizes[] = {1, EVAL_BATCH_SIZE};
+  for (int b = 0; b < 2; b++) {
+    double secs, qsecs;
+    int correct = predict_set(model, NULL, NULL, test_set, batch_sizes[b], &secs);
+    int qcorrect = predict_set(NULL, qmodel, NULL, test_set, batch_sizes[b], &qsecs);
+    printf("batch %4zu: double %d / %zu in %.2f us/image, int8 %d / %zu in %.2f us/image\n",
+              batch_sizes[b], correct, test_set->total, secs * 1e6 / test_set->total,
+              qcorrect, test_set->total, qsecs * 1e6 / test_set->total);
+    printf("            accuracy delta %+.2f%%, %.2fx faster\n",
+              100.0 * (qcorrect - correct) / test_set->total, secs / qsecs);
+  }
+
+  free_qmodel(qmodel);
+  free_model(model);
+  free_network(net);
+  set_loader_free(test_set);
+  return 0;
+}
+
+/*
+  prune_benchmark prunes the network in checkpoint to sparsity, fine tunes
+  it for epochs epochs under the pruning mask and compares its CSR export
+  with the dense model on the test set: size, accuracy, latency of single
+  images and throughput of EVAL_BATCH_SIZE batches
+*/
+int prune_benchmark(const char *checkpoint, double sparsity, int epochs) {
+  set_loader_t *train_set;
+  set_loader_t *test_set;
+  network_t *net = load_network(checkpoint);
+  if (net == NULL) return 1;
+  if (load_sets(&train_set, &test_set, false) < 0) {
+    free_network(net);
+    return 1;
+  }
+  model_t *model = freeze_network(net);
+
+  size_t pruned = prune_network(net, sparsity);
+  printf("Pruned %zu weights, accuracy %d / %zu before fine tuning\n",
+            pruned, evaluate(net, test_set), test_set->total);
+  if (epochs > 0) {
+    stochastic_gradient_descent(net, train_set, test_set, MINI_BATCH_SIZE, epochs, ETA);
+  }
+  sparse_model_t *smodel = export_sparse_model(net);
+  printf("dense %zu bytes, CSR %zu bytes\n",
+            model->params->block->size * sizeof(double), sparse_model_size(smodel));
+
+  size_t batch_sizes[] = {1, EVAL_BATCH_SIZE};
+  for (int b = 0; b < 2; b++) {
+    double secs, ssecs;
+    int correct = predict_set(model, NULL, NULL, test_set, batch_sizes[b], &secs);
+    int scorrect = predict_set(NULL, NULL, smodel, test_set, batch_sizes[b], &ssecs);
+    printf("batch %4zu: dense %d / %zu in %.2f us/image, pruned %d / %zu in %.2f us/image, "
+              "%.2fx faster\n", batch_sizes[b], correct, test_set->total,
+              secs * 1e6 / test_set->total, scorrect, test_set->total,
+              ssecs * 1e6 / test_set->total, secs / ssecs);
+  }
+
+  free_sparse_model(smodel);
+  free_model(model);
+  free_network(net);
+  set_loader_free(train_set);
+  set_loader_free(test_set);
+  return 0;
+}
@@ -1,5 +1,7 @@
 #include "mnist.h"
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
 
 /*
   verify_data checks that the relevant data files are available.
@@ -48,101 +50,243 @@ bool verify_data() {
 }
 
 /*
-  init_set_loader initializes the set loader with the data and respective labels
+  map_idx maps an IDX file read-only and checks its magic number and that
+  it holds at least min_size bytes
+*/
+static uint8_t *map_idx(const char *file, int magic_number, size_t min_size, size_t *map_size) {
+  struct stat st;
+  uint32_t magic;
+  int fd = Open(file, O_RDONLY, 0);
+  Fstat(fd, &st);
+  if ((size_t)st.st_size < min_size) app_error("IDX file is truncated");
+  uint8_t *map = (uint8_t*) Mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  Close(fd);
+  memcpy(&magic, map, 4);
+  if (ntohl(magic) != magic_number) app_error("bad IDX magic number");
+  *map_size = st.st_size;
+  return map;
+}
+
+/*
+  idx_field reads the big endian 32 bit header field at offset
+*/
+static size_t idx_field(uint8_t *map, size_t offset) {
+  uint32_t field;
+  memcpy(&field, map + offset, 4);
+  return ntohl(field);
+}
+
+/*
+  init_set_loader initializes the set loader with the data and respective labels.
+  Both files are mapped read-only, the images point straight into the
+  mapping, so loading does not copy the data and concurrent trainers share
+  the page cache.
 */
 set_loader_t *init_set_loader(const char *data_file, const char *label_file) {
-  int images_fd;
-  int labels_fd;
-  int num_images;
-  int num_labels;
-  int width, height;
-  size_t image_data_size;
-  uint8_t *image_data;
+  size_t image_map_size, label_map_size;
+  uint8_t *image_map, *label_map;
+  size_t num_images, num_labels;
+  size_t width, height;
   set_loader_t *set;
-  image_t *image;
-
 
   printf("%s\n", "Initializing set loader");
 
   // READ DATA HEADER
   printf("\n%s\n", "Reading data header");
-  images_fd = open(data_file, O_RDONLY, 0);
-  lseek(images_fd, 4, SEEK_SET); // read past magic number
-  read(images_fd, &num_images, 4); // read sizes
-  read(images_fd, &height, 4);
-  read(images_fd, &width, 4);
-  // fix endian-ness
-  num_images = htonl(num_images);
-  width = htonl(width);
-  height = htonl(height);
-  printf("Number of images: %d\n", num_images);
-  printf("Image height: %d\n", height);
-  printf("Image width: %d\n", width);
+  image_map = map_idx(data_file, TRAIN_IMAGES_MN, IDX_IMAGES_HEADER, &image_map_size);
+  num_images = idx_field(image_map, 4);
+  height = idx_field(image_map, 8);
+  width = idx_field(image_map, 12);
+  printf("Number of images: %zu\n", num_images);
+  printf("Image height: %zu\n", height);
+  printf("Image width: %zu\n", width);
+  // the header fields are untrusted, divide instead of multiplying them
+  if (width == 0 || height == 0 || width > SIZE_MAX / height) app_error("bad image size");
+  if (num_images > INT_MAX) app_error("too many images");
+  if (num_images > (image_map_size - IDX_IMAGES_HEADER) / (width * height)) {
+    app_error("image file is truncated");
+  }
 
   // READ LABEL HEADER
   printf("\n%s\n", "Reading label header");
-  labels_fd = open(label_file, O_RDONLY, 0);
-  lseek(labels_fd, 4, SEEK_SET);
-  read(labels_fd, &num_labels, 4); // read labels
-  // fix endian-ness
-  num_labels = htonl(num_labels);
-  printf("Number of labels: %d\n", num_labels);
-  assert(num_labels == num_images);
-
-  // READ IMAGE DATA
-  image_data_size = width * height * num_images * sizeof(uint8_t);
-  image_data = (uint8_t*) malloc(image_data_size);
-  read(images_fd, image_data, image_data_size);
+  label_map = map_idx(label_file, TRAIN_LABELS_MN, IDX_LABELS_HEADER, &label_map_size);
+  num_labels = idx_field(label_map, 4);
+  printf("Number of labels: %zu\n", num_labels);
+  if (num_labels != num_images) app_error("label and image counts differ");
+  if (num_labels > label_map_size - IDX_LABELS_HEADER) app_error("label file is truncated");
 
   // INITIALIZE SET LOADER
-  set = (set_loader_t*) malloc(sizeof(set_loader_t));
+  set = (set_loader_t*) Malloc(sizeof(set_loader_t));
   set->idx = 0;
   set->total = num_images;
   set->width = width;
   set->height = height;
   set->data_size = width * height * num_images * sizeof(uint8_t);
-  set->data = image_data;
-  set->images = (image_t**) malloc(sizeof(image_t*)*num_images);
-  for (int i = 0; i < num_images; i++) {
-    image = (image_t*) malloc(sizeof(image_t));
-    read(labels_fd, &(image->label), 1);
-    assert(0 <= image->label && image->label <= 9);
-    image->data = &(image_data[(width*height)*i]);
-    set->images[i] = image;
+  set->data = image_map + IDX_IMAGES_HEADER;
+  set->labels = label_map + IDX_LABELS_HEADER;
+  set->image_map = image_map;
+  set->image_map_size = image_map_size;
+  set->label_map = label_map;
+  set->label_map_size = label_map_size;
+  for (size_t i = 0; i < num_images; i++) {
+    if (set->labels[i] >= NUM_CLASSES) app_error("bad label");
   }
-  set->access_order = (int*) malloc(sizeof(int) * num_images);
+  set->access_order = (int*) Malloc(sizeof(int) * num_images);
   for (int i = 0; i < num_images; i++) {
     set->access_order[i] = i;
   }
-  close(labels_fd);
-  close(images_fd);
+  set->mode = LOADER_UINT8;
+  set->cache = NULL;
+  set->targets = NULL;
+  set->cache_float = NULL;
+  set->targets_float = NULL;
+  set->nz_start = NULL;
+  set->nz_index = NULL;
+  set->nz_max = 0;
+  // start reading the images in ahead of the first epoch
+  set_loader_advise(set, MADV_WILLNEED);
   return set;
 }
 
+/*
+  set_loader_advise passes a madvise hint for the image data, MADV_RANDOM
+  while training on a shuffled order, MADV_SEQUENTIAL for a single pass or
+  MADV_WILLNEED to read the set in ahead of use
+*/
+void set_loader_advise(set_loader_t *set, int advice) {
+  if (madvise(set->image_map, set->image_map_size, advice) < 0) {
+    unix_error("madvise error");
+  }
+}
+
+/*
+  set_loader_cache switches the loader to mode. The cache modes convert
+  every image once into a contiguous row of scaled pixels and every label
+  into a one-hot row, so building a batch no longer converts anything.
+  LOADER_UINT8 drops the cache for hosts short on memory. It returns the
+  size of the cache in bytes.
+*/
+size_t set_loader_cache(set_loader_t *set, int mode) {
+  size_t len = set->width * set->height;
+  size_t size = 0;
+  free(set->cache);
+  free(set->targets);
+  free(set->cache_float);
+  free(set->targets_float);
+  set->cache = NULL;
+  set->targets = NULL;
+  set->cache_float = NULL;
+  set->targets_float = NULL;
+  set->mode = mode;
+
+  if (mode == LOADER_CACHE_DOUBLE) {
+    size = set->total * (len + NUM_CLASSES) * sizeof(double);
+    set->cache = (double*) Malloc(set->total * len * sizeof(double));
+    set->targets = (double*) Calloc(set->total * NUM_CLASSES, sizeof(double));
+    for (size_t k = 0; k < set->total; k++) {
+      for (size_t i = 0; i < len; i++) {
+        set->cache[k * len + i] = PIXEL_SCALE * set->data[k * len + i];
+      }
+      set->targets[k * NUM_CLASSES + set->labels[k]] = 1;
+    }
+  } else if (mode == LOADER_CACHE_FLOAT) {
+    size = set->total * (len + NUM_CLASSES) * sizeof(float);
+    set->cache_float = (float*) Malloc(set->total * len * sizeof(float));
+    set->targets_float = (float*) Calloc(set->total * NUM_CLASSES, sizeof(float));
+    for (size_t k = 0; k < set->total; k++) {
+      for (size_t i = 0; i < len; i++) {
+        set->cache_float[k * len + i] = (float)(PIXEL_SCALE * set->data[k * len + i]);
+      }
+      set->targets_float[k * NUM_CLASSES + set->labels[k]] = 1;
+    }
+  } else {
+    assert(mode == LOADER_UINT8);
+  }
+  if (size) {
+    printf("Caching %zu x %zu inputs as %s: %.1f MB\n", set->total, len,
+              (mode == LOADER_CACHE_DOUBLE) ? "double" : "float", size / 1e6);
+  }
+  return size;
+}
+
+/*
+  set_loader_sparse indexes the nonzero pixels of every image, so batches
+  can be built as sparse inputs that skip the background. It returns the
+  number of nonzero pixels in the set.
+*/
+size_t set_loader_sparse(set_loader_t *set) {
+  size_t len = set->width * set->height;
+  assert(len <= 65536);
+  free(set->nz_start);
+  free(set->nz_index);
+  set->nz_start = (size_t*) Malloc((set->total + 1) * sizeof(size_t));
+  set->nz_max = 0;
+  size_t nz = 0;
+  for (size_t k = 0; k < set->total; k++) {
+    for (size_t i = 0; i < len; i++) {
+      if (set->data[k * len + i]) nz++;
+    }
+  }
+  set->nz_index = (uint16_t*) Malloc(nz * sizeof(uint16_t));
+  nz = 0;
+  for (size_t k = 0; k < set->total; k++) {
+    set->nz_start[k] = nz;
+    for (size_t i = 0; i < len; i++) {
+      if (set->data[k * len + i]) set->nz_index[nz++] = i;
+    }
+    if (nz - set->nz_start[k] > set->nz_max) set->nz_max = nz - set->nz_start[k];
+  }
+  set->nz_start[set->total] = nz;
+  printf("Indexing nonzero pixels: %.1f%% of %zu x %zu, at most %zu per image\n",
+            100.0 * nz / (set->total * len), set->total, len, set->nz_max);
+  return nz;
+}
+
 /*
   set_loader_free frees a set_loader_t
 */
 void set_loader_free(set_loader_t *set) {
-  for (int i = 0; i < set->total; i++) {
-    free(set->images[i]);
-  }
+  set_loader_cache(set, LOADER_UINT8);
+  free(set->nz_start);
+  free(set->nz_index);
   free(set->access_order);
-  free(set->images);
-  free(set->data);
+  Munmap(set->image_map, set->image_map_size);
+  Munmap(set->label_map, set->label_map_size);
   free(set);
 }
 
 /*
-  set_loader_free gets the next image_t from the set loader in
-  sequential order from data file.
+  get_next_image gets the next image_t from the set loader in the access
+  order, its data is NULL once the set is exhausted
+*/
+image_t get_next_image(set_loader_t *set) {
+  image_t img = {NULL, 0};
+  if (set->idx >= set->total) return img; // reached the end
+  return get_image(set, set->idx++);
+}
+
+/*
+  get_image returns the image at position i of the access order without
+  moving the loader, so several threads can read disjoint positions
 */
-image_t *get_next_image(set_loader_t *set) {
-  image_t *img;
-  if (set->idx >= set->total) return NULL; // reached the end
-  img = set->images[set->access_order[set->idx++]];
+image_t get_image(set_loader_t *set, size_t i) {
+  assert(i < set->total);
+  size_t k = set->access_order[i];
+  image_t img = {set->data + k * set->width * set->height, set->labels[k]};
   return img;
 }
 
+/*
+  get_batch returns the indices of the n images at positions first and on
+  of the access order. The indices point into the access order and stay
+  valid until the next shuffle, image k has its pixels at
+  data[k * width * height] and its label at labels[k].
+*/
+const int *get_batch(set_loader_t *set, size_t first, size_t n) {
+  assert(first + n <= set->total);
+  return set->access_order + first;
+}
+
 /*
   shuffle randomizes the access order of the images
 */
@@ -78,6 +78,23 @@ Pixels are organized row-wise. Pixel values are 0 to 255. 0 means background
 #define TEST_LABELS "data/t10k-labels.idx1-ubyte"
 #define TEST_LABELS_MN 0x00000801
 
+// bytes before the first pixel and the first label of an IDX file
+#define IDX_IMAGES_HEADER 16
+#define IDX_LABELS_HEADER 8
+
+#define NUM_CLASSES 10
+// inputs are scaled from 0..255 to 0..1
+#define PIXEL_SCALE (1.0 / 255.0)
+
+// how a set loader hands out inputs, see set_loader_cache
+#define LOADER_UINT8 0        // convert the mapped pixels for every batch
+#define LOADER_CACHE_DOUBLE 1 // keep scaled double rows of the whole set
+#define LOADER_CACHE_FLOAT 2  // keep scaled float rows of the whole set
+
+/*
+  An image is a view of one sample of a set loader, data points into the
+  mapped pixels
+*/
 typedef struct image {
   uint8_t *data;      // image data
   uint8_t label;      // image label
@@ -86,18 +103,35 @@ typedef struct image {
 typedef struct set_loader {
   size_t idx;         // current image
   size_t total;       // total number of images
-  uint8_t *data;      // image data
-  image_t **images;   // images structures
+  uint8_t *data;      // pixels of every image back to back, inside image_map
+  uint8_t *labels;    // label of every image, inside label_map
   int *access_order;  // randomized indeces
   size_t data_size;   // data size
   size_t height;      // height of each image (pixels)
   size_t width;       // width of each image (pixels)
+  void *image_map;    // read-only mapping of the image file
+  size_t image_map_size;
+  void *label_map;    // read-only mapping of the label file
+  size_t label_map_size;
+  int mode;               // LOADER_UINT8 or one of the cache modes
+  double *cache;          // one scaled row per image (LOADER_CACHE_DOUBLE)
+  double *targets;        // one one-hot row per image (LOADER_CACHE_DOUBLE)
+  float *cache_float;     // one scaled row per image (LOADER_CACHE_FLOAT)
+  float *targets_float;   // one one-hot row per image (LOADER_CACHE_FLOAT)
+  size_t *nz_start;       // image k has the nonzero pixels nz_index[nz_start[k]..nz_start[k+1])
+  uint16_t *nz_index;     // see set_loader_sparse, NULL when not indexed
+  size_t nz_max;          // most nonzero pixels of any image
 } set_loader_t;
 
 bool verify_data();
 set_loader_t *init_set_loader(const char *data_file, const char *label_file);
 void set_loader_free(set_loader_t *set);
-image_t *get_next_image(set_loader_t *set);
+void set_loader_advise(set_loader_t *set, int advice);
+size_t set_loader_cache(set_loader_t *set, int mode);
+size_t set_loader_sparse(set_loader_t *set);
+image_t get_next_image(set_loader_t *set);
+image_t get_image(set_loader_t *set, size_t i);
+const int *get_batch(set_loader_t *set, size_t first, size_t n);
 void shuffle(set_loader_t *set);
 void image_print(image_t *img, int dim);
 
@@ -0,0 +1,207 @@
+#include "network.h"
+#include <limits.h>
+
+/*
+  A checkpoint is a checkpoint_header_t followed, at the next SLAB_ALIGN
+  boundary, by the raw parameter slab of the network in native byte order.
+  save_network writes it with one fwrite per part and renames it into
+  place, load_network maps the file copy-on-write and builds the parameter
+  slab straight over the mapping, so loading costs a page fault per
+  touched page and nothing else.
+*/
+
+static size_t checkpoint_params_offset() {
+  return (sizeof(checkpoint_header_t) + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+}
+
+/*
+  checkpoint_fits checks that the slab of the given layers holds at most
+  max_values values, without overflowing on untrusted layer sizes
+*/
+static bool checkpoint_fits(int layers[], int num_layers, size_t max_values) {
+  size_t align = SLAB_ALIGN / sizeof(double);
+  size_t size = 0;
+  for (int l = 1; l < num_layers; l++) {
+    size_t w = (size_t)layers[l] * layers[l-1]; // below 2^62
+    if (w > max_values - size) return false;
+    size += (w + align - 1) / align * align;
+    if (size > max_values) return false;
+  }
+  for (int l = 1; l < num_layers; l++) {
+    if ((size_t)layers[l] > max_values - size) return false;
+    size += (layers[l] + align - 1) / align * align;
+    if (size > max_values) return false;
+  }
+  return true;
+}
+
+/*
+  save_network writes a checkpoint of net to path, it returns 0 on success
+  and -1 if the file could not be written. It writes and syncs path.tmp
+  first and renames it over path, so a crash never leaves a torn
+  checkpoint behind.
+*/
+int save_network(network_t *net, const char *path) {
+  char pad[SLAB_ALIGN] = {0};
+  checkpoint_header_t h;
+  if (net->activation->id == ACTIVATION_CUSTOM || net->cost->id == COST_CUSTOM) {
+    fprintf(stderr, "%s\n", "custom activation and cost functions can not be saved");
+    return -1;
+  }
+  memset(&h, 0, sizeof(h));
+  h.magic = CHECKPOINT_MAGIC;
+  h.version = CHECKPOINT_VERSION;
+  h.dtype = DTYPE_FLOAT64;
+  h.activation = net->activation->id;
+  h.cost = net->cost->id;
+  h.optimizer = net->optimizer;
+  h.num_layers = net->num_layers;
+  for (int l = 0; l < net->num_layers; l++) h.layers[l] = net->layers[l];
+  h.params_offset = checkpoint_params_offset();
+  h.params_size = net->params->block->size * sizeof(double);
+
+  char tmp[MAXLINE];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return -1;
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL) return -1;
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+            && fwrite(pad, h.params_offset - sizeof(h), 1, f) == 1
+            && fwrite(net->params->block->data, h.params_size, 1, f) == 1
+            && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  if (fclose(f) != 0) ok = false;
+  if (ok && rename(tmp, path) == 0) return 0;
+  unlink(tmp);
+  return -1;
+}
+
+/*
+  map_checkpoint validates the checkpoint at path and maps its parameter
+  slab with the given protection and flags. It returns the slab, which
+  unmaps the file when freed, and leaves the header in h, or returns NULL
+  if the file is not a checkpoint this build can read.
+*/
+static slab_t *map_checkpoint(const char *path, checkpoint_header_t *h, int prot, int flags) {
+  struct stat st;
+  int layers[MAX_LAYERS];
+  int fd = open(path, O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  Fstat(fd, &st);
+  // every header field is untrusted, compare sizes without adding them
+  if ((size_t)st.st_size < sizeof(*h) || read(fd, h, sizeof(*h)) != sizeof(*h)
+      || h->magic != CHECKPOINT_MAGIC || h->version != CHECKPOINT_VERSION
+      || h->dtype != DTYPE_FLOAT64 || h->num_layers < 2 || h->num_layers > MAX_LAYERS
+      || h->params_offset < sizeof(*h) || h->params_offset % SLAB_ALIGN != 0
+      || h->params_offset > (uint64_t)st.st_size
+      || h->params_size > (uint64_t)st.st_size - h->params_offset) {
+    fprintf(stderr, "%s: %s\n", path, "not a readable checkpoint");
+    Close(fd);
+    return NULL;
+  }
+  for (int l = 0; l < h->num_layers; l++) {
+    if (h->layers[l] == 0 || h->layers[l] > INT_MAX) {
+      fprintf(stderr, "%s: %s\n", path, "bad layer size");
+      Close(fd);
+      return NULL;
+    }
+    layers[l] = h->layers[l];
+  }
+  if (!checkpoint_fits(layers, h->num_layers, h->params_size / sizeof(double))
+      || slab_size(layers, h->num_layers) * sizeof(double) != h->params_size) {
+    fprintf(stderr, "%s: %s\n", path, "parameters do not match the topology");
+    Close(fd);
+    return NULL;
+  }
+
+  void *map = Mmap(NULL, st.st_size, prot, flags, fd, 0);
+  Close(fd);
+  gsl_block *block = (gsl_block*) malloc(sizeof(gsl_block));
+  block->size = slab_size(layers, h->num_layers);
+  block->data = (double*)((char*)map + h->params_offset);
+  slab_t *params = init_slab_from_block(layers, h->num_layers, block);
+  params->map = map;
+  params->map_size = st.st_size;
+  return params;
+}
+
+/*
+  load_network maps the checkpoint at path and returns a network that uses
+  the mapped parameters in place. Training the network only copies the
+  pages it writes, the file is never modified. It returns NULL if the file
+  is not a checkpoint this build can read.
+*/
+network_t *load_network(const char *path) {
+  checkpoint_header_t h;
+  slab_t *params = map_checkpoint(path, &h, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+  if (params == NULL) return NULL;
+  af_t *activation = activation_from_id(h.activation);
+  cf_t *cost = cost_from_id(h.cost);
+  if (activation == NULL || cost == NULL) {
+    fprintf(stderr, "%s: %s\n", path, "unknown activation or cost function");
+    free(activation);
+    free(cost);
+    free_slab(params);
+    return NULL;
+  }
+
+  int layers[MAX_LAYERS];
+  for (int l = 0; l < h.num_layers; l++) layers[l] = h.layers[l];
+  network_t *net = alloc_network(layers, h.num_layers, activation, cost);
+  net->optimizer = h.optimizer;
+  net->params = params;
+  net->weights = net->params->weights->data;
+  net->biases = net->params->biases->data;
+  init_network_buffers(net);
+  return net;
+}
+
+/*
+  load_model maps the checkpoint at path read-only and shared, so every
+  model and every process loading the same file uses one copy of the
+  weights in the page cache. It returns NULL if the file is not a
+  checkpoint this build can read.
+*/
+model_t *load_model(const char *path) {
+  checkpoint_header_t h;
+  slab_t *params = map_checkpoint(path, &h, PROT_READ, MAP_SHARED);
+  if (params == NULL) return NULL;
+  af_t *activation = activation_from_id(h.activation);
+  if (activation == NULL) {
+    fprintf(stderr, "%s: %s\n", path, "unknown activation function");
+    free_slab(params);
+    return NULL;
+  }
+  int layers[MAX_LAYERS];
+  for (int l = 0; l < h.num_layers; l++) layers[l] = h.layers[l];
+  model_t *m = init_model(layers, h.num_layers, activation, params);
+  m->softmax = (h.cost == COST_SOFTMAX_CROSS_ENTROPY);
+  return m;
+}
+
+/*
+  activation_from_id returns a new af_t for an ACTIVATION_* id, or NULL
+  for ACTIVATION_CUSTOM and unknown ids
+*/
+af_t *activation_from_id(int id) {
+  switch (id) {
+    case ACTIVATION_SIGMOID: return use_sigmoid();
+    case ACTIVATION_RELU: return use_relu();
+    case ACTIVATION_FAST_SIGMOID: return use_fast_sigmoid();
+    default: return NULL;
+  }
+}
+
+/*
+  cost_from_id returns a new cf_t for a COST_* id, or NULL for COST_CUSTOM
+  and unknown ids
+*/
+cf_t *cost_from_id(int id) {
+  switch (id) {
+    case COST_QUAD: return use_quad_cost();
+    case COST_CROSS_ENTROPY: return use_cross_entropy_cost();
+    case COST_SOFTMAX_CROSS_ENTROPY: return use_softmax_cross_entropy_cost();
+    default: return NULL;
+  }
+}
@@ -0,0 +1,1004 @@
+#include "network.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86
+#endif
+
+/*
+  Fused kernels for the inner loops of the network. Each row kernel adds
+  the bias to one row of a layer's outputs, applies the activation and
+  optionally writes its derivative in a single pass over contiguous memory.
+  The instruction set is picked once at runtime, the environment variable
+  ANNC_ISA (scalar, avx2, avx512) can force a narrower one.
+*/
+
+typedef void (*row_kernel_t)(double *z, double *a, double *sp, double b, size_t n);
+typedef void (*row_kernel_float_t)(float *z, float *a, float *sp, float b, size_t n);
+
+static int isa = -1;
+
+/*
+  kernel_isa returns the widest instruction set supported by the cpu
+*/
+int kernel_isa() {
+  if (isa >= 0) return isa;
+  isa = ISA_SCALAR;
+#ifdef KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) isa = ISA_AVX2;
+  if (__builtin_cpu_supports("avx512f")) isa = ISA_AVX512;
+#endif
+  char *force = getenv("ANNC_ISA");
+  if (force != NULL) {
+    if (!strcmp(force, "scalar")) isa = ISA_SCALAR;
+    else if (!strcmp(force, "avx2") && isa >= ISA_AVX2) isa = ISA_AVX2;
+  }
+  return isa;
+}
+
+// BEGIN FAST MATH
+
+/*
+  fast_exp approximates exp(x) by reducing x = n*ln(2) + r with |r| <= ln(2)/2
+  and evaluating a degree 7 polynomial in r, then scaling by 2^n. The
+  relative error is below 6e-9 for |x| <= FAST_EXP_LIMIT, inputs beyond
+  the limit are clamped. The vector kernels below use the same scheme.
+*/
+#define LOG2E 1.4426950408889634
+#define LN2_HI 0.693145751953125
+#define LN2_LO 1.42860682030941723212e-6
+#define EXP_C2 (1.0/2.0)
+#define EXP_C3 (1.0/6.0)
+#define EXP_C4 (1.0/24.0)
+#define EXP_C5 (1.0/120.0)
+#define EXP_C6 (1.0/720.0)
+#define EXP_C7 (1.0/5040.0)
+
+double fast_exp(double x) {
+  if (x > FAST_EXP_LIMIT) x = FAST_EXP_LIMIT;
+  if (x < -FAST_EXP_LIMIT) x = -FAST_EXP_LIMIT;
+  double t = x * LOG2E;
+  long k = (long)(t + ((t >= 0) ? 0.5 : -0.5));
+  double n = (double)k;
+  double r = (x - n * LN2_HI) - n * LN2_LO;
+  double p = EXP_C7;
+  p = p * r + EXP_C6;
+  p = p * r + EXP_C5;
+  p = p * r + EXP_C4;
+  p = p * r + EXP_C3;
+  p = p * r + EXP_C2;
+  p = p * r + 1.0;
+  p = p * r + 1.0;
+  // 2^k built directly in the exponent bits
+  union { uint64_t i; double d; } scale = { (uint64_t)(k + 1023) << 52 };
+  return p * scale.d;
+}
+
+/*
+  fast_exp_float is fast_exp in single precision with a degree 6 polynomial
+*/
+float fast_exp_float(float x) {
+  if (x > FAST_EXP_LIMIT) x = FAST_EXP_LIMIT;
+  if (x < -FAST_EXP_LIMIT) x = -FAST_EXP_LIMIT;
+  float t = x * (float)LOG2E;
+  int k = (int)(t + ((t >= 0) ? 0.5f : -0.5f));
+  float n = (float)k;
+  float r = (x - n * (float)LN2_HI) - n * (float)LN2_LO;
+  float p = (float)EXP_C6;
+  p = p * r + (float)EXP_C5;
+  p = p * r + (float)EXP_C4;
+  p = p * r + (float)EXP_C3;
+  p = p * r + (float)EXP_C2;
+  p = p * r + 1.0f;
+  p = p * r + 1.0f;
+  union { uint32_t i; float f; } scale = { (uint32_t)(k + 127) << 23 };
+  return p * scale.f;
+}
+
+// BEGIN SCALAR KERNELS
+
+static void sigmoid_row(double *z, double *a, double *sp, double b, size_t n) {
+  for (size_t j = 0; j < n; j++) {
+    double x = z[j] + b;
+    double s = 1.0 / (1.0 + exp(-x));
+    z[j] = x;
+    a[j] = s;
+    if (sp) sp[j] = s * (1.0 - s);
+  }
+}
+
+static void fast_sigmoid_row(double *z, double *a, double *sp, double b, size_t n) {
+  for (size_t j = 0; j < n; j++) {
+    double x = z[j] + b;
+    double s = 1.0 / (1.0 + fast_exp(-x));
+    z[j] = x;
+    a[j] = s;
+    if (sp) sp[j] = s * (1.0 - s);
+  }
+}
+
+static void relu_row(double *z, double *a, double *sp, double b, size_t n) {
+  for (size_t j = 0; j < n; j++) {
+    double x = z[j] + b;
+    z[j] = x;
+    a[j] = (x > 0.0) ? x : 0;
+    if (sp) sp[j] = (x > 0.0) ? 1 : 0;
+  }
+}
+
+static void sigmoid_row_float(float *z, float *a, float *sp, float b, size_t n) {
+  for (size_t j = 0; j < n; j++) {
+    float x = z[j] + b;
+    float s = 1.0f / (1.0f + expf(-x));
+    z[j] = x;
+    a[j] = s;
+    if (sp) sp[j] = s * (1.0f - s);
+  }
+}
+
+static void fast_sigmoid_row_float(float *z, float *a, float *sp, float b, size_t n) {
+  for (size_t j = 0; j < n; j++) {
+    float x = z[j] + b;
+    float s = 1.0f / (1.0f + fast_exp_float(-x));
+    z[j] = x;
+    a[j] = s;
+    if (sp) sp[j] = s * (1.0f - s);
+  }
+}
+
+static void relu_row_float(float *z, float *a, float *sp, float b, size_t n) {
+  for (size_t j = 0; j < n; j++) {
+    float x = z[j] + b;
+    z[j] = x;
+    a[j] = (x > 0.0f) ? x : 0;
+    if (sp) sp[j] = (x > 0.0f) ? 1 : 0;
+  }
+}
+
+// BEGIN VECTOR KERNELS
+
+#ifdef KERNELS_X86
+
+__attribute__((target("avx2,fma")))
+static inline __m256d exp_avx2(__m256d x) {
+  x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(-FAST_EXP_LIMIT)), _mm256_set1_pd(FAST_EXP_LIMIT));
+  __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(LOG2E)),
+                              _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_HI), x);
+  r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_LO), r);
+  __m256d p = _mm256_set1_pd(EXP_C7);
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C6));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C5));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C4));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C3));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C2));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+  // 2^n built directly in the exponent bits
+  __m256i e = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n));
+  e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+  return _mm256_mul_pd(p, _mm256_castsi256_pd(e));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 exp_float_avx2(__m256 x) {
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-FAST_EXP_LIMIT)), _mm256_set1_ps(FAST_EXP_LIMIT));
+  __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(LOG2E)),
+                             _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_HI), x);
+  r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_LO), r);
+  __m256 p = _mm256_set1_ps(EXP_C6);
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_C5));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_C4));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_C3));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_C2));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.0f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.0f));
+  __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d exp_avx512(__m512d x) {
+  x = _mm512_min_pd(_mm512_max_pd(x, _mm512_set1_pd(-FAST_EXP_LIMIT)), _mm512_set1_pd(FAST_EXP_LIMIT));
+  __m512d n = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(LOG2E)),
+                                   _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512d r = _mm512_fnmadd_pd(n, _mm512_set1_pd(LN2_HI), x);
+  r = _mm512_fnmadd_pd(n, _mm512_set1_pd(LN2_LO), r);
+  __m512d p = _mm512_set1_pd(EXP_C7);
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C6));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C5));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C4));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C3));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C2));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+  return _mm512_scalef_pd(p, n);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 exp_float_avx512(__m512 x) {
+  x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-FAST_EXP_LIMIT)), _mm512_set1_ps(FAST_EXP_LIMIT));
+  __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(LOG2E)),
+                                  _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_HI), x);
+  r = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_LO), r);
+  __m512 p = _mm512_set1_ps(EXP_C6);
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_C5));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_C4));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_C3));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_C2));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.0f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.0f));
+  return _mm512_scalef_ps(p, n);
+}
+
+/*
+  The sigmoid kernels need exp as accurate as libm's. exp_accurate_avx2
+  and exp_accurate_avx512 reduce x like fast_exp but evaluate a degree 12
+  polynomial, whose truncation error for |r| <= ln(2)/2 is below 2e-16, so
+  the result is off by a few ulp at most. Inputs are clamped to
+  +-EXP_LIMIT, past which the sigmoid is 1 or below 1e-307. The single
+  precision versions reach float accuracy with degree 7.
+*/
+#define EXP_LIMIT 708.0
+#define EXP_LIMIT_FLOAT 87.0f
+#define EXP_C8 (1.0/40320.0)
+#define EXP_C9 (1.0/362880.0)
+#define EXP_C10 (1.0/3628800.0)
+#define EXP_C11 (1.0/39916800.0)
+#define EXP_C12 (1.0/479001600.0)
+
+__attribute__((target("avx2,fma")))
+static inline __m256d exp_accurate_avx2(__m256d x) {
+  x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(-EXP_LIMIT)), _mm256_set1_pd(EXP_LIMIT));
+  __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(LOG2E)),
+                              _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_HI), x);
+  r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_LO), r);
+  __m256d p = _mm256_set1_pd(EXP_C12);
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C11));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C10));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C9));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C8));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C7));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C6));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C5));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C4));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C3));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_C2));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+  __m256i e = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n));
+  e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+  return _mm256_mul_pd(p, _mm256_castsi256_pd(e));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 exp_accurate_float_avx2(__m256 x) {
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-EXP_LIMIT_FLOAT)), _mm256_set1_ps(EXP_LIMIT_FLOAT));
+  __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(LOG2E)),
+                             _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_HI), x);
+  r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_LO), r);
+  __m256 p = _mm256_set1_ps(EXP_C7);
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_C6));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_C5));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_C4));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_C3));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_C2));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.0f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.0f));
+  __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d exp_accurate_avx512(__m512d x) {
+  x = _mm512_min_pd(_mm512_max_pd(x, _mm512_set1_pd(-EXP_LIMIT)), _mm512_set1_pd(EXP_LIMIT));
+  __m512d n = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(LOG2E)),
+                                   _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512d r = _mm512_fnmadd_pd(n, _mm512_set1_pd(LN2_HI), x);
+  r = _mm512_fnmadd_pd(n, _mm512_set1_pd(LN2_LO), r);
+  __m512d p = _mm512_set1_pd(EXP_C12);
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C11));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C10));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C9));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C8));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C7));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C6));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C5));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C4));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C3));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_C2));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+  return _mm512_scalef_pd(p, n);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 exp_accurate_float_avx512(__m512 x) {
+  x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-EXP_LIMIT_FLOAT)), _mm512_set1_ps(EXP_LIMIT_FLOAT));
+  __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(LOG2E)),
+                                  _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_HI), x);
+  r = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_LO), r);
+  __m512 p = _mm512_set1_ps(EXP_C7);
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_C6));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_C5));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_C4));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_C3));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_C2));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.0f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.0f));
+  return _mm512_scalef_ps(p, n);
+}
+
+__attribute__((target("avx2,fma")))
+static void fast_sigmoid_row_avx2(double *z, double *a, double *sp, double b, size_t n) {
+  __m256d vb = _mm256_set1_pd(b);
+  __m256d one = _mm256_set1_pd(1.0);
+  size_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    __m256d x = _mm256_add_pd(_mm256_loadu_pd(z + j), vb);
+    __m256d s = _mm256_div_pd(one, _mm256_add_pd(one, exp_avx2(_mm256_sub_pd(_mm256_setzero_pd(), x))));
+    _mm256_storeu_pd(z + j, x);
+    _mm256_storeu_pd(a + j, s);
+    if (sp) _mm256_storeu_pd(sp + j, _mm256_mul_pd(s, _mm256_sub_pd(one, s)));
+  }
+  // gcc leaves the upper halves dirty before the tail call, the scalar
+  // tail would pay the sse transition penalty on every instruction
+  _mm256_zeroupper();
+  fast_sigmoid_row(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+__attribute__((target("avx2,fma")))
+static void fast_sigmoid_row_float_avx2(float *z, float *a, float *sp, float b, size_t n) {
+  __m256 vb = _mm256_set1_ps(b);
+  __m256 one = _mm256_set1_ps(1.0f);
+  size_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m256 x = _mm256_add_ps(_mm256_loadu_ps(z + j), vb);
+    __m256 s = _mm256_div_ps(one, _mm256_add_ps(one, exp_float_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x))));
+    _mm256_storeu_ps(z + j, x);
+    _mm256_storeu_ps(a + j, s);
+    if (sp) _mm256_storeu_ps(sp + j, _mm256_mul_ps(s, _mm256_sub_ps(one, s)));
+  }
+  _mm256_zeroupper();
+  fast_sigmoid_row_float(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+__attribute__((target("avx512f")))
+static void fast_sigmoid_row_avx512(double *z, double *a, double *sp, double b, size_t n) {
+  __m512d vb = _mm512_set1_pd(b);
+  __m512d one = _mm512_set1_pd(1.0);
+  size_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m512d x = _mm512_add_pd(_mm512_loadu_pd(z + j), vb);
+    __m512d s = _mm512_div_pd(one, _mm512_add_pd(one, exp_avx512(_mm512_sub_pd(_mm512_setzero_pd(), x))));
+    _mm512_storeu_pd(z + j, x);
+    _mm512_storeu_pd(a + j, s);
+    if (sp) _mm512_storeu_pd(sp + j, _mm512_mul_pd(s, _mm512_sub_pd(one, s)));
+  }
+  _mm256_zeroupper();
+  fast_sigmoid_row(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+__attribute__((target("avx512f")))
+static void fast_sigmoid_row_float_avx512(float *z, float *a, float *sp, float b, size_t n) {
+  __m512 vb = _mm512_set1_ps(b);
+  __m512 one = _mm512_set1_ps(1.0f);
+  size_t j = 0;
+  for (; j + 16 <= n; j += 16) {
+    __m512 x = _mm512_add_ps(_mm512_loadu_ps(z + j), vb);
+    __m512 s = _mm512_div_ps(one, _mm512_add_ps(one, exp_float_avx512(_mm512_sub_ps(_mm512_setzero_ps(), x))));
+    _mm512_storeu_ps(z + j, x);
+    _mm512_storeu_ps(a + j, s);
+    if (sp) _mm512_storeu_ps(sp + j, _mm512_mul_ps(s, _mm512_sub_ps(one, s)));
+  }
+  _mm256_zeroupper();
+  fast_sigmoid_row_float(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+__attribute__((target("avx2,fma")))
+static void sigmoid_row_avx2(double *z, double *a, double *sp, double b, size_t n) {
+  __m256d vb = _mm256_set1_pd(b);
+  __m256d one = _mm256_set1_pd(1.0);
+  size_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    __m256d x = _mm256_add_pd(_mm256_loadu_pd(z + j), vb);
+    __m256d s = _mm256_div_pd(one, _mm256_add_pd(one, exp_accurate_avx2(_mm256_sub_pd(_mm256_setzero_pd(), x))));
+    _mm256_storeu_pd(z + j, x);
+    _mm256_storeu_pd(a + j, s);
+    if (sp) _mm256_storeu_pd(sp + j, _mm256_mul_pd(s, _mm256_sub_pd(one, s)));
+  }
+  _mm256_zeroupper();
+  sigmoid_row(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+__attribute__((target("avx2,fma")))
+static void sigmoid_row_float_avx2(float *z, float *a, float *sp, float b, size_t n) {
+  __m256 vb = _mm256_set1_ps(b);
+  __m256 one = _mm256_set1_ps(1.0f);
+  size_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m256 x = _mm256_add_ps(_mm256_loadu_ps(z + j), vb);
+    __m256 s = _mm256_div_ps(one, _mm256_add_ps(one, exp_accurate_float_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x))));
+    _mm256_storeu_ps(z + j, x);
+    _mm256_storeu_ps(a + j, s);
+    if (sp) _mm256_storeu_ps(sp + j, _mm256_mul_ps(s, _mm256_sub_ps(one, s)));
+  }
+  _mm256_zeroupper();
+  sigmoid_row_float(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+__attribute__((target("avx512f")))
+static void sigmoid_row_avx512(double *z, double *a, double *sp, double b, size_t n) {
+  __m512d vb = _mm512_set1_pd(b);
+  __m512d one = _mm512_set1_pd(1.0);
+  size_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m512d x = _mm512_add_pd(_mm512_loadu_pd(z + j), vb);
+    __m512d s = _mm512_div_pd(one, _mm512_add_pd(one, exp_accurate_avx512(_mm512_sub_pd(_mm512_setzero_pd(), x))));
+    _mm512_storeu_pd(z + j, x);
+    _mm512_storeu_pd(a + j, s);
+    if (sp) _mm512_storeu_pd(sp + j, _mm512_mul_pd(s, _mm512_sub_pd(one, s)));
+  }
+  _mm256_zeroupper();
+  sigmoid_row(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+__attribute__((target("avx512f")))
+static void sigmoid_row_float_avx512(float *z, float *a, float *sp, float b, size_t n) {
+  __m512 vb = _mm512_set1_ps(b);
+  __m512 one = _mm512_set1_ps(1.0f);
+  size_t j = 0;
+  for (; j + 16 <= n; j += 16) {
+    __m512 x = _mm512_add_ps(_mm512_loadu_ps(z + j), vb);
+    __m512 s = _mm512_div_ps(one, _mm512_add_ps(one, exp_accurate_float_avx512(_mm512_sub_ps(_mm512_setzero_ps(), x))));
+    _mm512_storeu_ps(z + j, x);
+    _mm512_storeu_ps(a + j, s);
+    if (sp) _mm512_storeu_ps(sp + j, _mm512_mul_ps(s, _mm512_sub_ps(one, s)));
+  }
+  _mm256_zeroupper();
+  sigmoid_row_float(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+__attribute__((target("avx2,fma")))
+static void relu_row_avx2(double *z, double *a, double *sp, double b, size_t n) {
+  __m256d vb = _mm256_set1_pd(b);
+  __m256d zero = _mm256_setzero_pd();
+  __m256d one = _mm256_set1_pd(1.0);
+  size_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    __m256d x = _mm256_add_pd(_mm256_loadu_pd(z + j), vb);
+    _mm256_storeu_pd(z + j, x);
+    _mm256_storeu_pd(a + j, _mm256_max_pd(x, zero));
+    if (sp) _mm256_storeu_pd(sp + j, _mm256_and_pd(_mm256_cmp_pd(x, zero, _CMP_GT_OQ), one));
+  }
+  relu_row(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+__attribute__((target("avx2,fma")))
+static void relu_row_float_avx2(float *z, float *a, float *sp, float b, size_t n) {
+  __m256 vb = _mm256_set1_ps(b);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.0f);
+  size_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m256 x = _mm256_add_ps(_mm256_loadu_ps(z + j), vb);
+    _mm256_storeu_ps(z + j, x);
+    _mm256_storeu_ps(a + j, _mm256_max_ps(x, zero));
+    if (sp) _mm256_storeu_ps(sp + j, _mm256_and_ps(_mm256_cmp_ps(x, zero, _CMP_GT_OQ), one));
+  }
+  relu_row_float(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+__attribute__((target("avx512f")))
+static void relu_row_avx512(double *z, double *a, double *sp, double b, size_t n) {
+  __m512d vb = _mm512_set1_pd(b);
+  __m512d zero = _mm512_setzero_pd();
+  __m512d one = _mm512_set1_pd(1.0);
+  size_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m512d x = _mm512_add_pd(_mm512_loadu_pd(z + j), vb);
+    _mm512_storeu_pd(z + j, x);
+    _mm512_storeu_pd(a + j, _mm512_max_pd(x, zero));
+    if (sp) _mm512_storeu_pd(sp + j, _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(x, zero, _CMP_GT_OQ), one));
+  }
+  relu_row(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+__attribute__((target("avx512f")))
+static void relu_row_float_avx512(float *z, float *a, float *sp, float b, size_t n) {
+  __m512 vb = _mm512_set1_ps(b);
+  __m512 zero = _mm512_setzero_ps();
+  __m512 one = _mm512_set1_ps(1.0f);
+  size_t j = 0;
+  for (; j + 16 <= n; j += 16) {
+    __m512 x = _mm512_add_ps(_mm512_loadu_ps(z + j), vb);
+    _mm512_storeu_ps(z + j, x);
+    _mm512_storeu_ps(a + j, _mm512_max_ps(x, zero));
+    if (sp) _mm512_storeu_ps(sp + j, _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(x, zero, _CMP_GT_OQ), one));
+  }
+  relu_row_float(z + j, a + j, sp ? sp + j : NULL, b, n - j);
+}
+
+#endif
+
+// BEGIN DISPATCH
+
+static row_kernel_t row_kernel(int id) {
+  switch (id) {
+    case ACTIVATION_SIGMOID:
+#ifdef KERNELS_X86
+      if (kernel_isa() == ISA_AVX512) return &sigmoid_row_avx512;
+      if (kernel_isa() == ISA_AVX2) return &sigmoid_row_avx2;
+#endif
+      return &sigmoid_row;
+    case ACTIVATION_FAST_SIGMOID:
+#ifdef KERNELS_X86
+      if (kernel_isa() == ISA_AVX512) return &fast_sigmoid_row_avx512;
+      if (kernel_isa() == ISA_AVX2) return &fast_sigmoid_row_avx2;
+#endif
+      return &fast_sigmoid_row;
+    case ACTIVATION_RELU:
+#ifdef KERNELS_X86
+      if (kernel_isa() == ISA_AVX512) return &relu_row_avx512;
+      if (kernel_isa() == ISA_AVX2) return &relu_row_avx2;
+#endif
+      return &relu_row;
+  }
+  return NULL;
+}
+
+static row_kernel_float_t row_kernel_float(int id) {
+  switch (id) {
+    case ACTIVATION_SIGMOID:
+#ifdef KERNELS_X86
+      if (kernel_isa() == ISA_AVX512) return &sigmoid_row_float_avx512;
+      if (kernel_isa() == ISA_AVX2) return &sigmoid_row_float_avx2;
+#endif
+      return &sigmoid_row_float;
+    case ACTIVATION_FAST_SIGMOID:
+#ifdef KERNELS_X86
+      if (kernel_isa() == ISA_AVX512) return &fast_sigmoid_row_float_avx512;
+      if (kernel_isa() == ISA_AVX2) return &fast_sigmoid_row_float_avx2;
+#endif
+      return &fast_sigmoid_row_float;
+    case ACTIVATION_RELU:
+#ifdef KERNELS_X86
+      if (kernel_isa() == ISA_AVX512) return &relu_row_float_avx512;
+      if (kernel_isa() == ISA_AVX2) return &relu_row_float_avx2;
+#endif
+      return &relu_row_float;
+  }
+  return NULL;
+}
+
+/*
+  bias_activate adds the bias column b to z in place, stores the activation
+  of z in a and, if sp is not NULL, the derivative of the activation in sp.
+  Activations without a fused kernel go through af->f and af->f_p.
+*/
+void bias_activate(af_t *af, gsl_matrix *z, gsl_matrix *b, gsl_matrix *a, gsl_matrix *sp) {
+  assert(same_shape(z, a) && (sp == NULL || same_shape(z, sp)));
+  assert(b->size1 == z->size1 && b->size2 == 1);
+  row_kernel_t k = row_kernel(af->id);
+  for (size_t i = 0; i < z->size1; i++) {
+    double *zi = z->data + i * z->tda;
+    double *ai = a->data + i * a->tda;
+    double *spi = sp ? sp->data + i * sp->tda : NULL;
+    double bi = b->data[i * b->tda];
+    if (k != NULL) {
+      k(zi, ai, spi, bi, z->size2);
+      continue;
+    }
+    for (size_t j = 0; j < z->size2; j++) {
+      zi[j] += bi;
+      ai[j] = (*af->f)(zi[j]);
+      if (spi) spi[j] = (*af->f_p)(zi[j]);
+    }
+  }
+}
+
+/*
+  bias_activate_float is bias_activate for single precision matrices
+*/
+void bias_activate_float(af_t *af, gsl_matrix_float *z, gsl_matrix_float *b,
+                            gsl_matrix_float *a, gsl_matrix_float *sp) {
+  assert(same_shape_float(z, a) && (sp == NULL || same_shape_float(z, sp)));
+  assert(b->size1 == z->size1 && b->size2 == 1);
+  row_kernel_float_t k = row_kernel_float(af->id);
+  for (size_t i = 0; i < z->size1; i++) {
+    float *zi = z->data + i * z->tda;
+    float *ai = a->data + i * a->tda;
+    float *spi = sp ? sp->data + i * sp->tda : NULL;
+    float bi = b->data[i * b->tda];
+    if (k != NULL) {
+      k(zi, ai, spi, bi, z->size2);
+      continue;
+    }
+    for (size_t j = 0; j < z->size2; j++) {
+      zi[j] += bi;
+      ai[j] = (float)(*af->f)(zi[j]);
+      if (spi) spi[j] = (float)(*af->f_p)(zi[j]);
+    }
+  }
+}
+
+// BEGIN SOFTMAX KERNELS
+
+/*
+  The softmax kernels work on the output layer, one column per sample,
+  a few columns at a time so every pass over the rows stays in cache. The
+  column maximum is subtracted before exponentiating, so the exponentials
+  are at most 1 and never overflow. exp_row_kernel_t sets
+  e[j] = exp(z[j] - m[j]) and adds it to s[j], xent_row_kernel_t sets
+  delta[j] = a[j] - y[j] and returns the sum of y[j] * (lse[j] - z[j]).
+*/
+#define SOFTMAX_CHUNK 128
+
+typedef void (*exp_row_kernel_t)(const double *z, const double *m, double *e, double *s, size_t n);
+typedef double (*xent_row_kernel_t)(const double *z, const double *lse, const double *a,
+                                      const double *y, double *delta, size_t n);
+
+static void exp_row(const double *z, const double *m, double *e, double *s, size_t n) {
+  for (size_t j = 0; j < n; j++) {
+    e[j] = fast_exp(z[j] - m[j]);
+    s[j] += e[j];
+  }
+}
+
+static double xent_row(const double *z, const double *lse, const double *a,
+                        const double *y, double *delta, size_t n) {
+  double sum = 0;
+  for (size_t j = 0; j < n; j++) {
+    delta[j] = a[j] - y[j];
+    sum += y[j] * (lse[j] - z[j]);
+  }
+  return sum;
+}
+
+#ifdef KERNELS_X86
+
+__attribute__((target("avx2,fma")))
+static void exp_row_avx2(const double *z, const double *m, double *e, double *s, size_t n) {
+  size_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    __m256d x = exp_avx2(_mm256_sub_pd(_mm256_loadu_pd(z + j), _mm256_loadu_pd(m + j)));
+    _mm256_storeu_pd(e + j, x);
+    _mm256_storeu_pd(s + j, _mm256_add_pd(_mm256_loadu_pd(s + j), x));
+  }
+  exp_row(z + j, m + j, e + j, s + j, n - j);
+}
+
+__attribute__((target("avx2,fma")))
+static double xent_row_avx2(const double *z, const double *lse, const double *a,
+                              const double *y, double *delta, size_t n) {
+  __m256d sum = _mm256_setzero_pd();
+  size_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    __m256d yj = _mm256_loadu_pd(y + j);
+    _mm256_storeu_pd(delta + j, _mm256_sub_pd(_mm256_loadu_pd(a + j), yj));
+    sum = _mm256_fmadd_pd(yj, _mm256_sub_pd(_mm256_loadu_pd(lse + j), _mm256_loadu_pd(z + j)), sum);
+  }
+  __m128d h = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+  h = _mm_add_sd(h, _mm_unpackhi_pd(h, h));
+  return _mm_cvtsd_f64(h) + xent_row(z + j, lse + j, a + j, y + j, delta + j, n - j);
+}
+
+__attribute__((target("avx512f")))
+static void exp_row_avx512(const double *z, const double *m, double *e, double *s, size_t n) {
+  size_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m512d x = exp_avx512(_mm512_sub_pd(_mm512_loadu_pd(z + j), _mm512_loadu_pd(m + j)));
+    _mm512_storeu_pd(e + j, x);
+    _mm512_storeu_pd(s + j, _mm512_add_pd(_mm512_loadu_pd(s + j), x));
+  }
+  exp_row(z + j, m + j, e + j, s + j, n - j);
+}
+
+__attribute__((target("avx512f")))
+static double xent_row_avx512(const double *z, const double *lse, const double *a,
+                                const double *y, double *delta, size_t n) {
+  __m512d sum = _mm512_setzero_pd();
+  size_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m512d yj = _mm512_loadu_pd(y + j);
+    _mm512_storeu_pd(delta + j, _mm512_sub_pd(_mm512_loadu_pd(a + j), yj));
+    sum = _mm512_fmadd_pd(yj, _mm512_sub_pd(_mm512_loadu_pd(lse + j), _mm512_loadu_pd(z + j)), sum);
+  }
+  return _mm512_reduce_add_pd(sum) + xent_row(z + j, lse + j, a + j, y + j, delta + j, n - j);
+}
+
+#endif
+
+static exp_row_kernel_t exp_row_kernel() {
+#ifdef KERNELS_X86
+  if (kernel_isa() == ISA_AVX512) return &exp_row_avx512;
+  if (kernel_isa() == ISA_AVX2) return &exp_row_avx2;
+#endif
+  return &exp_row;
+}
+
+static xent_row_kernel_t xent_row_kernel() {
+#ifdef KERNELS_X86
+  if (kernel_isa() == ISA_AVX512) return &xent_row_avx512;
+  if (kernel_isa() == ISA_AVX2) return &xent_row_avx2;
+#endif
+  return &xent_row;
+}
+
+/*
+  bias_softmax adds the bias column b to z in place and stores the softmax
+  of each column of z in a. If lse is not NULL it gets the log of the
+  normalizer of each column, log(sum(exp(z))), for softmax_cross_entropy.
+  The exponentials come from fast_exp, so a and lse are not libm exact:
+  they are within SOFTMAX_MAX_ERROR of a libm softmax, annc-check sees
+  errors around 1e-9 on every instruction set.
+*/
+void bias_softmax(gsl_matrix *z, gsl_matrix *b, gsl_matrix *a, double *lse) {
+  assert(same_shape(z, a));
+  assert(b->size1 == z->size1 && b->size2 == 1);
+  exp_row_kernel_t k = exp_row_kernel();
+  double m[SOFTMAX_CHUNK];
+  double s[SOFTMAX_CHUNK];
+  for (size_t first = 0; first < z->size2; first += SOFTMAX_CHUNK) {
+    size_t n = z->size2 - first;
+    if (n > SOFTMAX_CHUNK) n = SOFTMAX_CHUNK;
+    for (size_t i = 0; i < z->size1; i++) {
+      double *zi = z->data + i * z->tda + first;
+      double bi = b->data[i * b->tda];
+      for (size_t j = 0; j < n; j++) {
+        zi[j] += bi;
+        if (i == 0 || zi[j] > m[j]) m[j] = zi[j];
+      }
+    }
+    memset(s, 0, n * sizeof(double));
+    for (size_t i = 0; i < z->size1; i++) {
+      k(z->data + i * z->tda + first, m, a->data + i * a->tda + first, s, n);
+    }
+    for (size_t j = 0; j < n; j++) {
+      if (lse) lse[first + j] = m[j] + log(s[j]);
+      s[j] = 1.0 / s[j];
+    }
+    for (size_t i = 0; i < z->size1; i++) {
+      double *ai = a->data + i * a->tda + first;
+      for (size_t j = 0; j < n; j++) ai[j] *= s[j];
+    }
+  }
+}
+
+/*
+  softmax_cross_entropy takes the output layer of a softmax network, z and
+  lse as bias_softmax left them and a its softmax, and the targets y. In
+  a single sweep it stores the gradient of the cross entropy with respect
+  to z, a - y, in delta and returns the cost, summed over the batch like
+  cross_entropy. The cost is taken from z and lse, -y * (z - lse), so it
+  needs no log and stays finite however small a gets.
+*/
+double softmax_cross_entropy(gsl_matrix *z, const double *lse, gsl_matrix *a,
+                                gsl_matrix *y, gsl_matrix *delta) {
+  assert(same_shape(z, a) && same_shape(a, y) && same_shape(y, delta));
+  xent_row_kernel_t k = xent_row_kernel();
+  double cost = 0;
+  for (size_t i = 0; i < z->size1; i++) {
+    cost += k(z->data + i * z->tda, lse, a->data + i * a->tda,
+                y->data + i * y->tda, delta->data + i * delta->tda, z->size2);
+  }
+  return cost / z->size1;
+}
+
+// BEGIN OPTIMIZER KERNELS
+
+/*
+  The optimizer kernels apply one step of the momentum update to n
+  parameters in a single pass, with velocity v and gradient g:
+    v = mu * v - eta * g
+    w = decay * w + v                  (OPTIMIZER_MOMENTUM)
+    w = decay * w + mu * v - eta * g   (OPTIMIZER_NESTEROV)
+*/
+
+static void sgd_update_scalar(int nesterov, double *w, double *v, const double *g,
+                                size_t n, double decay, double mu, double eta) {
+  for (size_t i = 0; i < n; i++) {
+    double vi = mu * v[i] - eta * g[i];
+    v[i] = vi;
+    w[i] = decay * w[i] + (nesterov ? (mu * vi - eta * g[i]) : vi);
+  }
+}
+
+static void sgd_update_float_scalar(int nesterov, float *w, float *v, const float *g,
+                                size_t n, float decay, float mu, float eta) {
+  for (size_t i = 0; i < n; i++) {
+    float vi = mu * v[i] - eta * g[i];
+    v[i] = vi;
+    w[i] = decay * w[i] + (nesterov ? (mu * vi - eta * g[i]) : vi);
+  }
+}
+
+#ifdef KERNELS_X86
+
+__attribute__((target("avx2,fma")))
+static void sgd_update_avx2(int nesterov, double *w, double *v, const double *g,
+                                size_t n, double decay, double mu, double eta) {
+  __m256d vdecay = _mm256_set1_pd(decay);
+  __m256d vmu = _mm256_set1_pd(mu);
+  __m256d veta = _mm256_set1_pd(eta);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d gi = _mm256_loadu_pd(g + i);
+    __m256d vi = _mm256_fnmadd_pd(veta, gi, _mm256_mul_pd(vmu, _mm256_loadu_pd(v + i)));
+    __m256d step = nesterov ? _mm256_fnmadd_pd(veta, gi, _mm256_mul_pd(vmu, vi)) : vi;
+    _mm256_storeu_pd(v + i, vi);
+    _mm256_storeu_pd(w + i, _mm256_fmadd_pd(vdecay, _mm256_loadu_pd(w + i), step));
+  }
+  sgd_update_scalar(nesterov, w + i, v + i, g + i, n - i, decay, mu, eta);
+}
+
+__attribute__((target("avx2,fma")))
+static void sgd_update_float_avx2(int nesterov, float *w, float *v, const float *g,
+                                size_t n, float decay, float mu, float eta) {
+  __m256 vdecay = _mm256_set1_ps(decay);
+  __m256 vmu = _mm256_set1_ps(mu);
+  __m256 veta = _mm256_set1_ps(eta);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 gi = _mm256_loadu_ps(g + i);
+    __m256 vi = _mm256_fnmadd_ps(veta, gi, _mm256_mul_ps(vmu, _mm256_loadu_ps(v + i)));
+    __m256 step = nesterov ? _mm256_fnmadd_ps(veta, gi, _mm256_mul_ps(vmu, vi)) : vi;
+    _mm256_storeu_ps(v + i, vi);
+    _mm256_storeu_ps(w + i, _mm256_fmadd_ps(vdecay, _mm256_loadu_ps(w + i), step));
+  }
+  sgd_update_float_scalar(nesterov, w + i, v + i, g + i, n - i, decay, mu, eta);
+}
+
+__attribute__((target("avx512f")))
+static void sgd_update_avx512(int nesterov, double *w, double *v, const double *g,
+                                size_t n, double decay, double mu, double eta) {
+  __m512d vdecay = _mm512_set1_pd(decay);
+  __m512d vmu = _mm512_set1_pd(mu);
+  __m512d veta = _mm512_set1_pd(eta);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512d gi = _mm512_loadu_pd(g + i);
+    __m512d vi = _mm512_fnmadd_pd(veta, gi, _mm512_mul_pd(vmu, _mm512_loadu_pd(v + i)));
+    __m512d step = nesterov ? _mm512_fnmadd_pd(veta, gi, _mm512_mul_pd(vmu, vi)) : vi;
+    _mm512_storeu_pd(v + i, vi);
+    _mm512_storeu_pd(w + i, _mm512_fmadd_pd(vdecay, _mm512_loadu_pd(w + i), step));
+  }
+  sgd_update_scalar(nesterov, w + i, v + i, g + i, n - i, decay, mu, eta);
+}
+
+__attribute__((target("avx512f")))
+static void sgd_update_float_avx512(int nesterov, float *w, float *v, const float *g,
+                                size_t n, float decay, float mu, float eta) {
+  __m512 vdecay = _mm512_set1_ps(decay);
+  __m512 vmu = _mm512_set1_ps(mu);
+  __m512 veta = _mm512_set1_ps(eta);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 gi = _mm512_loadu_ps(g + i);
+    __m512 vi = _mm512_fnmadd_ps(veta, gi, _mm512_mul_ps(vmu, _mm512_loadu_ps(v + i)));
+    __m512 step = nesterov ? _mm512_fnmadd_ps(veta, gi, _mm512_mul_ps(vmu, vi)) : vi;
+    _mm512_storeu_ps(v + i, vi);
+    _mm512_storeu_ps(w + i, _mm512_fmadd_ps(vdecay, _mm512_loadu_ps(w + i), step));
+  }
+  sgd_update_float_scalar(nesterov, w + i, v + i, g + i, n - i, decay, mu, eta);
+}
+
+#endif
+
+/*
+  sgd_update runs the optimizer kernel over n contiguous parameters
+*/
+void sgd_update(int optimizer, double *w, double *v, const double *g,
+                  size_t n, double decay, double mu, double eta) {
+  int nesterov = (optimizer == OPTIMIZER_NESTEROV);
+#ifdef KERNELS_X86
+  if (kernel_isa() == ISA_AVX512) {
+    sgd_update_avx512(nesterov, w, v, g, n, decay, mu, eta);
+    return;
+  }
+  if (kernel_isa() == ISA_AVX2) {
+    sgd_update_avx2(nesterov, w, v, g, n, decay, mu, eta);
+    return;
+  }
+#endif
+  sgd_update_scalar(nesterov, w, v, g, n, decay, mu, eta);
+}
+
+void sgd_update_float(int optimizer, float *w, float *v, const float *g,
+                  size_t n, float decay, float mu, float eta) {
+  int nesterov = (optimizer == OPTIMIZER_NESTEROV);
+#ifdef KERNELS_X86
+  if (kernel_isa() == ISA_AVX512) {
+    sgd_update_float_avx512(nesterov, w, v, g, n, decay, mu, eta);
+    return;
+  }
+  if (kernel_isa() == ISA_AVX2) {
+    sgd_update_float_avx2(nesterov, w, v, g, n, decay, mu, eta);
+    return;
+  }
+#endif
+  sgd_update_float_scalar(nesterov, w, v, g, n, decay, mu, eta);
+}
+
+// BEGIN INT8 KERNELS
+
+/*
+  The int8 kernels compute the dot product of k uint8 inputs with k int8
+  weights in int32. The AVX2 kernel multiplies with vpmaddubsw, which
+  adds pairs of products in saturating int16 lanes, so it is exact only
+  for weights within +-QUANT_WEIGHT_MAX. AVX-512 VNNI adds groups of four
+  products straight into int32 with vpdpbusd.
+*/
+
+typedef int32_t (*dot_kernel_t)(const uint8_t *x, const int8_t *w, size_t k);
+
+static int32_t dot_u8s8_scalar(const uint8_t *x, const int8_t *w, size_t k) {
+  int32_t sum = 0;
+  for (size_t i = 0; i < k; i++) sum += (int32_t)x[i] * w[i];
+  return sum;
+}
+
+#ifdef KERNELS_X86
+
+__attribute__((target("avx2")))
+static int32_t dot_u8s8_avx2(const uint8_t *x, const int8_t *w, size_t k) {
+  __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= k; i += 32) {
+    __m256i p = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(x + i)),
+                                       _mm256_loadu_si256((const __m256i*)(w + i)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(p, ones));
+  }
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(s) + dot_u8s8_scalar(x + i, w + i, k - i);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static int32_t dot_u8s8_vnni(const uint8_t *x, const int8_t *w, size_t k) {
+  __m512i acc = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 64 <= k; i += 64) {
+    acc = _mm512_dpbusd_epi32(acc, _mm512_loadu_si512(x + i), _mm512_loadu_si512(w + i));
+  }
+  if (i < k) {
+    // masked loads for the tail, the lanes past k read as zero
+    __mmask64 m = ~0ULL >> (64 - (k - i));
+    acc = _mm512_dpbusd_epi32(acc, _mm512_maskz_loadu_epi8(m, x + i), _mm512_maskz_loadu_epi8(m, w + i));
+  }
+  return _mm512_reduce_add_epi32(acc);
+}
+
+#endif
+
+static dot_kernel_t dot_kernel() {
+#ifdef KERNELS_X86
+  if (kernel_isa() == ISA_AVX512 && __builtin_cpu_supports("avx512bw")
+      && __builtin_cpu_supports("avx512vnni")) return &dot_u8s8_vnni;
+  if (kernel_isa() >= ISA_AVX2) return &dot_u8s8_avx2;
+#endif
+  return &dot_u8s8_scalar;
+}
+
+/*
+  dot_u8s8 multiplies rows int8 weight rows of w by n uint8 input rows of
+  x over their first k entries, c[r * ldc + j] is the dot product of
+  weight row r and input row j
+*/
+void dot_u8s8(const int8_t *w, size_t ldw, size_t rows, const uint8_t *x, size_t ldx,
+                size_t n, size_t k, int32_t *c, size_t ldc) {
+  dot_kernel_t dot = dot_kernel();
+  for (size_t r = 0; r < rows; r++) {
+    for (size_t j = 0; j < n; j++) {
+      c[r * ldc + j] = dot(x + j * ldx, w + r * ldw, k);
+    }
+  }
+}
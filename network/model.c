@@ -0,0 +1,127 @@
+#include "network.h"
+
+/*
+  A model only runs feedforward, so it keeps none of the gradients,
+  derivatives or workspace of a network_t. Its memory is the parameter
+  slab, which load_model shares with every other user of the checkpoint,
+  and every predicting thread adds one scratch of three widest layer x
+  batch buffers.
+*/
+
+/*
+  init_model builds a model over params and takes ownership of params and
+  activation
+*/
+model_t *init_model(int layers[], int num_layers, af_t *activation, slab_t *params) {
+  assert(num_layers <= MAX_LAYERS);
+  model_t *m = (model_t*) malloc(sizeof(model_t));
+  m->num_layers = num_layers;
+  memcpy(m->layers, layers, num_layers*sizeof(int));
+  m->activation = activation;
+  m->softmax = false;
+  m->params = params;
+  m->weights = params->weights->data;
+  m->biases = params->biases->data;
+  return m;
+}
+
+/*
+  freeze_network copies the parameters and activations of net into a new
+  model, net can be trained further or freed afterwards
+*/
+model_t *freeze_network(network_t *net) {
+  slab_t *params = init_slab(net);
+  memcpy(params->block->data, net->params->block->data,
+            params->block->size * sizeof(double));
+  af_t *activation = (af_t*) malloc(sizeof(af_t));
+  memcpy(activation, net->activation, sizeof(af_t));
+  model_t *m = init_model(net->layers, net->num_layers, activation, params);
+  m->softmax = (net->cost->id == COST_SOFTMAX_CROSS_ENTROPY);
+  return m;
+}
+
+void free_model(model_t *m) {
+  free_slab(m->params);
+  free(m->activation);
+  free(m);
+}
+
+/*
+  init_scratch allocates the buffers for one thread to predict batches of
+  up to max_batch samples with m
+*/
+scratch_t *init_scratch(model_t *m, size_t max_batch) {
+  return alloc_scratch(m->layers, m->num_layers, max_batch);
+}
+
+/*
+  alloc_scratch is init_scratch for any model with the given topology
+*/
+scratch_t *alloc_scratch(int layers[], int num_layers, size_t max_batch) {
+  size_t width = 0;
+  for (int l = 0; l < num_layers; l++) {
+    if (layers[l] > width) width = layers[l];
+  }
+  scratch_t *s = (scratch_t*) malloc(sizeof(scratch_t));
+  s->max_batch = max_batch;
+  s->input_size = layers[0];
+  s->arena = (gsl_block*) malloc(sizeof(gsl_block));
+  s->arena->size = 3 * width * max_batch;
+  if (posix_memalign((void**)&s->arena->data, SLAB_ALIGN, s->arena->size * sizeof(double))) {
+    fprintf(stderr, "%s\n", "scratch allocation failed");
+    exit(1);
+  }
+  for (int i = 0; i < 2; i++) {
+    s->buffers[i] = gsl_matrix_alloc_from_block(s->arena, i * width * max_batch,
+                                                  width, max_batch, max_batch);
+  }
+  s->z = gsl_matrix_alloc_from_block(s->arena, 2 * width * max_batch, width, max_batch, max_batch);
+  return s;
+}
+
+void free_scratch(scratch_t *s) {
+  // the buffers are views, the data is freed with the arena
+  gsl_matrix_free(s->buffers[0]);
+  gsl_matrix_free(s->buffers[1]);
+  gsl_matrix_free(s->z);
+  gsl_block_free(s->arena);
+  free(s);
+}
+
+/*
+  scratch_input returns an input matrix for n samples inside the scratch,
+  so the caller can fill it and predict without a copy
+*/
+gsl_matrix *scratch_input(scratch_t *s, size_t n) {
+  assert(n <= s->max_batch);
+  s->in = gsl_matrix_submatrix(s->buffers[0], 0, 0, s->input_size, n);
+  return &s->in.matrix;
+}
+
+/*
+  model_predict runs input, one column per sample, through the model and
+  returns the output layer, which lives in the scratch until its next use
+*/
+gsl_matrix *model_predict(model_t *m, scratch_t *s, gsl_matrix *input) {
+  size_t n = input->size2;
+  assert(input->size1 == m->layers[0] && n <= s->max_batch);
+  gsl_matrix_view views[2];
+  gsl_matrix *a = input;
+  for (int l = 0; l < m->num_layers-1; l++) {
+    // layer l+1 goes to the buffer that does not hold layer l
+    gsl_matrix_view z = gsl_matrix_submatrix(s->z, 0, 0, m->layers[l+1], n);
+    views[(l+1) % 2] = gsl_matrix_submatrix(s->buffers[(l+1) % 2], 0, 0, m->layers[l+1], n);
+    gsl_matrix *next = &views[(l+1) % 2].matrix;
+    if (!specialized_forward(m->weights[l], a, &z.matrix)) {
+      gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, m->weights[l], a, 0.0, &z.matrix);
+    }
+    if (m->softmax && l == m->num_layers-2) {
+      bias_softmax(&z.matrix, m->biases[l], next, NULL);
+    } else {
+      bias_activate(m->activation, &z.matrix, m->biases[l], next, NULL);
+    }
+    a = next;
+  }
+  s->out = views[(m->num_layers-1) % 2];
+  return &s->out.matrix;
+}
@@ -1,5 +1,47 @@
 #include "network.h"
 
+const gsl_rng_type * T;
+gsl_rng * r;
+
+/*
+  When built with -DANNC_DEBUG_ALLOC the heap allocators are interposed so
+  that alloc_count can prove the training loop does not allocate. This
+  catches allocations made inside GSL as well.
+*/
+#ifdef ANNC_DEBUG_ALLOC
+static size_t allocs = 0;
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(p, size);
+}
+#endif
+
+/*
+  alloc_count returns the number of heap allocations so far, it is always
+  0 unless built with -DANNC_DEBUG_ALLOC
+*/
+size_t alloc_count() {
+#ifdef ANNC_DEBUG_ALLOC
+  return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+#else
+  return 0;
+#endif
+}
+
 // BEGIN NETWORK FUNCTIONS
 
 /*
@@ -7,126 +49,293 @@
 */
 network_t *init_network(int layers[], int num_layers, af_t *activation, cf_t *cost) {
 
-  gsl_rng_env_setup();
-  T = gsl_rng_default;
-  r = gsl_rng_alloc(T);
+  init_rng();
+  network_t *net = alloc_network(layers, num_layers, activation, cost);
+  net->params = init_slab(net);
+  net->weights = net->params->weights->data;
+  net->biases = net->params->biases->data;
+  // Generate random biases and weights.
+  for (int l = 1; l < num_layers; l++) {
+    rand_gaussian_fill(net->biases[l-1]);
+    rand_gaussian_fill(net->weights[l-1]);
+  }
+  init_network_buffers(net);
+  return net;
+}
+
+/*
+  alloc_network allocates a network with the given topology but no
+  parameters or buffers
+*/
+network_t *alloc_network(int layers[], int num_layers, af_t *activation, cf_t *cost) {
+  assert(num_layers <= MAX_LAYERS);
   network_t *net = (network_t*) malloc(sizeof(network_t));
+  net->parent = NULL;
   net->num_layers = num_layers;
   memcpy(net->layers, layers, num_layers*sizeof(int));
-  net->weights = (gsl_matrix**) malloc(sizeof(gsl_matrix*)*(num_layers-1));
-  net->biases = (gsl_matrix**) malloc(sizeof(gsl_matrix*)*(num_layers-1));
   net->activation = activation;
   net->cost = cost;
+  net->optimizer = OPTIMIZER_MOMENTUM;
   net->obj_fun = 0;
-  // Generate random biases and weights.
-  for (int l = 1; l < num_layers; l++) {
-    net->biases[l-1] = rand_gaussian_matrix(layers[l], 1);
-    net->weights[l-1] = rand_gaussian_matrix(layers[l], layers[l-1]);
-  }
+  net->batch_size = 1;
+  net->mask = NULL;
+  return net;
+}
+
+/*
+  init_network_buffers allocates the activations, workspace and gradients
+  of a network whose parameters are set
+*/
+void init_network_buffers(network_t *net) {
+  net->sparse_input = NULL;
   init_activations(net);
   init_outputs(net);
-  net->bias_grads = init_bias_grads(net);
-  net->weight_grads = init_weight_grads(net);
-  net->delta_bias_grads = init_bias_grads(net);
-  net->delta_weight_grads = init_weight_grads(net);
+  init_derivatives(net);
+  net->ws = init_workspace(net);
+  net->grads = init_slab(net);
+  net->bias_grads = net->grads->biases;
+  net->weight_grads = net->grads->weights;
+  net->delta_grads = init_slab(net);
+  net->delta_bias_grads = net->delta_grads->biases;
+  net->delta_weight_grads = net->delta_grads->weights;
+}
 
-  return net;
+/*
+  init_network_replica creates a network that shares the weights, biases,
+  activation and cost of net but has its own activations, workspace and
+  gradients, so several threads can run feedforward and backprop on the
+  same parameters at once.
+*/
+network_t *init_network_replica(network_t *net) {
+  network_t *rep = (network_t*) malloc(sizeof(network_t));
+  memcpy(rep, net, sizeof(network_t));
+  rep->parent = net;
+  rep->obj_fun = 0;
+  rep->batch_size = 1;
+  init_network_buffers(rep);
+  return rep;
 }
 
 /*
- free a network
+ free a network, a replica leaves the parameters of its parent alone
 */
 void free_network(network_t* net) {
-  gsl_rng_free(r);
-
-  for (int i = 0; i < net->num_layers-1; i++) {
-    gsl_matrix_free(net->weights[i]);
-    gsl_matrix_free(net->biases[i]);
-  }
   gsl_matrix_list_free(net->activations);
   gsl_matrix_list_free(net->outputs);
-  gsl_matrix_list_free(net->bias_grads);
-  gsl_matrix_list_free(net->weight_grads);
-  gsl_matrix_list_free(net->delta_weight_grads);
-  gsl_matrix_list_free(net->delta_bias_grads);
-  free(net->weights);
-  free(net->biases);
-  free(net->activation);
-  free(net->cost);
+  gsl_matrix_list_free(net->derivatives);
+  free_slab(net->grads);
+  free_slab(net->delta_grads);
+  free_workspace(net->ws);
+  if (net->parent == NULL) {
+    free_slab(net->params);
+    if (net->mask) free_slab(net->mask);
+    free(net->activation);
+    free(net->cost);
+  }
   free(net);
 }
 
+/*
+  init_rng sets up the random number generator shared by every network.
+  It is only allocated once so several networks can live side by side.
+*/
+void init_rng() {
+  if (r != NULL) return;
+  gsl_rng_env_setup();
+  T = gsl_rng_default;
+  r = gsl_rng_alloc(T);
+}
+
+/*
+  set_batch_size resizes the activations and outputs of the network so that
+  each holds batch_size columns, one per sample of a mini batch.
+*/
+void set_batch_size(network_t *net, size_t batch_size) {
+  if (net->batch_size == batch_size) return;
+  gsl_matrix_list_free(net->activations);
+  gsl_matrix_list_free(net->outputs);
+  gsl_matrix_list_free(net->derivatives);
+  net->batch_size = batch_size;
+  init_activations(net);
+  init_outputs(net);
+  init_derivatives(net);
+  free_workspace(net->ws);
+  net->ws = init_workspace(net);
+}
+
+/*
+  bias_activate_layer adds the biases of layer l to its weighted inputs and
+  activates them, the output layer of a softmax network gets a softmax
+*/
+static void bias_activate_layer(network_t *net, int l) {
+  if (l == net->num_layers-2 && net->cost->id == COST_SOFTMAX_CROSS_ENTROPY) {
+    bias_softmax(net->outputs->data[l], net->biases[l], net->activations->data[l+1], net->ws->lse);
+    return;
+  }
+  bias_activate(net->activation, net->outputs->data[l], net->biases[l],
+                net->activations->data[l+1], net->derivatives->data[l]);
+}
+
+/*
+  activate_sparse is activateLayer for the first layer on a sparse input,
+  z[r][j] is the sum of w[r][i] * x[i][j] over the nonzero x[i][j]
+*/
+static void activate_sparse(network_t *net) {
+  sparse_t *x = net->sparse_input;
+  gsl_matrix *w = net->weights[0];
+  gsl_matrix *z = net->outputs->data[0];
+  for (size_t r = 0; r < z->size1; r++) {
+    const double *wr = w->data + r * w->tda;
+    double *zr = z->data + r * z->tda;
+    for (size_t j = 0; j < x->n; j++) {
+      double sum = 0;
+      for (size_t p = x->start[j]; p < x->start[j+1]; p++) sum += wr[x->index[p]] * x->value[p];
+      zr[j] = sum;
+    }
+  }
+  bias_activate_layer(net, 0);
+}
+
 /*
  perform feedforward proceedure on the network
  zs = outputs, as=activations
+ each column of a is a sample, so a whole mini batch passes through each
+ layer as a single matrix-matrix product
 */
 void feedforward(network_t* net, gsl_matrix *a) {
   assert(net->layers[0] == a->size1);
+  if (a->size2 != net->batch_size) set_batch_size(net, a->size2);
   assert(net->activations->length == net->num_layers);
   assert(net->outputs->length == net->num_layers-1);
-  gsl_matrix_memcpy(net->activations->data[0], a);
+  // the input may already have been loaded in place, densely or sparsely
+  if (a != net->activations->data[0]) {
+    gsl_matrix_memcpy(net->activations->data[0], a);
+    net->sparse_input = NULL;
+  }
 
   for (int i = 0; i < (net->num_layers-1); i++) {
+    if (i == 0 && net->sparse_input != NULL) {
+      activate_sparse(net);
+      continue;
+    }
     activateLayer(net, i);
   }
 }
 
+/*
+  load_sparse loads x in place as the input layer of net, the next
+  feedforward(net, net->activations->data[0]) and backprop then only touch
+  the weights of the nonzero inputs in the first layer. The dense input
+  layer is left stale. x must stay valid until the backprop.
+*/
+void load_sparse(network_t *net, sparse_t *x) {
+  assert(x->start[x->n] <= x->capacity);
+  set_batch_size(net, x->n);
+  net->sparse_input = x;
+}
+
+/*
+  weight_grad sets the weight gradient of layer l to delta times the
+  transposed activations of layer l, for a sparse input layer only the
+  columns of the nonzero inputs get a contribution
+*/
+static void weight_grad(network_t *net, int l, gsl_matrix *delta) {
+  gsl_matrix *g = net->delta_weight_grads->data[l];
+  sparse_t *x = net->sparse_input;
+  if (l > 0 || x == NULL) {
+    if (!specialized_weight_grad(delta, net->activations->data[l], g)) {
+      gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, delta,
+                      net->activations->data[l], 0.0, g);
+    }
+    return;
+  }
+  gsl_matrix_set_zero(g);
+  for (size_t r = 0; r < g->size1; r++) {
+    double *gr = g->data + r * g->tda;
+    const double *dr = delta->data + r * delta->tda;
+    for (size_t j = 0; j < x->n; j++) {
+      double d = dr[j];
+      for (size_t p = x->start[j]; p < x->start[j+1]; p++) gr[x->index[p]] += d * x->value[p];
+    }
+  }
+}
+
+/*
+  sparse_alloc allocates a sparse batch of up to n samples with capacity
+  nonzero entries in total
+*/
+sparse_t *sparse_alloc(size_t n, size_t capacity) {
+  sparse_t *x = (sparse_t*) malloc(sizeof(sparse_t));
+  x->n = 0;
+  x->capacity = capacity;
+  x->start = (size_t*) calloc(n + 1, sizeof(size_t));
+  x->index = (int*) malloc(capacity * sizeof(int));
+  x->value = (double*) malloc(capacity * sizeof(double));
+  return x;
+}
+
+void sparse_free(sparse_t *x) {
+  free(x->start);
+  free(x->index);
+  free(x->value);
+  free(x);
+}
+
 // activateLayer is the inner loop of the feed forward
 void activateLayer(network_t *net, int l) {
-  gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, net->weights[l],
-                net->activations->data[l], 0.0, net->outputs->data[l]);
-  gsl_matrix_add(net->outputs->data[l], net->biases[l]);
-  map_from(net->activation->f, net->activations->data[l+1], net->outputs->data[l]);
+  if (!specialized_forward(net->weights[l], net->activations->data[l], net->outputs->data[l])) {
+    gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, net->weights[l],
+                  net->activations->data[l], 0.0, net->outputs->data[l]);
+  }
+  bias_activate_layer(net, l);
 }
 
-void backprop(network_t *net, gsl_matrix *target) {
+/*
+  backprop computes the gradients of the cost with respect to the weights and
+  biases for the batch last passed to feedforward. The gradients are summed
+  over the columns of the batch. It returns the cost of the batch.
+*/
+double backprop(network_t *net, gsl_matrix *target) {
   // dimensional check
   assert(net->delta_weight_grads->length == net->num_layers-1
           && net->delta_bias_grads->length == net->num_layers-1);
+  assert(target->size2 == net->batch_size);
 
-  // propogate forward thru the network
-  gsl_matrix *delta;
   size_t asize = net->num_layers;
   size_t zsize = net->num_layers-1;
   size_t wgrad_size = net->delta_weight_grads->length;
   size_t bgrad_size = net->delta_bias_grads->length;
-
-  gsl_matrix *delta_temp;
+  // deltas[l] is the error of layer l+1, preallocated in the workspace
+  gsl_matrix **deltas = net->ws->deltas->data;
 
   // propogate backward thru the network
-  gsl_matrix *cost_by_a = gsl_matrix_calloc(target->size1, target->size2);
-  (*net->cost->f_p)(net->activation, cost_by_a, net->activations->data[asize-1],
-                                        target, net->outputs->data[zsize-1]);
-  // gsl_matrix *sd_outputs = matrix_copy(net->outputs->data[zsize-1]);
-  // map(net->activation->f_p, sd_outputs);
-  // gsl_matrix_mul_elements(cost_by_a, sd_outputs);
-  // gsl_matrix_free(sd_outputs);
-  delta = cost_by_a;
-  delta_temp = gsl_matrix_alloc(net->weights[(wgrad_size-1)]->size2,
-                                            delta->size2);
-
-  gsl_matrix_memcpy(net->delta_bias_grads->data[bgrad_size-1], delta);
-
-  // gsl_blas_dgemm(f1, f2, alpha, A, B, beta, C)
+  double cost;
+  if (net->cost->id == COST_SOFTMAX_CROSS_ENTROPY) {
+    cost = softmax_cross_entropy(net->outputs->data[zsize-1], net->ws->lse,
+                                  net->activations->data[asize-1], target, deltas[zsize-1]);
+  } else {
+    (*net->cost->f_p)(net->activation, deltas[zsize-1], net->activations->data[asize-1],
+                                          target, net->derivatives->data[zsize-1]);
+    cost = (*net->cost->f)(net->activations->data[asize-1], target);
+  }
+
+  sum_columns(net->delta_bias_grads->data[bgrad_size-1], deltas[zsize-1]);
+
   // C = alpha * f1(A) * f2(B) + beta * C
-  gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, delta,
-                  net->activations->data[asize-2], 0.0, net->delta_weight_grads->data[wgrad_size-1]);
+  weight_grad(net, wgrad_size-1, deltas[zsize-1]);
 
   for (int l = 2; l < net->num_layers; l++) {
-    gsl_matrix *z = net->outputs->data[zsize-l];
-    map(net->activation->f_p, z);
-    gsl_matrix *sp = z;
-    gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, net->weights[(wgrad_size-l+1)],
-                    delta, 0.0, delta_temp);
-    gsl_matrix_mul_elements(delta_temp, sp);
-    delta = delta_temp;
-    gsl_matrix_memcpy(net->delta_bias_grads->data[bgrad_size-l], delta);
-    gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, delta,
-                    net->activations->data[asize-l-1], 0.0, net->delta_weight_grads->data[wgrad_size-l]);
-
+    gsl_matrix *sp = net->derivatives->data[zsize-l];
+    gsl_matrix *delta = deltas[zsize-l];
+    if (!specialized_backward(net->weights[wgrad_size-l+1], deltas[zsize-l+1], delta)) {
+      gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, net->weights[(wgrad_size-l+1)],
+                      deltas[zsize-l+1], 0.0, delta);
+    }
+    gsl_matrix_mul_elements(delta, sp);
+    sum_columns(net->delta_bias_grads->data[bgrad_size-l], delta);
+    weight_grad(net, wgrad_size-l, delta);
   }
-  gsl_matrix_free(cost_by_a);
-  gsl_matrix_free(delta);
+  return cost;
 }
 
 // BEGIN MATRIX FUNCTIONS
@@ -160,15 +369,131 @@ void print_matrix(FILE *f, const gsl_matrix *m) {
 gsl_matrix *rand_gaussian_matrix(size_t rows, size_t cols) {
   gsl_matrix *m1;
 
-
   m1 = gsl_matrix_calloc (rows, cols);
-  for (int i = 0; i < rows; i++) {
-    for (int j = 0; j < cols; j++) {
+  rand_gaussian_fill(m1);
+  return m1;
+}
+
+/*
+ fill a matrix with gaussian noise with standard deviation SIGMA
+ scaled by the square root of its number of columns
+*/
+void rand_gaussian_fill(gsl_matrix *m) {
+  init_rng();
+  for (size_t i = 0; i < m->size1; i++) {
+    for (size_t j = 0; j < m->size2; j++) {
        double x = gsl_ran_gaussian(r, SIGMA);
-       gsl_matrix_set (m1, i, j, x/sqrt(cols));
+       gsl_matrix_set (m, i, j, x/sqrt(m->size2));
     }
   }
-  return m1;
+}
+
+/*
+  slab_layout lays the parameters of a network with the given layers out
+  in a slab of elem_size byte values, the weights of every layer first and
+  then the biases, each tensor SLAB_ALIGN aligned. It stores the offset of
+  every tensor in w_offsets and b_offsets and the size of the weights in
+  weights_size, each if not NULL, and returns the number of values in the
+  slab. Both precisions share it.
+*/
+size_t slab_layout(int layers[], int num_layers, size_t elem_size,
+                    size_t w_offsets[], size_t b_offsets[], size_t *weights_size) {
+  size_t align = SLAB_ALIGN / elem_size;
+  size_t size = 0;
+  for (int l = 1; l < num_layers; l++) {
+    if (w_offsets) w_offsets[l-1] = size;
+    size += ((size_t)layers[l] * layers[l-1] + align - 1) / align * align;
+  }
+  if (weights_size) *weights_size = size;
+  for (int l = 1; l < num_layers; l++) {
+    if (b_offsets) b_offsets[l-1] = size;
+    size += (layers[l] + align - 1) / align * align;
+  }
+  return size;
+}
+
+/*
+  slab_size returns the number of values in a slab for the given layers,
+  padding included
+*/
+size_t slab_size(int layers[], int num_layers) {
+  return slab_layout(layers, num_layers, sizeof(double), NULL, NULL, NULL);
+}
+
+/*
+  init_slab allocates a zeroed slab with one tensor per weight and
+  bias matrix of the network
+*/
+slab_t *init_slab(network_t *net) {
+  gsl_block *block = (gsl_block*) malloc(sizeof(gsl_block));
+  block->size = slab_size(net->layers, net->num_layers);
+  if (posix_memalign((void**)&block->data, SLAB_ALIGN, block->size * sizeof(double))) {
+    fprintf(stderr, "%s\n", "slab allocation failed");
+    exit(1);
+  }
+  memset(block->data, 0, block->size * sizeof(double));
+  return init_slab_from_block(net->layers, net->num_layers, block);
+}
+
+/*
+  init_slab_from_block lays the parameters of a network with the given
+  layers out over block, which must be SLAB_ALIGN aligned and as large as
+  init_slab makes it
+*/
+slab_t *init_slab_from_block(int layers[], int num_layers, gsl_block *block) {
+  size_t w_offsets[MAX_LAYERS], b_offsets[MAX_LAYERS], weights_size;
+  size_t size = slab_layout(layers, num_layers, sizeof(double), w_offsets, b_offsets, &weights_size);
+  assert(block->size == size);
+  slab_t *s = (slab_t*) malloc(sizeof(slab_t));
+  s->block = block;
+  s->map = NULL;
+  s->map_size = 0;
+
+  s->weights = gsl_matrix_list_malloc(num_layers-1);
+  s->biases = gsl_matrix_list_malloc(num_layers-1);
+  s->weights->slab = (gsl_block*) malloc(sizeof(gsl_block));
+  s->weights->slab->size = weights_size;
+  s->weights->slab->data = s->block->data;
+  s->biases->slab = (gsl_block*) malloc(sizeof(gsl_block));
+  s->biases->slab->size = size - weights_size;
+  s->biases->slab->data = s->block->data + weights_size;
+  for (int l = 1; l < num_layers; l++) {
+    s->weights->data[l-1] = gsl_matrix_alloc_from_block(s->block, w_offsets[l-1],
+                              layers[l], layers[l-1], layers[l-1]);
+    s->biases->data[l-1] = gsl_matrix_alloc_from_block(s->block, b_offsets[l-1], layers[l], 1, 1);
+  }
+  return s;
+}
+
+void free_slab(slab_t *s) {
+  // the regions and matrices are views, the data is freed with the block
+  free(s->weights->slab);
+  free(s->biases->slab);
+  gsl_matrix_list_free(s->weights);
+  gsl_matrix_list_free(s->biases);
+  if (s->map) {
+    Munmap(s->map, s->map_size);
+    free(s->block);
+  } else {
+    gsl_block_free(s->block);
+  }
+  free(s);
+}
+
+void slab_set_zero(slab_t *s) {
+  memset(s->block->data, 0, s->block->size * sizeof(double));
+}
+
+/*
+  slab_add adds src to dest element wise, both must come from the same network
+*/
+void slab_add(slab_t *dest, slab_t *src) {
+  assert(dest->block->size == src->block->size);
+  double *d = dest->block->data;
+  const double *a = src->block->data;
+  for (size_t i = 0; i < dest->block->size; i++) {
+    d[i] += a[i];
+  }
 }
 
 /*
@@ -183,6 +508,7 @@ gsl_matrix *matrix_copy(gsl_matrix *m) {
 gsl_matrix_list_t *init_bias_grads(network_t *net) {
   gsl_matrix_list_t *ml = (gsl_matrix_list_t*) malloc(sizeof(gsl_matrix_list_t));
   ml->length = net->num_layers-1;
+  ml->slab = NULL;
   ml->data = (gsl_matrix**) malloc(sizeof(gsl_matrix*)*(net->num_layers-1));
   for (int l = 1; l < net->num_layers; l++) {
     ml->data[l-1] = gsl_matrix_calloc(net->layers[l], 1);
@@ -194,6 +520,7 @@ gsl_matrix_list_t *init_bias_grads(network_t *net) {
 gsl_matrix_list_t *init_weight_grads(network_t *net) {
   gsl_matrix_list_t *ml = (gsl_matrix_list_t*) malloc(sizeof(gsl_matrix_list_t));
   ml->length = net->num_layers-1;
+  ml->slab = NULL;
   ml->data = (gsl_matrix**) malloc(sizeof(gsl_matrix*)*(net->num_layers-1));
   for (int l = 1; l < net->num_layers; l++) {
     ml->data[l-1] = gsl_matrix_calloc(net->layers[l], net->layers[l-1]);
@@ -204,19 +531,70 @@ gsl_matrix_list_t *init_weight_grads(network_t *net) {
 void init_outputs(network_t *net) {
   gsl_matrix_list_t *ml = (gsl_matrix_list_t*) malloc(sizeof(gsl_matrix_list_t));
   ml->length = net->num_layers-1;
+  ml->slab = NULL;
   ml->data = (gsl_matrix**) malloc(sizeof(gsl_matrix*)*(net->num_layers-1));
   for (int l = 1; l < net->num_layers; l++) {
-    ml->data[l-1] = gsl_matrix_calloc(net->layers[l], 1);
+    ml->data[l-1] = gsl_matrix_calloc(net->layers[l], net->batch_size);
   }
   net->outputs = ml;
 }
 
+void init_derivatives(network_t *net) {
+  gsl_matrix_list_t *ml = (gsl_matrix_list_t*) malloc(sizeof(gsl_matrix_list_t));
+  ml->length = net->num_layers-1;
+  ml->slab = NULL;
+  ml->data = (gsl_matrix**) malloc(sizeof(gsl_matrix*)*(net->num_layers-1));
+  for (int l = 1; l < net->num_layers; l++) {
+    ml->data[l-1] = gsl_matrix_calloc(net->layers[l], net->batch_size);
+  }
+  net->derivatives = ml;
+}
+
+/*
+  init_workspace carves the target, the per layer deltas and the softmax
+  normalizers for the current batch size out of one arena
+*/
+workspace_t *init_workspace(network_t *net) {
+  size_t n = net->batch_size;
+  size_t total = (net->layers[net->num_layers-1] + 1) * n;
+  for (int l = 1; l < net->num_layers; l++) {
+    total += net->layers[l] * n;
+  }
+  workspace_t *ws = (workspace_t*) malloc(sizeof(workspace_t));
+  ws->arena = gsl_block_alloc(total);
+  size_t offset = 0;
+  ws->target = gsl_matrix_alloc_from_block(ws->arena, offset,
+                    net->layers[net->num_layers-1], n, n);
+  offset += net->layers[net->num_layers-1] * n;
+  ws->deltas = (gsl_matrix_list_t*) malloc(sizeof(gsl_matrix_list_t));
+  ws->deltas->length = net->num_layers-1;
+  ws->deltas->slab = NULL;
+  ws->deltas->data = (gsl_matrix**) malloc(sizeof(gsl_matrix*)*(net->num_layers-1));
+  for (int l = 1; l < net->num_layers; l++) {
+    ws->deltas->data[l-1] = gsl_matrix_alloc_from_block(ws->arena, offset, net->layers[l], n, n);
+    offset += net->layers[l] * n;
+  }
+  ws->lse = ws->arena->data + offset;
+  ws->sparse = NULL;
+  return ws;
+}
+
+void free_workspace(workspace_t *ws) {
+  // the matrices are views into the arena, this only frees their structs
+  gsl_matrix_free(ws->target);
+  gsl_matrix_list_free(ws->deltas);
+  gsl_block_free(ws->arena);
+  if (ws->sparse) sparse_free(ws->sparse);
+  free(ws);
+}
+
 void init_activations(network_t *net) {
   gsl_matrix_list_t *ml = (gsl_matrix_list_t*) malloc(sizeof(gsl_matrix_list_t));
   ml->length = net->num_layers;
+  ml->slab = NULL;
   ml->data = (gsl_matrix**) malloc(sizeof(gsl_matrix*)*(net->num_layers));
   for (int l = 0; l < net->num_layers; l++) {
-    ml->data[l] = gsl_matrix_calloc(net->layers[l], 1);
+    ml->data[l] = gsl_matrix_calloc(net->layers[l], net->batch_size);
   }
   net->activations = ml;
 }
@@ -227,6 +605,7 @@ void init_activations(network_t *net) {
 gsl_matrix_list_t *gsl_matrix_list_malloc(size_t length) {
   gsl_matrix_list_t *ml = (gsl_matrix_list_t*) malloc(sizeof(gsl_matrix_list_t));
   ml->length = length;
+  ml->slab = NULL;
   ml->data = (gsl_matrix**) malloc(sizeof(gsl_matrix*)*(length));
   return ml;
 }
@@ -246,6 +625,10 @@ void gsl_matrix_list_free_matrices(gsl_matrix_list_t *ml) {
 }
 
 void gsl_matrix_list_set_zero(gsl_matrix_list_t *ml) {
+  if (ml->slab != NULL) {
+    memset(ml->slab->data, 0, ml->slab->size * sizeof(double));
+    return;
+  }
   for (int i = 0; i < ml->length; i++) {
     gsl_matrix_set_all(ml->data[i], 0.0);
   }
@@ -288,25 +671,38 @@ double euclidean_norm(gsl_matrix *m) {
   return sum;
 }
 
+/*
+  sum_columns stores the sum of the columns of src in the column vector dest
+*/
+void sum_columns(gsl_matrix *dest, gsl_matrix *src) {
+  assert(dest->size1 == src->size1 && dest->size2 == 1);
+  for (size_t i = 0; i < src->size1; i++) {
+    double sum = 0;
+    double *row = src->data + i * src->tda;
+    for (size_t j = 0; j < src->size2; j++) {
+      sum += row[j];
+    }
+    gsl_matrix_set(dest, i, 0, sum);
+  }
+}
+
 // BEGIN AUXILIARY FUNCTIONS
 
 
+/*
+  save writes a checkpoint of the network to a time stamped file, see
+  save_network
+*/
 void save(network_t *net) {
   char filepath[BUFFER_SIZE];
-  char buff[BUFFER_SIZE];
+  char buff[20];
   time_t now = time(NULL);
   strftime(buff, 20, "%Y-%m-%d%H:%M:%S", localtime(&now));
-  sprintf(filepath, "mnist_network%s.res", buff);
-  FILE *f = fopen(filepath, "w");
-  if (f == NULL) {
+  snprintf(filepath, BUFFER_SIZE, "mnist_network%s.ckpt", buff);
+  if (save_network(net, filepath) < 0) {
       printf("Error opening file!\n");
       exit(1);
   }
-  for (int i = 0; i < net->num_layers-1; i++) print_matrix(f, net->weights[i]);
-  fprintf(f, "\n");
-  for (int i = 0; i < net->num_layers-1; i++) print_matrix(f, net->biases[i]);
-  fprintf(f, "\n");
-  fclose(f);
 }
 
 // BEGIN ACTIVATION FUNCTIONS
@@ -314,6 +710,7 @@ void save(network_t *net) {
 
 af_t *use_sigmoid() {
   af_t *a = (af_t*)malloc(sizeof(af_t));
+  a->id = ACTIVATION_SIGMOID;
   a->f = &sigmoid;
   a->f_p = &sigmoid_prime;
   return a;
@@ -321,11 +718,24 @@ af_t *use_sigmoid() {
 
 af_t *use_relu() {
   af_t *a = (af_t*)malloc(sizeof(af_t));
+  a->id = ACTIVATION_RELU;
   a->f = &relu;
   a->f_p = &relu_prime;
   return a;
 }
 
+/*
+  use_fast_sigmoid selects a sigmoid built on the polynomial fast_exp, see
+  FAST_SIGMOID_MAX_ERROR for its accuracy
+*/
+af_t *use_fast_sigmoid() {
+  af_t *a = (af_t*)malloc(sizeof(af_t));
+  a->id = ACTIVATION_FAST_SIGMOID;
+  a->f = &fast_sigmoid;
+  a->f_p = &fast_sigmoid_prime;
+  return a;
+}
+
 double sigmoid_prime(double x) {
   return (sigmoid(x) * (1.0 - sigmoid(x)));
 }
@@ -334,6 +744,15 @@ double sigmoid(double x) {
   return (1.0 / (1.0 + exp(-(1.0) * x)));
 }
 
+double fast_sigmoid(double x) {
+  return (1.0 / (1.0 + fast_exp(-x)));
+}
+
+double fast_sigmoid_prime(double x) {
+  double s = fast_sigmoid(x);
+  return (s * (1.0 - s));
+}
+
 double relu(double x) {
   return (x > 0.0) ? x : 0;
 }
@@ -347,52 +766,58 @@ double relu_prime(double x) {
 
 cf_t *use_quad_cost() {
   cf_t *c = (cf_t*)malloc(sizeof(cf_t));
+  c->id = COST_QUAD;
   c->f = &quad_cost;
   c->f_p = &quad_cost_p;
+  c->f_float = &quad_cost_float;
+  c->f_p_float = &quad_cost_p_float;
   return c;
 }
 
 // quad_cost_p applies the derivative of the quadratic cost function
 void quad_cost_p(af_t *af, gsl_matrix *dest, gsl_matrix *a,
-                                      gsl_matrix *y, gsl_matrix *z) {
+                                      gsl_matrix *y, gsl_matrix *sp) {
   // calculate a - y
   assert(same_shape(a, y) && same_shape(y, dest));
-  gsl_matrix_add(dest, y);  // dest = y
-  gsl_matrix_scale(dest, -1.0); // dest = - y
-  gsl_matrix_add(dest, a);  // dest = a + (-y) = a - y
-  map(af->f_p, z);
-  gsl_matrix_mul_elements(dest, z);
+  gsl_matrix_memcpy(dest, a);
+  gsl_matrix_sub(dest, y);  // dest = a - y
+  gsl_matrix_mul_elements(dest, sp); // sp = f'(z) from the forward pass
 }
 
 // quad_cost applies the mean squared error cost
 double quad_cost(gsl_matrix *a, gsl_matrix *y) {
   // a_L - y
   assert(same_shape(a, y));
+  // summed over the columns (samples) of a batch
   int r = a->size1;
   double cost = 0;
   double delta;
   for (int i = 0; i < r; i++) {
-    delta = gsl_matrix_get(a, i, 0) - gsl_matrix_get(y, i, 0);
-    cost += pow(delta, 2);
+    for (size_t j = 0; j < a->size2; j++) {
+      delta = gsl_matrix_get(a, i, j) - gsl_matrix_get(y, i, j);
+      cost += pow(delta, 2);
+    }
   }
   return (cost/((double)r));
 }
 
 cf_t *use_cross_entropy_cost() {
   cf_t *c = (cf_t*)malloc(sizeof(cf_t));
+  c->id = COST_CROSS_ENTROPY;
   c->f = &cross_entropy;
   c->f_p = &cross_entropy_p;
+  c->f_float = &cross_entropy_float;
+  c->f_p_float = &cross_entropy_p_float;
   return c;
 }
 
 // cross_entropy_p applies the derivative of the cross entropy cost function
 void cross_entropy_p(af_t *af, gsl_matrix *dest, gsl_matrix *a,
-                                      gsl_matrix *y, gsl_matrix *z) {
+                                      gsl_matrix *y, gsl_matrix *sp) {
   // calculate a - y
   assert(same_shape(a, y) && same_shape(y, dest));
-  gsl_matrix_add(dest, y);  // dest = y
-  gsl_matrix_scale(dest, -1.0); // dest = - y
-  gsl_matrix_add(dest, a);  // dest = a + (-y) = a - y
+  gsl_matrix_memcpy(dest, a);
+  gsl_matrix_sub(dest, y);  // dest = a - y
 }
 
 double ce(double a, double y) {
@@ -407,11 +832,44 @@ double ce(double a, double y) {
 // cross_entropy applies the cross entropy cost
 double cross_entropy(gsl_matrix *a, gsl_matrix *y) {
   // a_L - y
+  assert(same_shape(a, y));
+  // summed over the columns (samples) of a batch
+  int r = a->size1;
+  double cost = 0;
+  for (int i = 0; i < r; i++) {
+    for (size_t j = 0; j < a->size2; j++) {
+      cost += ce(gsl_matrix_get(a, i, j), gsl_matrix_get(y, i, j));
+    }
+  }
+  return (cost/((double)r));
+}
+
+/*
+  use_softmax_cross_entropy_cost makes the output layer a softmax and the
+  cost its cross entropy. backprop gets the cost and the output error in
+  one pass from softmax_cross_entropy, f and f_p serve callers that only
+  hold the outputs. There is no single precision version.
+*/
+cf_t *use_softmax_cross_entropy_cost() {
+  cf_t *c = (cf_t*)malloc(sizeof(cf_t));
+  c->id = COST_SOFTMAX_CROSS_ENTROPY;
+  c->f = &softmax_cost;
+  c->f_p = &cross_entropy_p;
+  c->f_float = NULL;
+  c->f_p_float = NULL;
+  return c;
+}
+
+// softmax_cost applies the cross entropy cost to softmax outputs a
+double softmax_cost(gsl_matrix *a, gsl_matrix *y) {
   assert(same_shape(a, y));
   int r = a->size1;
   double cost = 0;
   for (int i = 0; i < r; i++) {
-    cost += ce(gsl_matrix_get(a, i, 0), gsl_matrix_get(y, i, 0));
+    for (size_t j = 0; j < a->size2; j++) {
+      double yij = gsl_matrix_get(y, i, j);
+      if (yij != 0) cost -= yij * log(fmax(gsl_matrix_get(a, i, j), GSL_DBL_MIN));
+    }
   }
   return (cost/((double)r));
 }
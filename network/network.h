@@ -1,7 +1,7 @@
 #ifndef __NETWORK_H__
 #define  __NETWORK_H__
 
-#include "../csapp.h"
+#include "../lib/csapp.h"
 #include <assert.h>
 #include <stdbool.h>
 #include <gsl/gsl_blas.h>
@@ -17,76 +17,390 @@
 // standard deviation of the gaussian distribution
 #define SIGMA 1
 
+// alignment in bytes of every tensor in a slab
+#define SLAB_ALIGN 64
+
+// activation function ids, selects the fused kernel for an af_t
+#define ACTIVATION_CUSTOM 0
+#define ACTIVATION_SIGMOID 1
+#define ACTIVATION_RELU 2
+#define ACTIVATION_FAST_SIGMOID 3
+
+// fast sigmoid: inputs are clamped to +-FAST_EXP_LIMIT, the absolute error
+// against the libm sigmoid is below FAST_SIGMOID_MAX_ERROR in double
+// precision and FAST_SIGMOID_MAX_ERROR_FLOAT in single precision
+#define FAST_EXP_LIMIT 50.0
+#define FAST_SIGMOID_MAX_ERROR 2e-9
+#define FAST_SIGMOID_MAX_ERROR_FLOAT 2e-7
+// the vector sigmoid kernels agree with the libm sigmoid to a relative
+// error below SIGMOID_MAX_ERROR, SIGMOID_MAX_ERROR_FLOAT in single precision
+#define SIGMOID_MAX_ERROR 1e-15
+#define SIGMOID_MAX_ERROR_FLOAT 5e-7
+
+// cost function ids, stored in checkpoints
+#define COST_CUSTOM 0
+#define COST_QUAD 1
+#define COST_CROSS_ENTROPY 2
+// softmax output layer fused with the cross entropy, see bias_softmax
+#define COST_SOFTMAX_CROSS_ENTROPY 3
+// the softmax kernels exponentiate with fast_exp, their outputs and log
+// normalizers are within SOFTMAX_MAX_ERROR of a libm softmax
+#define SOFTMAX_MAX_ERROR 1e-8
+
+// update rules of the optimizer kernel
+#define OPTIMIZER_MOMENTUM 0
+#define OPTIMIZER_NESTEROV 1
+
+// instruction sets of the fused kernels
+#define ISA_SCALAR 0
+#define ISA_AVX2 1
+#define ISA_AVX512 2
+
+// int8 inference, see quantize.c. Weights are quantized to
+// +-QUANT_WEIGHT_MAX so the sum of two uint8 x int8 products never
+// saturates the int16 lanes of vpmaddubsw
+#define QUANT_WEIGHT_MAX 63
+#define QUANT_ACTIVATION_MAX 255
+// weight and activation rows are padded to QUANT_ALIGN bytes
+#define QUANT_ALIGN 64
+
+// layer shapes (inputs, outputs) that get kernels specialized at compile
+// time, see specialized.c. These are the layers of main.c's LAYERS, build
+// with -DSPECIALIZED_SHAPES(X)=... to declare others.
+#ifndef SPECIALIZED_SHAPES
+#define SPECIALIZED_SHAPES(X) \
+  X(784, 30) \
+  X(30, 30) \
+  X(30, 10)
+#endif
+
+// checkpoint file format, see checkpoint.c
+#define CHECKPOINT_MAGIC 0x434e4e41 // "ANNC" in a little endian file
+#define CHECKPOINT_VERSION 1
+#define DTYPE_FLOAT64 0
+#define DTYPE_FLOAT32 1
+
 typedef struct gsl_matrix_list {
   int length;
   gsl_matrix **data;
+  gsl_block *slab; // contiguous region holding every matrix, or NULL
 } gsl_matrix_list_t;
 
+typedef struct gsl_matrix_float_list {
+  int length;
+  gsl_matrix_float **data;
+  gsl_block_float *slab;
+} gsl_matrix_float_list_t;
+
+/*
+  slab stores one value per weight and bias of a network in a single
+  SLAB_ALIGN aligned buffer, weights first and then biases, each tensor
+  starting on an aligned offset. The per layer matrices are views into it,
+  so zeroing, reducing or updating a whole set of parameters is one pass
+  over one array.
+*/
+typedef struct slab {
+  gsl_block *block;
+  gsl_matrix_list_t *weights;
+  gsl_matrix_list_t *biases;
+  void *map;       // file mapping that holds block->data, or NULL
+  size_t map_size;
+} slab_t;
+
+typedef struct slab_float {
+  gsl_block_float *block;
+  gsl_matrix_float_list_t *weights;
+  gsl_matrix_float_list_t *biases;
+} slab_float_t;
+
 typedef struct af {
+  int id; // ACTIVATION_* id
   double (*f)(double); // activation function
   double (*f_p)(double); // activation function derivative
 } af_t;
 
 typedef struct cf {
+  int id; // COST_* id
   double (*f)(gsl_matrix*, gsl_matrix*); // cost function
   void (*f_p)(af_t*, gsl_matrix*, gsl_matrix*, gsl_matrix*, gsl_matrix*); // cost function prime
+  double (*f_float)(gsl_matrix_float*, gsl_matrix_float*); // single precision cost
+  void (*f_p_float)(af_t*, gsl_matrix_float*, gsl_matrix_float*,
+                    gsl_matrix_float*, gsl_matrix_float*); // single precision prime
 } cf_t;
 
+/*
+  checkpoint_header starts a checkpoint file. The parameter slab of the
+  network follows at params_offset, byte for byte as init_slab lays it out,
+  so a mapped checkpoint can be used in place.
+*/
+typedef struct checkpoint_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t dtype;       // DTYPE_* of the parameters
+  uint32_t activation;  // ACTIVATION_* id
+  uint32_t cost;        // COST_* id
+  uint32_t optimizer;
+  uint32_t num_layers;
+  uint32_t layers[MAX_LAYERS];
+  uint64_t params_offset; // SLAB_ALIGN aligned
+  uint64_t params_size;   // in bytes
+} checkpoint_header_t;
+
+/*
+  sparse_t is a batch of inputs stored by their nonzero entries, sample j
+  has the entries start[j] to start[j+1]-1 of index and value
+*/
+typedef struct sparse {
+  size_t n;         // samples
+  size_t capacity;  // entries index and value can hold
+  size_t *start;    // n+1 offsets
+  int *index;       // input of each entry
+  double *value;
+} sparse_t;
+
+/*
+  workspace holds every temporary of a training step. All of its matrices
+  are carved out of a single arena that is only reallocated when the batch
+  size changes, so the steady state training loop never touches the heap.
+*/
+typedef struct workspace {
+  gsl_block *arena;
+  gsl_matrix *target;         // one-hot targets, output layer x batch
+  gsl_matrix_list_t *deltas;  // error of each layer, layer x batch
+  sparse_t *sparse;           // sparse input loaded in place, grown on demand
+  double *lse;                // log of the softmax normalizer of each sample
+} workspace_t;
+
+typedef struct workspace_float {
+  gsl_block_float *arena;
+  gsl_matrix_float *target;
+  gsl_matrix_float_list_t *deltas;
+} workspace_float_t;
+
 typedef struct network {
+  struct network *parent; // network whose parameters a replica shares, or NULL
   af_t *activation;
   cf_t *cost;
+  int optimizer; // OPTIMIZER_* update rule, momentum by default
   double obj_fun;
 
   int num_layers;
   int layers[MAX_LAYERS];
-  gsl_matrix **weights;
+  size_t batch_size; // number of columns (samples) in each activation/output
+  slab_t *params;      // weights and biases
+  slab_t *grads;       // weight_grads and bias_grads
+  slab_t *delta_grads; // delta_weight_grads and delta_bias_grads
+  gsl_matrix **weights; // views into params
   gsl_matrix **biases;
   gsl_matrix_list_t *activations;
   gsl_matrix_list_t *outputs;
+  gsl_matrix_list_t *derivatives; // activation derivative of each output
   gsl_matrix_list_t *weight_grads;
   gsl_matrix_list_t *bias_grads;
   gsl_matrix_list_t *delta_weight_grads;
   gsl_matrix_list_t *delta_bias_grads;
+  workspace_t *ws;
+  sparse_t *sparse_input; // input layer when loaded with load_sparse, or NULL
+  slab_t *mask;           // 0 for every pruned weight and 1 elsewhere, or NULL
 } network_t;
 
-const gsl_rng_type * T;
-gsl_rng * r;
+/*
+  model is a frozen network for inference. It holds the activation and the
+  parameters only and never writes them, so any number of threads can
+  predict with one model, each passing its own scratch.
+*/
+typedef struct model {
+  int num_layers;
+  int layers[MAX_LAYERS];
+  af_t *activation;
+  bool softmax;         // the output layer is a softmax, see COST_SOFTMAX_CROSS_ENTROPY
+  slab_t *params;
+  gsl_matrix **weights; // views into params
+  gsl_matrix **biases;
+} model_t;
+
+/*
+  scratch holds the buffers of one thread predicting with a model, for
+  batches of up to max_batch samples, carved out of a single arena
+*/
+typedef struct scratch {
+  size_t max_batch;
+  size_t input_size;
+  gsl_block *arena;
+  gsl_matrix *buffers[2]; // activations of even and odd layers, widest layer x max_batch
+  gsl_matrix *z;          // weighted inputs of a layer
+  gsl_matrix_view in;     // the last scratch_input
+  gsl_matrix_view out;    // the last prediction
+} scratch_t;
+
+/*
+  csr stores a sparse matrix row by row, row r has the entries
+  row_start[r] to row_start[r+1]-1 of col and value
+*/
+typedef struct csr {
+  size_t rows;
+  size_t cols;
+  uint32_t *row_start; // rows+1 offsets
+  uint32_t *col;
+  double *value;
+} csr_t;
+
+/*
+  sparse_model is a model of a pruned network with its weights in CSR,
+  it predicts with a scratch like model_t
+*/
+typedef struct sparse_model {
+  int num_layers;
+  int layers[MAX_LAYERS];
+  af_t *activation;
+  bool softmax;
+  csr_t **weights;
+  gsl_matrix **biases;
+} sparse_model_t;
+
+/*
+  qmodel is a model with int8 weights, one scale per weight row, for
+  inference on uint8 inputs. The activations between layers are uint8 too,
+  layer l reads them scaled by input_scales[l].
+*/
+typedef struct qmodel {
+  int num_layers;
+  int layers[MAX_LAYERS];
+  size_t strides[MAX_LAYERS];      // padded row length of weights[l] and of its inputs
+  double input_scales[MAX_LAYERS]; // value of one step of the uint8 inputs of layer l
+  af_t *activation;
+  bool softmax;
+  int8_t **weights;                // layers[l+1] rows of strides[l] weights
+  double **multipliers;            // per row, weight scale times input_scales[l]
+  gsl_matrix **biases;
+} qmodel_t;
+
+/*
+  qscratch holds the buffers of one thread predicting with a qmodel
+*/
+typedef struct qscratch {
+  size_t max_batch;
+  uint8_t *inputs;   // max_batch rows of quantized activations, widest stride
+  int32_t *dots;     // widest layer x max_batch int32 dot products
+  gsl_matrix *z;     // widest layer x max_batch
+  gsl_matrix *a;
+  gsl_matrix_view out;
+} qscratch_t;
+
+// single precision (float32) network, same layout as network_t
+typedef struct network_float {
+  af_t *activation;
+  cf_t *cost;
+  int optimizer;
+  double obj_fun;
+
+  int num_layers;
+  int layers[MAX_LAYERS];
+  size_t batch_size; // number of columns (samples) in each activation/output
+  slab_float_t *params;
+  slab_float_t *grads;
+  slab_float_t *delta_grads;
+  gsl_matrix_float **weights;
+  gsl_matrix_float **biases;
+  gsl_matrix_float_list_t *activations;
+  gsl_matrix_float_list_t *outputs;
+  gsl_matrix_float_list_t *derivatives;
+  gsl_matrix_float_list_t *weight_grads;
+  gsl_matrix_float_list_t *bias_grads;
+  gsl_matrix_float_list_t *delta_weight_grads;
+  gsl_matrix_float_list_t *delta_bias_grads;
+  workspace_float_t *ws;
+} network_float_t;
+
+extern const gsl_rng_type * T;
+extern gsl_rng * r;
 
 // network functions
 network_t *init_network(int layers[], int num_layers, af_t *activation, cf_t *cost);
 void free_network(network_t *net);
+network_t *init_network_replica(network_t *net);
 void feedforward(network_t* net, gsl_matrix *a);
 void activateLayer(network_t *net, int l);
+void load_sparse(network_t *net, sparse_t *x);
+sparse_t *sparse_alloc(size_t n, size_t capacity);
+void sparse_free(sparse_t *x);
+void set_batch_size(network_t *net, size_t batch_size);
+workspace_t *init_workspace(network_t *net);
+void free_workspace(workspace_t *ws);
+size_t alloc_count();
+
+double backprop(network_t *net, gsl_matrix *target);
+void init_rng();
 
-void backprop(network_t *net, gsl_matrix *target);
+// single precision network functions (network_float.c)
+network_float_t *init_network_float(int layers[], int num_layers, af_t *activation, cf_t *cost);
+void free_network_float(network_float_t *net);
+void feedforward_float(network_float_t* net, gsl_matrix_float *a);
+void activateLayer_float(network_float_t *net, int l);
+void set_batch_size_float(network_float_t *net, size_t batch_size);
+workspace_float_t *init_workspace_float(network_float_t *net);
+void free_workspace_float(workspace_float_t *ws);
+void backprop_float(network_float_t *net, gsl_matrix_float *target);
 
 // activation functions
 af_t *use_sigmoid();
 af_t *use_relu();
+af_t *use_fast_sigmoid();
 
 double sigmoid(double z);
 double sigmoid_prime(double x);
+double fast_sigmoid(double x);
+double fast_sigmoid_prime(double x);
 double relu(double z);
 double relu_prime(double x);
 
 // cost functions
 cf_t *use_quad_cost();
 cf_t *use_cross_entropy_cost();
+cf_t *use_softmax_cross_entropy_cost();
 
 void quad_cost_p(af_t *af, gsl_matrix *dest, gsl_matrix *a,
-                                      gsl_matrix *y, gsl_matrix *z);
+                                      gsl_matrix *y, gsl_matrix *sp);
 double quad_cost(gsl_matrix *a, gsl_matrix *y);
 
 void cross_entropy_p(af_t *af, gsl_matrix *dest, gsl_matrix *a,
-                                      gsl_matrix *y, gsl_matrix *z);
+                                      gsl_matrix *y, gsl_matrix *sp);
 double cross_entropy(gsl_matrix *a, gsl_matrix *y);
+double ce(double a, double y);
+
+double softmax_cost(gsl_matrix *a, gsl_matrix *y);
+
+void quad_cost_p_float(af_t *af, gsl_matrix_float *dest, gsl_matrix_float *a,
+                                      gsl_matrix_float *y, gsl_matrix_float *sp);
+double quad_cost_float(gsl_matrix_float *a, gsl_matrix_float *y);
+void cross_entropy_p_float(af_t *af, gsl_matrix_float *dest, gsl_matrix_float *a,
+                                      gsl_matrix_float *y, gsl_matrix_float *sp);
+double cross_entropy_float(gsl_matrix_float *a, gsl_matrix_float *y);
 
 
 // auxiliary functions
 void save(network_t *net);
 
+// checkpoints (checkpoint.c)
+int save_network(network_t *net, const char *path);
+network_t *load_network(const char *path);
+model_t *load_model(const char *path);
+af_t *activation_from_id(int id);
+cf_t *cost_from_id(int id);
+
 // matrix functions
 gsl_matrix *rand_gaussian_matrix(size_t rows, size_t cols);
+void rand_gaussian_fill(gsl_matrix *m);
+size_t slab_layout(int layers[], int num_layers, size_t elem_size,
+                    size_t w_offsets[], size_t b_offsets[], size_t *weights_size);
+size_t slab_size(int layers[], int num_layers);
+slab_t *init_slab(network_t *net);
+slab_t *init_slab_from_block(int layers[], int num_layers, gsl_block *block);
+network_t *alloc_network(int layers[], int num_layers, af_t *activation, cf_t *cost);
+void init_network_buffers(network_t *net);
+void free_slab(slab_t *s);
+void slab_set_zero(slab_t *s);
+void slab_add(slab_t *dest, slab_t *src);
 void map(double (*f)(double), gsl_matrix *m);
 void map_from(double (*f)(double), gsl_matrix *dest, gsl_matrix *src);
 void print_matrix(FILE *f, const gsl_matrix *m);
@@ -99,8 +413,76 @@ gsl_matrix_list_t *init_bias_grads(network_t *net);
 gsl_matrix_list_t *init_weight_grads(network_t *net);
 void print_shape(gsl_matrix *m, const char *msg);
 void init_outputs(network_t *net);
+void init_derivatives(network_t *net);
 void init_activations(network_t *net);
 void gsl_matrix_list_set_zero(gsl_matrix_list_t *ml);
 double euclidean_norm(gsl_matrix *m);
+void sum_columns(gsl_matrix *dest, gsl_matrix *src);
+
+// inference models (model.c)
+model_t *init_model(int layers[], int num_layers, af_t *activation, slab_t *params);
+model_t *freeze_network(network_t *net);
+void free_model(model_t *m);
+scratch_t *init_scratch(model_t *m, size_t max_batch);
+scratch_t *alloc_scratch(int layers[], int num_layers, size_t max_batch);
+void free_scratch(scratch_t *s);
+gsl_matrix *scratch_input(scratch_t *s, size_t n);
+gsl_matrix *model_predict(model_t *m, scratch_t *s, gsl_matrix *input);
+
+// compile time specialized kernels (specialized.c)
+bool specialized_forward(gsl_matrix *w, gsl_matrix *a, gsl_matrix *z);
+bool specialized_backward(gsl_matrix *w, gsl_matrix *delta, gsl_matrix *out);
+bool specialized_weight_grad(gsl_matrix *delta, gsl_matrix *a, gsl_matrix *g);
+
+// pruning and CSR inference (prune.c)
+size_t prune_network(network_t *net, double sparsity);
+void apply_mask(network_t *net, size_t first, size_t n);
+csr_t *csr_from_matrix(gsl_matrix *m);
+void csr_free(csr_t *w);
+void csr_matmul(csr_t *w, gsl_matrix *x, gsl_matrix *y);
+sparse_model_t *export_sparse_model(network_t *net);
+void free_sparse_model(sparse_model_t *sm);
+size_t sparse_model_size(sparse_model_t *sm);
+scratch_t *init_sparse_scratch(sparse_model_t *sm, size_t max_batch);
+gsl_matrix *sparse_model_predict(sparse_model_t *sm, scratch_t *s, gsl_matrix *input);
+
+// int8 inference (quantize.c)
+qmodel_t *quantize_network(network_t *net, double input_scale, gsl_matrix *calibration);
+void free_qmodel(qmodel_t *qm);
+qscratch_t *init_qscratch(qmodel_t *qm, size_t max_batch);
+void free_qscratch(qscratch_t *s);
+gsl_matrix *qmodel_predict(qmodel_t *qm, qscratch_t *s, const uint8_t *input, size_t n);
+
+// single precision matrix functions (network_float.c)
+void rand_gaussian_fill_float(gsl_matrix_float *m);
+slab_float_t *init_slab_float(network_float_t *net);
+void free_slab_float(slab_float_t *s);
+void slab_set_zero_float(slab_float_t *s);
+void slab_add_float(slab_float_t *dest, slab_float_t *src);
+bool same_shape_float(gsl_matrix_float *a, gsl_matrix_float *b);
+gsl_matrix_float_list_t *gsl_matrix_float_list_malloc(size_t length);
+void gsl_matrix_float_list_free(gsl_matrix_float_list_t *ml);
+void gsl_matrix_float_list_set_zero(gsl_matrix_float_list_t *ml);
+void init_outputs_float(network_float_t *net);
+void init_derivatives_float(network_float_t *net);
+void init_activations_float(network_float_t *net);
+void sum_columns_float(gsl_matrix_float *dest, gsl_matrix_float *src);
+
+// fused kernels (kernels.c)
+int kernel_isa();
+double fast_exp(double x);
+float fast_exp_float(float x);
+void bias_activate(af_t *af, gsl_matrix *z, gsl_matrix *b, gsl_matrix *a, gsl_matrix *sp);
+void bias_activate_float(af_t *af, gsl_matrix_float *z, gsl_matrix_float *b,
+                            gsl_matrix_float *a, gsl_matrix_float *sp);
+void bias_softmax(gsl_matrix *z, gsl_matrix *b, gsl_matrix *a, double *lse);
+double softmax_cross_entropy(gsl_matrix *z, const double *lse, gsl_matrix *a,
+                                gsl_matrix *y, gsl_matrix *delta);
+void sgd_update(int optimizer, double *w, double *v, const double *g,
+                  size_t n, double decay, double mu, double eta);
+void sgd_update_float(int optimizer, float *w, float *v, const float *g,
+                  size_t n, float decay, float mu, float eta);
+void dot_u8s8(const int8_t *w, size_t ldw, size_t rows, const uint8_t *x, size_t ldx,
+                size_t n, size_t k, int32_t *c, size_t ldc);
 
 #endif
@@ -0,0 +1,390 @@
+#include "network.h"
+
+/*
+  Single precision (float32) counterparts of the network routines in
+  network.c. They are backed by gsl_matrix_float and gsl_blas_sgemm, which
+  halves the memory traffic of weights, gradients and inputs.
+*/
+
+// BEGIN NETWORK FUNCTIONS
+
+/*
+  initialize a single precision network, the network owns activation and
+  cost. It returns NULL, freeing both, if the cost has no single precision
+  version, as the softmax cross entropy does not.
+*/
+network_float_t *init_network_float(int layers[], int num_layers, af_t *activation, cf_t *cost) {
+  if (cost->f_float == NULL || cost->f_p_float == NULL) {
+    fprintf(stderr, "%s\n", "the cost function has no single precision version");
+    free(activation);
+    free(cost);
+    return NULL;
+  }
+
+  init_rng();
+  network_float_t *net = (network_float_t*) malloc(sizeof(network_float_t));
+  net->num_layers = num_layers;
+  memcpy(net->layers, layers, num_layers*sizeof(int));
+  net->activation = activation;
+  net->cost = cost;
+  net->optimizer = OPTIMIZER_MOMENTUM;
+  net->obj_fun = 0;
+  net->batch_size = 1;
+  net->params = init_slab_float(net);
+  net->weights = net->params->weights->data;
+  net->biases = net->params->biases->data;
+  // Generate random biases and weights.
+  for (int l = 1; l < num_layers; l++) {
+    rand_gaussian_fill_float(net->biases[l-1]);
+    rand_gaussian_fill_float(net->weights[l-1]);
+  }
+  init_activations_float(net);
+  init_outputs_float(net);
+  init_derivatives_float(net);
+  net->ws = init_workspace_float(net);
+  net->grads = init_slab_float(net);
+  net->bias_grads = net->grads->biases;
+  net->weight_grads = net->grads->weights;
+  net->delta_grads = init_slab_float(net);
+  net->delta_bias_grads = net->delta_grads->biases;
+  net->delta_weight_grads = net->delta_grads->weights;
+
+  return net;
+}
+
+/*
+ free a single precision network
+*/
+void free_network_float(network_float_t* net) {
+  gsl_matrix_float_list_free(net->activations);
+  gsl_matrix_float_list_free(net->outputs);
+  gsl_matrix_float_list_free(net->derivatives);
+  free_slab_float(net->params);
+  free_slab_float(net->grads);
+  free_slab_float(net->delta_grads);
+  free_workspace_float(net->ws);
+  free(net->activation);
+  free(net->cost);
+  free(net);
+}
+
+/*
+  set_batch_size_float resizes the activations and outputs to batch_size columns
+*/
+void set_batch_size_float(network_float_t *net, size_t batch_size) {
+  if (net->batch_size == batch_size) return;
+  gsl_matrix_float_list_free(net->activations);
+  gsl_matrix_float_list_free(net->outputs);
+  gsl_matrix_float_list_free(net->derivatives);
+  net->batch_size = batch_size;
+  init_activations_float(net);
+  init_outputs_float(net);
+  init_derivatives_float(net);
+  free_workspace_float(net->ws);
+  net->ws = init_workspace_float(net);
+}
+
+/*
+ perform feedforward proceedure on the network, one column per sample
+*/
+void feedforward_float(network_float_t* net, gsl_matrix_float *a) {
+  assert(net->layers[0] == a->size1);
+  if (a->size2 != net->batch_size) set_batch_size_float(net, a->size2);
+  assert(net->activations->length == net->num_layers);
+  assert(net->outputs->length == net->num_layers-1);
+  // the input may already have been loaded in place
+  if (a != net->activations->data[0]) gsl_matrix_float_memcpy(net->activations->data[0], a);
+
+  for (int i = 0; i < (net->num_layers-1); i++) {
+    activateLayer_float(net, i);
+  }
+}
+
+// activateLayer_float is the inner loop of the feed forward
+void activateLayer_float(network_float_t *net, int l) {
+  gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1.0f, net->weights[l],
+                net->activations->data[l], 0.0f, net->outputs->data[l]);
+  bias_activate_float(net->activation, net->outputs->data[l], net->biases[l],
+                net->activations->data[l+1], net->derivatives->data[l]);
+}
+
+/*
+  backprop_float computes the gradients summed over the batch last passed
+  to feedforward_float
+*/
+void backprop_float(network_float_t *net, gsl_matrix_float *target) {
+  // dimensional check
+  assert(net->delta_weight_grads->length == net->num_layers-1
+          && net->delta_bias_grads->length == net->num_layers-1);
+  assert(target->size2 == net->batch_size);
+
+  size_t asize = net->num_layers;
+  size_t zsize = net->num_layers-1;
+  size_t wgrad_size = net->delta_weight_grads->length;
+  size_t bgrad_size = net->delta_bias_grads->length;
+  // deltas[l] is the error of layer l+1, preallocated in the workspace
+  gsl_matrix_float **deltas = net->ws->deltas->data;
+
+  // propogate backward thru the network
+  (*net->cost->f_p_float)(net->activation, deltas[zsize-1], net->activations->data[asize-1],
+                                        target, net->derivatives->data[zsize-1]);
+
+  sum_columns_float(net->delta_bias_grads->data[bgrad_size-1], deltas[zsize-1]);
+
+  // C = alpha * f1(A) * f2(B) + beta * C
+  gsl_blas_sgemm(CblasNoTrans, CblasTrans, 1.0f, deltas[zsize-1],
+                  net->activations->data[asize-2], 0.0f, net->delta_weight_grads->data[wgrad_size-1]);
+
+  for (int l = 2; l < net->num_layers; l++) {
+    gsl_matrix_float *sp = net->derivatives->data[zsize-l];
+    gsl_matrix_float *delta = deltas[zsize-l];
+    gsl_blas_sgemm(CblasTrans, CblasNoTrans, 1.0f, net->weights[(wgrad_size-l+1)],
+                    deltas[zsize-l+1], 0.0f, delta);
+    gsl_matrix_float_mul_elements(delta, sp);
+    sum_columns_float(net->delta_bias_grads->data[bgrad_size-l], delta);
+    gsl_blas_sgemm(CblasNoTrans, CblasTrans, 1.0f, delta,
+                    net->activations->data[asize-l-1], 0.0f, net->delta_weight_grads->data[wgrad_size-l]);
+  }
+}
+
+// BEGIN MATRIX FUNCTIONS
+
+bool same_shape_float(gsl_matrix_float *a, gsl_matrix_float *b) {
+  return (a->size1 == b->size1 && a->size2 == b->size2);
+}
+
+/*
+ fill a matrix with gaussian noise with standard deviation SIGMA
+ scaled by the square root of its number of columns
+*/
+void rand_gaussian_fill_float(gsl_matrix_float *m) {
+  init_rng();
+  for (size_t i = 0; i < m->size1; i++) {
+    for (size_t j = 0; j < m->size2; j++) {
+       double x = gsl_ran_gaussian(r, SIGMA);
+       gsl_matrix_float_set (m, i, j, x/sqrt(m->size2));
+    }
+  }
+}
+
+/*
+  init_slab_float allocates a zeroed slab with one tensor per weight and
+  bias matrix of the network
+*/
+slab_float_t *init_slab_float(network_float_t *net) {
+  size_t w_offsets[MAX_LAYERS], b_offsets[MAX_LAYERS], weights_size;
+  slab_float_t *s = (slab_float_t*) malloc(sizeof(slab_float_t));
+  s->block = (gsl_block_float*) malloc(sizeof(gsl_block_float));
+  s->block->size = slab_layout(net->layers, net->num_layers, sizeof(float),
+                                w_offsets, b_offsets, &weights_size);
+  if (posix_memalign((void**)&s->block->data, SLAB_ALIGN, s->block->size * sizeof(float))) {
+    fprintf(stderr, "%s\n", "slab allocation failed");
+    exit(1);
+  }
+  memset(s->block->data, 0, s->block->size * sizeof(float));
+
+  s->weights = gsl_matrix_float_list_malloc(net->num_layers-1);
+  s->biases = gsl_matrix_float_list_malloc(net->num_layers-1);
+  s->weights->slab = (gsl_block_float*) malloc(sizeof(gsl_block_float));
+  s->weights->slab->size = weights_size;
+  s->weights->slab->data = s->block->data;
+  s->biases->slab = (gsl_block_float*) malloc(sizeof(gsl_block_float));
+  s->biases->slab->size = s->block->size - weights_size;
+  s->biases->slab->data = s->block->data + weights_size;
+  for (int l = 1; l < net->num_layers; l++) {
+    s->weights->data[l-1] = gsl_matrix_float_alloc_from_block(s->block, w_offsets[l-1],
+                              net->layers[l], net->layers[l-1], net->layers[l-1]);
+    s->biases->data[l-1] = gsl_matrix_float_alloc_from_block(s->block, b_offsets[l-1],
+                              net->layers[l], 1, 1);
+  }
+  return s;
+}
+
+void free_slab_float(slab_float_t *s) {
+  // the regions and matrices are views, the data is freed with the block
+  free(s->weights->slab);
+  free(s->biases->slab);
+  gsl_matrix_float_list_free(s->weights);
+  gsl_matrix_float_list_free(s->biases);
+  gsl_block_float_free(s->block);
+  free(s);
+}
+
+void slab_set_zero_float(slab_float_t *s) {
+  memset(s->block->data, 0, s->block->size * sizeof(float));
+}
+
+/*
+  slab_add_float adds src to dest element wise, both must come from the same network
+*/
+void slab_add_float(slab_float_t *dest, slab_float_t *src) {
+  assert(dest->block->size == src->block->size);
+  float *d = dest->block->data;
+  const float *a = src->block->data;
+  for (size_t i = 0; i < dest->block->size; i++) {
+    d[i] += a[i];
+  }
+}
+
+void init_outputs_float(network_float_t *net) {
+  gsl_matrix_float_list_t *ml = (gsl_matrix_float_list_t*) malloc(sizeof(gsl_matrix_float_list_t));
+  ml->length = net->num_layers-1;
+  ml->slab = NULL;
+  ml->data = (gsl_matrix_float**) malloc(sizeof(gsl_matrix_float*)*(net->num_layers-1));
+  for (int l = 1; l < net->num_layers; l++) {
+    ml->data[l-1] = gsl_matrix_float_calloc(net->layers[l], net->batch_size);
+  }
+  net->outputs = ml;
+}
+
+void init_derivatives_float(network_float_t *net) {
+  gsl_matrix_float_list_t *ml = (gsl_matrix_float_list_t*) malloc(sizeof(gsl_matrix_float_list_t));
+  ml->length = net->num_layers-1;
+  ml->slab = NULL;
+  ml->data = (gsl_matrix_float**) malloc(sizeof(gsl_matrix_float*)*(net->num_layers-1));
+  for (int l = 1; l < net->num_layers; l++) {
+    ml->data[l-1] = gsl_matrix_float_calloc(net->layers[l], net->batch_size);
+  }
+  net->derivatives = ml;
+}
+
+/*
+  init_workspace_float carves the target and the per layer deltas for the
+  current batch size out of one arena
+*/
+workspace_float_t *init_workspace_float(network_float_t *net) {
+  size_t n = net->batch_size;
+  size_t total = net->layers[net->num_layers-1] * n;
+  for (int l = 1; l < net->num_layers; l++) {
+    total += net->layers[l] * n;
+  }
+  workspace_float_t *ws = (workspace_float_t*) malloc(sizeof(workspace_float_t));
+  ws->arena = gsl_block_float_alloc(total);
+  size_t offset = 0;
+  ws->target = gsl_matrix_float_alloc_from_block(ws->arena, offset,
+                    net->layers[net->num_layers-1], n, n);
+  offset += net->layers[net->num_layers-1] * n;
+  ws->deltas = (gsl_matrix_float_list_t*) malloc(sizeof(gsl_matrix_float_list_t));
+  ws->deltas->length = net->num_layers-1;
+  ws->deltas->slab = NULL;
+  ws->deltas->data = (gsl_matrix_float**) malloc(sizeof(gsl_matrix_float*)*(net->num_layers-1));
+  for (int l = 1; l < net->num_layers; l++) {
+    ws->deltas->data[l-1] = gsl_matrix_float_alloc_from_block(ws->arena, offset, net->layers[l], n, n);
+    offset += net->layers[l] * n;
+  }
+  return ws;
+}
+
+void free_workspace_float(workspace_float_t *ws) {
+  // the matrices are views into the arena, this only frees their structs
+  gsl_matrix_float_free(ws->target);
+  gsl_matrix_float_list_free(ws->deltas);
+  gsl_block_float_free(ws->arena);
+  free(ws);
+}
+
+void init_activations_float(network_float_t *net) {
+  gsl_matrix_float_list_t *ml = (gsl_matrix_float_list_t*) malloc(sizeof(gsl_matrix_float_list_t));
+  ml->length = net->num_layers;
+  ml->slab = NULL;
+  ml->data = (gsl_matrix_float**) malloc(sizeof(gsl_matrix_float*)*(net->num_layers));
+  for (int l = 0; l < net->num_layers; l++) {
+    ml->data[l] = gsl_matrix_float_calloc(net->layers[l], net->batch_size);
+  }
+  net->activations = ml;
+}
+
+/*
+  create an array of gsl_matrix_floats
+*/
+gsl_matrix_float_list_t *gsl_matrix_float_list_malloc(size_t length) {
+  gsl_matrix_float_list_t *ml = (gsl_matrix_float_list_t*) malloc(sizeof(gsl_matrix_float_list_t));
+  ml->length = length;
+  ml->slab = NULL;
+  ml->data = (gsl_matrix_float**) malloc(sizeof(gsl_matrix_float*)*(length));
+  return ml;
+}
+
+void gsl_matrix_float_list_free(gsl_matrix_float_list_t *ml) {
+  for (int i = 0; i < ml->length; i++) {
+    gsl_matrix_float_free(ml->data[i]);
+  }
+  free(ml->data);
+  free(ml);
+}
+
+void gsl_matrix_float_list_set_zero(gsl_matrix_float_list_t *ml) {
+  if (ml->slab != NULL) {
+    memset(ml->slab->data, 0, ml->slab->size * sizeof(float));
+    return;
+  }
+  for (int i = 0; i < ml->length; i++) {
+    gsl_matrix_float_set_all(ml->data[i], 0.0f);
+  }
+}
+
+/*
+  sum_columns_float stores the sum of the columns of src in the column vector dest
+*/
+void sum_columns_float(gsl_matrix_float *dest, gsl_matrix_float *src) {
+  assert(dest->size1 == src->size1 && dest->size2 == 1);
+  for (size_t i = 0; i < src->size1; i++) {
+    float sum = 0;
+    float *row = src->data + i * src->tda;
+    for (size_t j = 0; j < src->size2; j++) {
+      sum += row[j];
+    }
+    gsl_matrix_float_set(dest, i, 0, sum);
+  }
+}
+
+// BEGIN COST FUNCTIONS
+
+// quad_cost_p_float applies the derivative of the quadratic cost function
+void quad_cost_p_float(af_t *af, gsl_matrix_float *dest, gsl_matrix_float *a,
+                                      gsl_matrix_float *y, gsl_matrix_float *sp) {
+  // calculate a - y
+  assert(same_shape_float(a, y) && same_shape_float(y, dest));
+  gsl_matrix_float_memcpy(dest, a);
+  gsl_matrix_float_sub(dest, y);  // dest = a - y
+  gsl_matrix_float_mul_elements(dest, sp); // sp = f'(z) from the forward pass
+}
+
+// quad_cost_float applies the mean squared error cost
+double quad_cost_float(gsl_matrix_float *a, gsl_matrix_float *y) {
+  // summed over the columns (samples) of a batch
+  assert(same_shape_float(a, y));
+  int r = a->size1;
+  double cost = 0;
+  double delta;
+  for (int i = 0; i < r; i++) {
+    for (size_t j = 0; j < a->size2; j++) {
+      delta = gsl_matrix_float_get(a, i, j) - gsl_matrix_float_get(y, i, j);
+      cost += delta * delta;
+    }
+  }
+  return (cost/((double)r));
+}
+
+// cross_entropy_p_float applies the derivative of the cross entropy cost function
+void cross_entropy_p_float(af_t *af, gsl_matrix_float *dest, gsl_matrix_float *a,
+                                      gsl_matrix_float *y, gsl_matrix_float *sp) {
+  // calculate a - y
+  assert(same_shape_float(a, y) && same_shape_float(y, dest));
+  gsl_matrix_float_memcpy(dest, a);
+  gsl_matrix_float_sub(dest, y);  // dest = a - y
+}
+
+// cross_entropy_float applies the cross entropy cost
+double cross_entropy_float(gsl_matrix_float *a, gsl_matrix_float *y) {
+  // summed over the columns (samples) of a batch
+  assert(same_shape_float(a, y));
+  int r = a->size1;
+  double cost = 0;
+  for (int i = 0; i < r; i++) {
+    for (size_t j = 0; j < a->size2; j++) {
+      cost += ce(gsl_matrix_float_get(a, i, j), gsl_matrix_float_get(y, i, j));
+    }
+  }
+  return (cost/((double)r));
+}
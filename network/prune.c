@@ -0,0 +1,201 @@
+#include "network.h"
+
+/*
+  Magnitude pruning. prune_network zeroes the smallest weights of every
+  layer and records them in a mask over the parameter slab, which the
+  trainers apply after every update, so fine tuning a pruned network keeps
+  the pruned weights at zero. export_sparse_model then stores each layer in
+  CSR, and csr_matmul only reads the weights that are left.
+*/
+
+static int compare_abs(const void *a, const void *b) {
+  double x = fabs(*(const double*)a);
+  double y = fabs(*(const double*)b);
+  return (x > y) - (x < y);
+}
+
+/*
+  prune_network zeroes the sparsity fraction of smallest magnitude weights
+  in every layer of net and masks them for further training. Biases are
+  never pruned. It returns the number of pruned weights.
+*/
+size_t prune_network(network_t *net, double sparsity) {
+  assert(sparsity >= 0 && sparsity < 1);
+  if (net->mask == NULL) {
+    net->mask = init_slab(net);
+    for (size_t i = 0; i < net->mask->block->size; i++) net->mask->block->data[i] = 1;
+  }
+  size_t pruned = 0;
+  for (int l = 0; l < net->num_layers-1; l++) {
+    gsl_matrix *w = net->weights[l];
+    gsl_matrix *m = net->mask->weights->data[l];
+    size_t n = w->size1 * w->size2;
+    size_t k = (size_t)(sparsity * n);
+    if (k == 0) continue;
+    double *sorted = (double*) malloc(n * sizeof(double));
+    for (size_t r = 0; r < w->size1; r++) {
+      memcpy(sorted + r * w->size2, w->data + r * w->tda, w->size2 * sizeof(double));
+    }
+    qsort(sorted, n, sizeof(double), compare_abs);
+    double threshold = fabs(sorted[k-1]);
+    free(sorted);
+    // zero exactly k weights, ties at the threshold go first come first
+    size_t count = 0;
+    for (size_t r = 0; r < w->size1; r++) {
+      for (size_t i = 0; i < w->size2; i++) {
+        if (count < k && fabs(gsl_matrix_get(w, r, i)) <= threshold) {
+          gsl_matrix_set(w, r, i, 0);
+          gsl_matrix_set(m, r, i, 0);
+          count++;
+        }
+      }
+    }
+    pruned += count;
+  }
+  return pruned;
+}
+
+/*
+  apply_mask zeroes the pruned parameters among the n parameters of the
+  slab starting at first, it does nothing for a network that was never
+  pruned
+*/
+void apply_mask(network_t *net, size_t first, size_t n) {
+  if (net->mask == NULL) return;
+  double *p = net->params->block->data + first;
+  const double *m = net->mask->block->data + first;
+  for (size_t i = 0; i < n; i++) p[i] *= m[i];
+}
+
+// BEGIN CSR
+
+/*
+  csr_from_matrix stores the nonzero entries of m in CSR
+*/
+csr_t *csr_from_matrix(gsl_matrix *m) {
+  size_t nnz = 0;
+  for (size_t r = 0; r < m->size1; r++) {
+    for (size_t i = 0; i < m->size2; i++) {
+      if (gsl_matrix_get(m, r, i) != 0) nnz++;
+    }
+  }
+  csr_t *w = (csr_t*) malloc(sizeof(csr_t));
+  w->rows = m->size1;
+  w->cols = m->size2;
+  w->row_start = (uint32_t*) malloc((m->size1 + 1) * sizeof(uint32_t));
+  w->col = (uint32_t*) malloc(nnz * sizeof(uint32_t));
+  w->value = (double*) malloc(nnz * sizeof(double));
+  size_t p = 0;
+  for (size_t r = 0; r < m->size1; r++) {
+    w->row_start[r] = p;
+    for (size_t i = 0; i < m->size2; i++) {
+      double v = gsl_matrix_get(m, r, i);
+      if (v == 0) continue;
+      w->col[p] = i;
+      w->value[p++] = v;
+    }
+  }
+  w->row_start[m->size1] = p;
+  return w;
+}
+
+void csr_free(csr_t *w) {
+  free(w->row_start);
+  free(w->col);
+  free(w->value);
+  free(w);
+}
+
+/*
+  csr_matmul sets y = w x. Every nonzero weight adds a scaled row of x to a
+  row of y, so the inner loop runs over the contiguous batch columns and a
+  batch of one is a plain sparse matrix-vector product.
+*/
+void csr_matmul(csr_t *w, gsl_matrix *x, gsl_matrix *y) {
+  assert(x->size1 == w->cols && y->size1 == w->rows && x->size2 == y->size2);
+  size_t n = x->size2;
+  for (size_t r = 0; r < w->rows; r++) {
+    double *yr = y->data + r * y->tda;
+    memset(yr, 0, n * sizeof(double));
+    for (size_t p = w->row_start[r]; p < w->row_start[r+1]; p++) {
+      const double *xi = x->data + w->col[p] * x->tda;
+      double v = w->value[p];
+      for (size_t j = 0; j < n; j++) yr[j] += v * xi[j];
+    }
+  }
+}
+
+/*
+  export_sparse_model copies the activation, the biases and the weights of
+  net, in CSR, into a new sparse model
+*/
+sparse_model_t *export_sparse_model(network_t *net) {
+  int L = net->num_layers;
+  sparse_model_t *sm = (sparse_model_t*) malloc(sizeof(sparse_model_t));
+  sm->num_layers = L;
+  memcpy(sm->layers, net->layers, L * sizeof(int));
+  sm->activation = (af_t*) malloc(sizeof(af_t));
+  memcpy(sm->activation, net->activation, sizeof(af_t));
+  sm->softmax = (net->cost->id == COST_SOFTMAX_CROSS_ENTROPY);
+  sm->weights = (csr_t**) malloc((L-1) * sizeof(csr_t*));
+  sm->biases = (gsl_matrix**) malloc((L-1) * sizeof(gsl_matrix*));
+  for (int l = 0; l < L-1; l++) {
+    sm->weights[l] = csr_from_matrix(net->weights[l]);
+    sm->biases[l] = gsl_matrix_alloc(net->biases[l]->size1, 1);
+    gsl_matrix_memcpy(sm->biases[l], net->biases[l]);
+  }
+  return sm;
+}
+
+void free_sparse_model(sparse_model_t *sm) {
+  for (int l = 0; l < sm->num_layers-1; l++) {
+    csr_free(sm->weights[l]);
+    gsl_matrix_free(sm->biases[l]);
+  }
+  free(sm->weights);
+  free(sm->biases);
+  free(sm->activation);
+  free(sm);
+}
+
+/*
+  sparse_model_size returns the bytes of weights and biases of sm
+*/
+size_t sparse_model_size(sparse_model_t *sm) {
+  size_t size = 0;
+  for (int l = 0; l < sm->num_layers-1; l++) {
+    csr_t *w = sm->weights[l];
+    size += (w->rows + 1) * sizeof(uint32_t);
+    size += w->row_start[w->rows] * (sizeof(uint32_t) + sizeof(double));
+    size += sm->biases[l]->size1 * sizeof(double);
+  }
+  return size;
+}
+
+scratch_t *init_sparse_scratch(sparse_model_t *sm, size_t max_batch) {
+  return alloc_scratch(sm->layers, sm->num_layers, max_batch);
+}
+
+/*
+  sparse_model_predict is model_predict for a sparse model
+*/
+gsl_matrix *sparse_model_predict(sparse_model_t *sm, scratch_t *s, gsl_matrix *input) {
+  size_t n = input->size2;
+  assert(input->size1 == sm->layers[0] && n <= s->max_batch);
+  gsl_matrix_view views[2];
+  gsl_matrix *a = input;
+  for (int l = 0; l < sm->num_layers-1; l++) {
+    gsl_matrix_view z = gsl_matrix_submatrix(s->z, 0, 0, sm->layers[l+1], n);
+    views[(l+1) % 2] = gsl_matrix_submatrix(s->buffers[(l+1) % 2], 0, 0, sm->layers[l+1], n);
+    gsl_matrix *next = &views[(l+1) % 2].matrix;
+    csr_matmul(sm->weights[l], a, &z.matrix);
+    if (sm->softmax && l == sm->num_layers-2) {
+      bias_softmax(&z.matrix, sm->biases[l], next, NULL);
+    } else {
+      bias_activate(sm->activation, &z.matrix, sm->biases[l], next, NULL);
+    }
+    a = next;
+  }
+  s->out = views[(sm->num_layers-1) % 2];
+  return &s->out.matrix;
+}
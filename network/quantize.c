@@ -0,0 +1,170 @@
+#include "network.h"
+
+/*
+  Post-training int8 quantization. Every weight row is scaled to
+  +-QUANT_WEIGHT_MAX on its own, and the inputs of every layer are uint8
+  steps of input_scales[l]: the caller's scale for the first layer, which
+  then reads raw pixels, and the largest activation seen on a calibration
+  batch over QUANT_ACTIVATION_MAX for the others. A layer computes its
+  dot products in int32 and rescales them to double for the bias and the
+  fused activation, which are cheap next to the product. Every activation
+  must be non-negative, which holds for all of the ACTIVATION_* kernels.
+*/
+
+static size_t quant_stride(size_t n) {
+  return (n + QUANT_ALIGN - 1) / QUANT_ALIGN * QUANT_ALIGN;
+}
+
+static void *quant_alloc(size_t size) {
+  void *p;
+  if (posix_memalign(&p, QUANT_ALIGN, size)) {
+    fprintf(stderr, "%s\n", "quantized model allocation failed");
+    exit(1);
+  }
+  memset(p, 0, size);
+  return p;
+}
+
+/*
+  quantize_network returns an int8 copy of net. input_scale maps the uint8
+  inputs of qmodel_predict to the inputs net was trained on, calibration
+  holds one such input per column and sets the scales of the hidden
+  layers. It returns NULL for custom activations, which may be negative.
+*/
+qmodel_t *quantize_network(network_t *net, double input_scale, gsl_matrix *calibration) {
+  if (net->activation->id == ACTIVATION_CUSTOM) {
+    fprintf(stderr, "%s\n", "custom activation functions can not be quantized");
+    return NULL;
+  }
+  network_t *rep = init_network_replica(net);
+  feedforward(rep, calibration);
+
+  int L = net->num_layers;
+  qmodel_t *qm = (qmodel_t*) malloc(sizeof(qmodel_t));
+  qm->num_layers = L;
+  memcpy(qm->layers, net->layers, L * sizeof(int));
+  qm->activation = (af_t*) malloc(sizeof(af_t));
+  memcpy(qm->activation, net->activation, sizeof(af_t));
+  qm->softmax = (net->cost->id == COST_SOFTMAX_CROSS_ENTROPY);
+  qm->weights = (int8_t**) malloc((L-1) * sizeof(int8_t*));
+  qm->multipliers = (double**) malloc((L-1) * sizeof(double*));
+  qm->biases = (gsl_matrix**) malloc((L-1) * sizeof(gsl_matrix*));
+
+  for (int l = 0; l < L; l++) {
+    qm->strides[l] = quant_stride(net->layers[l]);
+    if (l == 0) {
+      qm->input_scales[l] = input_scale;
+      continue;
+    }
+    double amax = gsl_matrix_max(rep->activations->data[l]);
+    qm->input_scales[l] = (amax > 0 ? amax : 1.0) / QUANT_ACTIVATION_MAX;
+  }
+
+  for (int l = 0; l < L-1; l++) {
+    gsl_matrix *w = net->weights[l];
+    size_t stride = qm->strides[l];
+    qm->weights[l] = (int8_t*) quant_alloc(w->size1 * stride);
+    qm->multipliers[l] = (double*) malloc(w->size1 * sizeof(double));
+    for (size_t r = 0; r < w->size1; r++) {
+      double wmax = 0;
+      for (size_t i = 0; i < w->size2; i++) {
+        double x = fabs(gsl_matrix_get(w, r, i));
+        if (x > wmax) wmax = x;
+      }
+      double scale = (wmax > 0 ? wmax : 1.0) / QUANT_WEIGHT_MAX;
+      for (size_t i = 0; i < w->size2; i++) {
+        qm->weights[l][r * stride + i] = (int8_t) lrint(gsl_matrix_get(w, r, i) / scale);
+      }
+      qm->multipliers[l][r] = scale * qm->input_scales[l];
+    }
+    qm->biases[l] = gsl_matrix_alloc(net->biases[l]->size1, 1);
+    gsl_matrix_memcpy(qm->biases[l], net->biases[l]);
+  }
+  free_network(rep);
+  return qm;
+}
+
+void free_qmodel(qmodel_t *qm) {
+  for (int l = 0; l < qm->num_layers-1; l++) {
+    free(qm->weights[l]);
+    free(qm->multipliers[l]);
+    gsl_matrix_free(qm->biases[l]);
+  }
+  free(qm->weights);
+  free(qm->multipliers);
+  free(qm->biases);
+  free(qm->activation);
+  free(qm);
+}
+
+/*
+  init_qscratch allocates the buffers for one thread to predict batches of
+  up to max_batch samples with qm
+*/
+qscratch_t *init_qscratch(qmodel_t *qm, size_t max_batch) {
+  size_t width = 0, stride = 0;
+  for (int l = 0; l < qm->num_layers; l++) {
+    if (qm->layers[l] > width) width = qm->layers[l];
+    if (qm->strides[l] > stride) stride = qm->strides[l];
+  }
+  qscratch_t *s = (qscratch_t*) malloc(sizeof(qscratch_t));
+  s->max_batch = max_batch;
+  s->inputs = (uint8_t*) quant_alloc(max_batch * stride);
+  s->dots = (int32_t*) quant_alloc(width * max_batch * sizeof(int32_t));
+  s->z = gsl_matrix_alloc(width, max_batch);
+  s->a = gsl_matrix_alloc(width, max_batch);
+  return s;
+}
+
+void free_qscratch(qscratch_t *s) {
+  free(s->inputs);
+  free(s->dots);
+  gsl_matrix_free(s->z);
+  gsl_matrix_free(s->a);
+  free(s);
+}
+
+/*
+  qmodel_predict runs n samples of layers[0] uint8 inputs each, stored one
+  after the other in input, through qm. It returns the output layer as
+  doubles, one column per sample, which lives in the scratch until its
+  next use.
+*/
+gsl_matrix *qmodel_predict(qmodel_t *qm, qscratch_t *s, const uint8_t *input, size_t n) {
+  assert(n <= s->max_batch);
+  const uint8_t *x = input;
+  size_t ldx = qm->layers[0];
+  gsl_matrix_view a;
+  for (int l = 0; l < qm->num_layers-1; l++) {
+    size_t rows = qm->layers[l+1];
+    dot_u8s8(qm->weights[l], qm->strides[l], rows, x, ldx, n, qm->layers[l], s->dots, n);
+    gsl_matrix_view z = gsl_matrix_submatrix(s->z, 0, 0, rows, n);
+    a = gsl_matrix_submatrix(s->a, 0, 0, rows, n);
+    for (size_t r = 0; r < rows; r++) {
+      double m = qm->multipliers[l][r];
+      double *zr = z.matrix.data + r * z.matrix.tda;
+      for (size_t j = 0; j < n; j++) zr[j] = m * s->dots[r * n + j];
+    }
+    if (qm->softmax && l == qm->num_layers-2) {
+      bias_softmax(&z.matrix, qm->biases[l], &a.matrix, NULL);
+    } else {
+      bias_activate(qm->activation, &z.matrix, qm->biases[l], &a.matrix, NULL);
+    }
+    if (l == qm->num_layers-2) break;
+
+    // requantize the activations into one row per sample for layer l+1
+    double inv = 1.0 / qm->input_scales[l+1];
+    size_t stride = qm->strides[l+1];
+    for (size_t r = 0; r < rows; r++) {
+      double *ar = a.matrix.data + r * a.matrix.tda;
+      for (size_t j = 0; j < n; j++) {
+        long q = lrint(ar[j] * inv);
+        s->inputs[j * stride + r] = (uint8_t)(q > QUANT_ACTIVATION_MAX ? QUANT_ACTIVATION_MAX : q);
+      }
+    }
+    x = s->inputs;
+    ldx = stride;
+  }
+  s->out = a;
+  return &s->out.matrix;
+}
@@ -0,0 +1,283 @@
+#include "network.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPECIALIZED_X86
+#endif
+
+/*
+  Kernels specialized at compile time for the layer shapes listed in
+  SPECIALIZED_SHAPES. Every shape instantiates a forward, a backward and
+  a weight gradient kernel from the register blocked templates below with
+  its sizes as constants, so the compiler unrolls and schedules the inner
+  loops for them and no BLAS call is made. The network asks for a kernel
+  by shape on every product and falls back to gsl_blas_dgemm when there is
+  none or the cpu lacks AVX2 and FMA.
+*/
+
+// a kernel computes c from a and b for a batch of n columns
+typedef void (*spec_kernel_t)(const double *a, size_t tda, const double *b, size_t tdb,
+                                double *c, size_t tdc, size_t n);
+
+typedef struct spec {
+  size_t in;
+  size_t out;
+  spec_kernel_t forward;     // z = w a
+  spec_kernel_t backward;    // delta of the inputs = w^T delta
+  spec_kernel_t weight_grad; // g = delta a^T
+} spec_t;
+
+#ifdef SPECIALIZED_X86
+
+/*
+  gemm_avx2 sets c (M x n) to a (M x K) times b (K x n). Element (m, k) of
+  a is a[m * sm + k * sk], so the same template multiplies by w and by
+  its transpose. Blocks of 4 rows by 8 columns keep 8 accumulators in
+  registers, broadcasting one element of a per row and step of k.
+*/
+__attribute__((target("avx2,fma"), always_inline))
+static inline void gemm_avx2(const size_t M, const size_t K, const double *a, const size_t sm,
+                               const size_t sk, const double *b, size_t tdb,
+                               double *c, size_t tdc, size_t n) {
+  const size_t blocked = M - M % 4;
+  for (size_t m = 0; m < blocked; m += 4) {
+    const double *a0 = a + m * sm;
+    const double *a1 = a0 + sm;
+    const double *a2 = a1 + sm;
+    const double *a3 = a2 + sm;
+    size_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+      __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+      __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+      __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+      __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+      for (size_t k = 0; k < K; k++) {
+        __m256d b0 = _mm256_loadu_pd(b + k * tdb + j);
+        __m256d b1 = _mm256_loadu_pd(b + k * tdb + j + 4);
+        __m256d w = _mm256_broadcast_sd(a0 + k * sk);
+        c00 = _mm256_fmadd_pd(w, b0, c00);
+        c01 = _mm256_fmadd_pd(w, b1, c01);
+        w = _mm256_broadcast_sd(a1 + k * sk);
+        c10 = _mm256_fmadd_pd(w, b0, c10);
+        c11 = _mm256_fmadd_pd(w, b1, c11);
+        w = _mm256_broadcast_sd(a2 + k * sk);
+        c20 = _mm256_fmadd_pd(w, b0, c20);
+        c21 = _mm256_fmadd_pd(w, b1, c21);
+        w = _mm256_broadcast_sd(a3 + k * sk);
+        c30 = _mm256_fmadd_pd(w, b0, c30);
+        c31 = _mm256_fmadd_pd(w, b1, c31);
+      }
+      double *c0 = c + m * tdc + j;
+      _mm256_storeu_pd(c0, c00);
+      _mm256_storeu_pd(c0 + 4, c01);
+      _mm256_storeu_pd(c0 + tdc, c10);
+      _mm256_storeu_pd(c0 + tdc + 4, c11);
+      _mm256_storeu_pd(c0 + 2 * tdc, c20);
+      _mm256_storeu_pd(c0 + 2 * tdc + 4, c21);
+      _mm256_storeu_pd(c0 + 3 * tdc, c30);
+      _mm256_storeu_pd(c0 + 3 * tdc + 4, c31);
+    }
+    for (; j < n; j++) {
+      double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+      for (size_t k = 0; k < K; k++) {
+        double x = b[k * tdb + j];
+        s0 += a0[k * sk] * x;
+        s1 += a1[k * sk] * x;
+        s2 += a2[k * sk] * x;
+        s3 += a3[k * sk] * x;
+      }
+      c[m * tdc + j] = s0;
+      c[(m + 1) * tdc + j] = s1;
+      c[(m + 2) * tdc + j] = s2;
+      c[(m + 3) * tdc + j] = s3;
+    }
+  }
+  for (size_t m = blocked; m < M; m++) {
+    const double *a0 = a + m * sm;
+    size_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+      __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+      for (size_t k = 0; k < K; k++) {
+        __m256d w = _mm256_broadcast_sd(a0 + k * sk);
+        c00 = _mm256_fmadd_pd(w, _mm256_loadu_pd(b + k * tdb + j), c00);
+        c01 = _mm256_fmadd_pd(w, _mm256_loadu_pd(b + k * tdb + j + 4), c01);
+      }
+      _mm256_storeu_pd(c + m * tdc + j, c00);
+      _mm256_storeu_pd(c + m * tdc + j + 4, c01);
+    }
+    for (; j < n; j++) {
+      double s = 0;
+      for (size_t k = 0; k < K; k++) s += a0[k * sk] * b[k * tdb + j];
+      c[m * tdc + j] = s;
+    }
+  }
+}
+
+/*
+  hsum4_avx2 returns the horizontal sums of v0 to v3 as one vector
+*/
+__attribute__((target("avx2,fma"), always_inline))
+static inline __m256d hsum4_avx2(__m256d v0, __m256d v1, __m256d v2, __m256d v3) {
+  __m256d t0 = _mm256_hadd_pd(v0, v1);
+  __m256d t1 = _mm256_hadd_pd(v2, v3);
+  return _mm256_add_pd(_mm256_permute2f128_pd(t0, t1, 0x20),
+                        _mm256_permute2f128_pd(t0, t1, 0x31));
+}
+
+/*
+  gemm_nt_avx2 sets c (M x N) to a (M x n) times the transpose of b
+  (N x n). Every element is a dot product over the batch, blocks of 2 x 4
+  elements share their loads and are reduced four at a time.
+*/
+__attribute__((target("avx2,fma"), always_inline))
+static inline void gemm_nt_avx2(const size_t M, const size_t N, const double *a, size_t tda,
+                                  const double *b, size_t tdb, double *c, size_t tdc, size_t n) {
+  size_t r = 0;
+  for (; r + 2 <= M; r += 2) {
+    const double *a0 = a + r * tda;
+    const double *a1 = a0 + tda;
+    size_t i = 0;
+    for (; i + 4 <= N; i += 4) {
+      const double *b0 = b + i * tdb;
+      const double *b1 = b0 + tdb;
+      const double *b2 = b1 + tdb;
+      const double *b3 = b2 + tdb;
+      __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+      __m256d c02 = _mm256_setzero_pd(), c03 = _mm256_setzero_pd();
+      __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+      __m256d c12 = _mm256_setzero_pd(), c13 = _mm256_setzero_pd();
+      size_t j = 0;
+      for (; j + 4 <= n; j += 4) {
+        __m256d x0 = _mm256_loadu_pd(a0 + j);
+        __m256d x1 = _mm256_loadu_pd(a1 + j);
+        __m256d y = _mm256_loadu_pd(b0 + j);
+        c00 = _mm256_fmadd_pd(x0, y, c00);
+        c10 = _mm256_fmadd_pd(x1, y, c10);
+        y = _mm256_loadu_pd(b1 + j);
+        c01 = _mm256_fmadd_pd(x0, y, c01);
+        c11 = _mm256_fmadd_pd(x1, y, c11);
+        y = _mm256_loadu_pd(b2 + j);
+        c02 = _mm256_fmadd_pd(x0, y, c02);
+        c12 = _mm256_fmadd_pd(x1, y, c12);
+        y = _mm256_loadu_pd(b3 + j);
+        c03 = _mm256_fmadd_pd(x0, y, c03);
+        c13 = _mm256_fmadd_pd(x1, y, c13);
+      }
+      __m256d s0 = hsum4_avx2(c00, c01, c02, c03);
+      __m256d s1 = hsum4_avx2(c10, c11, c12, c13);
+      double t0[4], t1[4];
+      _mm256_storeu_pd(t0, s0);
+      _mm256_storeu_pd(t1, s1);
+      for (; j < n; j++) {
+        t0[0] += a0[j] * b0[j];
+        t0[1] += a0[j] * b1[j];
+        t0[2] += a0[j] * b2[j];
+        t0[3] += a0[j] * b3[j];
+        t1[0] += a1[j] * b0[j];
+        t1[1] += a1[j] * b1[j];
+        t1[2] += a1[j] * b2[j];
+        t1[3] += a1[j] * b3[j];
+      }
+      memcpy(c + r * tdc + i, t0, sizeof(t0));
+      memcpy(c + (r + 1) * tdc + i, t1, sizeof(t1));
+    }
+    for (; i < N; i++) {
+      double s0 = 0, s1 = 0;
+      for (size_t j = 0; j < n; j++) {
+        s0 += a0[j] * b[i * tdb + j];
+        s1 += a1[j] * b[i * tdb + j];
+      }
+      c[r * tdc + i] = s0;
+      c[(r + 1) * tdc + i] = s1;
+    }
+  }
+  for (; r < M; r++) {
+    for (size_t i = 0; i < N; i++) {
+      double s = 0;
+      for (size_t j = 0; j < n; j++) s += a[r * tda + j] * b[i * tdb + j];
+      c[r * tdc + i] = s;
+    }
+  }
+}
+
+/*
+  SPECIALIZE instantiates the kernels of a layer with IN inputs and OUT
+  outputs, SPEC_ENTRY its row of the dispatch table
+*/
+#define SPECIALIZE(IN, OUT) \
+  __attribute__((target("avx2,fma"))) \
+  static void forward_##IN##x##OUT(const double *w, size_t tdw, const double *x, size_t tdx, \
+                                      double *z, size_t tdz, size_t n) { \
+    gemm_avx2(OUT, IN, w, tdw, 1, x, tdx, z, tdz, n); \
+  } \
+  __attribute__((target("avx2,fma"))) \
+  static void backward_##IN##x##OUT(const double *w, size_t tdw, const double *d, size_t tdd, \
+                                       double *out, size_t tdo, size_t n) { \
+    gemm_avx2(IN, OUT, w, 1, tdw, d, tdd, out, tdo, n); \
+  } \
+  __attribute__((target("avx2,fma"))) \
+  static void weight_grad_##IN##x##OUT(const double *d, size_t tdd, const double *x, size_t tdx, \
+                                          double *g, size_t tdg, size_t n) { \
+    gemm_nt_avx2(OUT, IN, d, tdd, x, tdx, g, tdg, n); \
+  }
+
+#define SPEC_ENTRY(IN, OUT) \
+  {IN, OUT, &forward_##IN##x##OUT, &backward_##IN##x##OUT, &weight_grad_##IN##x##OUT},
+
+SPECIALIZED_SHAPES(SPECIALIZE)
+
+static const spec_t specs[] = {
+  SPECIALIZED_SHAPES(SPEC_ENTRY)
+};
+
+#endif
+
+/*
+  find_spec returns the kernels for a layer with in inputs and out outputs,
+  or NULL if there are none for this shape or this cpu
+*/
+static const spec_t *find_spec(size_t in, size_t out) {
+#ifdef SPECIALIZED_X86
+  if (kernel_isa() < ISA_AVX2) return NULL;
+  for (size_t s = 0; s < sizeof(specs) / sizeof(specs[0]); s++) {
+    if (specs[s].in == in && specs[s].out == out) return &specs[s];
+  }
+#endif
+  return NULL;
+}
+
+/*
+  specialized_forward sets z = w a if there is a kernel for the shape of
+  w, it returns false and leaves z alone otherwise
+*/
+bool specialized_forward(gsl_matrix *w, gsl_matrix *a, gsl_matrix *z) {
+  const spec_t *s = find_spec(w->size2, w->size1);
+  if (s == NULL) return false;
+  assert(a->size1 == w->size2 && z->size1 == w->size1 && z->size2 == a->size2);
+  s->forward(w->data, w->tda, a->data, a->tda, z->data, z->tda, a->size2);
+  return true;
+}
+
+/*
+  specialized_backward sets out = w^T delta if there is a kernel for the
+  shape of w, it returns false and leaves out alone otherwise
+*/
+bool specialized_backward(gsl_matrix *w, gsl_matrix *delta, gsl_matrix *out) {
+  const spec_t *s = find_spec(w->size2, w->size1);
+  if (s == NULL) return false;
+  assert(delta->size1 == w->size1 && out->size1 == w->size2 && out->size2 == delta->size2);
+  s->backward(w->data, w->tda, delta->data, delta->tda, out->data, out->tda, delta->size2);
+  return true;
+}
+
+/*
+  specialized_weight_grad sets g = delta a^T if there is a kernel for the
+  shape of g, it returns false and leaves g alone otherwise
+*/
+bool specialized_weight_grad(gsl_matrix *delta, gsl_matrix *a, gsl_matrix *g) {
+  const spec_t *s = find_spec(g->size2, g->size1);
+  if (s == NULL) return false;
+  assert(delta->size1 == g->size1 && a->size1 == g->size2 && delta->size2 == a->size2);
+  s->weight_grad(delta->data, delta->tda, a->data, a->tda, g->data, g->tda, delta->size2);
+  return true;
+}
@@ -0,0 +1,221 @@
+#include "serve.h"
+
+typedef struct batcher_thread {
+  batcher_t *b;
+  scratch_t *scratch;   // buffers for batches of up to max_batch images
+  qscratch_t *qscratch; // the same for the int8 model
+  uint8_t *pixels;      // max_batch images gathered for the int8 model
+} batcher_thread_t;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int log2_bucket(size_t x) {
+  int i = 0;
+  while ((((size_t)1) << i) < x && i < HIST_BUCKETS - 1) i++;
+  return i;
+}
+
+/*
+  take_batch waits for a batch to be due and unlinks it from the queue. A
+  batch is due when it holds max_batch images or its oldest request has
+  waited for the deadline. It returns the first request of the batch and
+  leaves its number of images in n.
+*/
+static request_t *take_batch(batcher_t *b, size_t *n) {
+  pthread_mutex_lock(&b->lock);
+  while (1) {
+    while (b->head == NULL) pthread_cond_wait(&b->ready, &b->lock);
+    double due = b->head->enqueued + b->deadline;
+    if (b->queued >= b->max_batch || now() >= due) break;
+    struct timespec ts;
+    ts.tv_sec = (time_t)due;
+    ts.tv_nsec = (long)((due - ts.tv_sec) * 1e9);
+    pthread_cond_timedwait(&b->ready, &b->lock, &ts);
+  }
+  // take whole requests up to max_batch images, at least one
+  request_t *first = b->head;
+  request_t *last = first;
+  size_t count = first->n;
+  while (last->next != NULL && count + last->next->n <= b->max_batch) {
+    last = last->next;
+    count += last->n;
+  }
+  b->head = last->next;
+  if (b->head == NULL) b->tail = NULL;
+  b->queued -= count;
+  last->next = NULL;
+  // the rest of the queue is the next batch for another batcher thread
+  if (b->head != NULL) pthread_cond_signal(&b->ready);
+  pthread_mutex_unlock(&b->lock);
+  *n = count;
+  return first;
+}
+
+/*
+  predict pushes the images of the requests from first on, n in total,
+  through the model as one batch and writes their scores
+*/
+static void predict(batcher_thread_t *t, request_t *first, size_t n) {
+  batcher_t *b = t->b;
+  size_t len = b->input_size;
+  size_t outputs = b->outputs;
+  size_t j = 0;
+  gsl_matrix *out;
+  if (b->qmodel != NULL) {
+    // the int8 model reads the pixels as they are, only a batch of several
+    // requests needs gathering
+    const uint8_t *pixels = first->pixels;
+    if (first->next != NULL) {
+      for (request_t *req = first; req != NULL; req = req->next) {
+        memcpy(t->pixels + j * len, req->pixels, req->n * len);
+        j += req->n;
+      }
+      pixels = t->pixels;
+    }
+    out = qmodel_predict(b->qmodel, t->qscratch, pixels, n);
+  } else {
+    gsl_matrix *input = scratch_input(t->scratch, n);
+    for (request_t *req = first; req != NULL; req = req->next) {
+      for (size_t s = 0; s < req->n; s++, j++) {
+        const uint8_t *x = req->pixels + s * len;
+        for (size_t i = 0; i < len; i++) input->data[i * input->tda + j] = PIXEL_SCALE * x[i];
+      }
+    }
+    out = model_predict(b->model, t->scratch, input);
+  }
+  j = 0;
+  for (request_t *req = first; req != NULL; req = req->next) {
+    for (size_t s = 0; s < req->n; s++, j++) {
+      for (size_t k = 0; k < outputs; k++) {
+        req->scores[s * outputs + k] = (float)out->data[k * out->tda + j];
+      }
+    }
+  }
+}
+
+/*
+  run_batch predicts a batch and hands every request its scores. Only a
+  single request can hold more than max_batch images, it runs in slices
+  of max_batch.
+*/
+static void run_batch(batcher_thread_t *t, request_t *first, size_t n) {
+  batcher_t *b = t->b;
+  double start = now();
+  for (request_t *req = first; req != NULL; req = req->next) {
+    size_t wait_us = (size_t)((start - req->enqueued) * 1e6);
+    __atomic_fetch_add(&b->wait_hist[log2_bucket(wait_us + 1)], 1, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add(&b->batch_hist[log2_bucket(n)], 1, __ATOMIC_RELAXED);
+
+  if (n <= b->max_batch) {
+    predict(t, first, n);
+  } else {
+    size_t len = b->input_size;
+    size_t outputs = b->outputs;
+    for (size_t off = 0; off < n; off += b->max_batch) {
+      request_t slice = *first;
+      slice.pixels = first->pixels + off * len;
+      slice.scores = first->scores + off * outputs;
+      slice.n = (n - off < b->max_batch) ? n - off : b->max_batch;
+      slice.next = NULL;
+      predict(t, &slice, slice.n);
+    }
+  }
+
+  request_t *req = first;
+  while (req != NULL) {
+    request_t *next = req->next; // req is gone once it is done
+    V(&req->done);
+    req = next;
+  }
+}
+
+static void *batcher_thread(void *vargp) {
+  batcher_thread_t *t = (batcher_thread_t*) vargp;
+  while (1) {
+    size_t n;
+    request_t *first = take_batch(t->b, &n);
+    run_batch(t, first, n);
+  }
+  return NULL;
+}
+
+/*
+  init_batcher starts num_threads batcher threads for m, or for the int8
+  model qm if m is NULL, that flush at max_batch images or after
+  deadline_ms milliseconds
+*/
+batcher_t *init_batcher(model_t *m, qmodel_t *qm, size_t max_batch, double deadline_ms, int num_threads) {
+  batcher_t *b = (batcher_t*) calloc(1, sizeof(batcher_t));
+  pthread_condattr_t attr;
+  assert((m == NULL) != (qm == NULL));
+  b->model = m;
+  b->qmodel = qm;
+  b->input_size = m ? m->layers[0] : qm->layers[0];
+  b->outputs = m ? m->layers[m->num_layers-1] : qm->layers[qm->num_layers-1];
+  b->max_batch = max_batch;
+  b->deadline = deadline_ms * 1e-3;
+  b->num_threads = num_threads;
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&b->ready, &attr);
+  pthread_condattr_destroy(&attr);
+  b->tids = (pthread_t*) malloc(num_threads * sizeof(pthread_t));
+  for (int i = 0; i < num_threads; i++) {
+    batcher_thread_t *t = (batcher_thread_t*) calloc(1, sizeof(batcher_thread_t));
+    t->b = b;
+    if (m != NULL) {
+      t->scratch = init_scratch(m, max_batch);
+    } else {
+      t->qscratch = init_qscratch(qm, max_batch);
+      t->pixels = (uint8_t*) malloc(max_batch * b->input_size);
+    }
+    Pthread_create(&b->tids[i], NULL, batcher_thread, t);
+  }
+  return b;
+}
+
+/*
+  batcher_submit queues a request and waits until its scores are in
+*/
+void batcher_submit(batcher_t *b, request_t *req) {
+  assert(req->n <= SERVE_MAX_BATCH);
+  Sem_init(&req->done, 0, 0);
+  req->next = NULL;
+  req->enqueued = now();
+  pthread_mutex_lock(&b->lock);
+  if (b->tail) b->tail->next = req;
+  else b->head = req;
+  b->tail = req;
+  b->queued += req->n;
+  // wake a batcher for the first request and once a batch is full
+  if (b->head == req || b->queued >= b->max_batch) pthread_cond_signal(&b->ready);
+  pthread_mutex_unlock(&b->lock);
+  P(&req->done);
+  sem_destroy(&req->done);
+}
+
+/*
+  batcher_stats writes the batch size and queue wait histograms to buf as
+  text and returns the length
+*/
+size_t batcher_stats(batcher_t *b, char *buf, size_t size) {
+  size_t len = 0;
+  len += snprintf(buf + len, size - len, "batch size (max %zu, deadline %.3f ms)\n",
+                    b->max_batch, b->deadline * 1e3);
+  for (int i = 0; i < HIST_BUCKETS && len < size; i++) {
+    size_t count = __atomic_load_n(&b->batch_hist[i], __ATOMIC_RELAXED);
+    if (count) len += snprintf(buf + len, size - len, "  <= %8zu: %zu\n", ((size_t)1) << i, count);
+  }
+  if (len < size) len += snprintf(buf + len, size - len, "queue wait (us)\n");
+  for (int i = 0; i < HIST_BUCKETS && len < size; i++) {
+    size_t count = __atomic_load_n(&b->wait_hist[i], __ATOMIC_RELAXED);
+    if (count) len += snprintf(buf + len, size - len, "  <= %8zu: %zu\n", ((size_t)1) << i, count);
+  }
+  return (len < size) ? len : size - 1;
+}
@@ -0,0 +1,125 @@
+#include "serve.h"
+
+/*
+  annc-client is a loopback load generator for annc-serve. Every thread
+  opens one connection and sends requests of batch test images back to
+  back, then the client reports throughput and the accuracy of the scores.
+
+  usage: annc-client [host] [port] [connections] [requests] [batch]
+*/
+
+typedef struct client {
+  pthread_t tid;
+  char *host;
+  char *port;
+  set_loader_t *set;
+  size_t first;     // position of the first image this client sends
+  int requests;
+  int batch;
+  int correct;
+} client_t;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+  print_stats asks the server for its batcher histograms and prints them
+*/
+static void print_stats(char *host, char *port) {
+  uint32_t header = htonl(SERVE_STATS);
+  char buf[4096];
+  int fd = Open_clientfd(host, port);
+  Rio_writen(fd, &header, 4);
+  if (Rio_readn(fd, &header, 4) == 4) {
+    uint32_t len = ntohl(header);
+    if (len < sizeof(buf) && Rio_readn(fd, buf, len) == (ssize_t)len) {
+      buf[len] = '\0';
+      printf("\n%s", buf);
+    }
+  }
+  Close(fd);
+}
+
+static void *client_thread(void *vargp) {
+  client_t *c = (client_t*) vargp;
+  size_t len = c->set->width * c->set->height;
+  uint8_t *request = (uint8_t*) malloc(4 + c->batch * len);
+  float *scores = NULL;
+  size_t outputs = 0;
+  uint32_t header[2];
+  int one = 1;
+  int fd = Open_clientfd(c->host, c->port);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  for (int r = 0; r < c->requests; r++) {
+    size_t first = (c->first + (size_t)r * c->batch) % c->set->total;
+    uint32_t n = htonl(c->batch);
+    memcpy(request, &n, 4);
+    for (int j = 0; j < c->batch; j++) {
+      memcpy(request + 4 + j * len, get_image(c->set, (first + j) % c->set->total).data, len);
+    }
+    Rio_writen(fd, request, 4 + c->batch * len);
+    if (Rio_readn(fd, header, sizeof(header)) != sizeof(header)) app_error("server hung up");
+    if (ntohl(header[0]) != (uint32_t)c->batch) app_error("response for the wrong batch");
+    if (scores == NULL) {
+      outputs = ntohl(header[1]);
+      if (outputs == 0) app_error("response without outputs");
+      scores = (float*) Malloc(c->batch * outputs * sizeof(float));
+    } else if (ntohl(header[1]) != outputs) {
+      app_error("response with a different number of outputs");
+    }
+    size_t size = c->batch * outputs * sizeof(float);
+    if (Rio_readn(fd, scores, size) != (ssize_t)size) app_error("server hung up");
+    for (int j = 0; j < c->batch; j++) {
+      size_t best = 0;
+      for (size_t k = 1; k < outputs; k++) {
+        if (scores[j * outputs + k] > scores[j * outputs + best]) best = k;
+      }
+      if (best == get_image(c->set, (first + j) % c->set->total).label) c->correct++;
+    }
+  }
+  Close(fd);
+  free(request);
+  free(scores);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  char *host = (argc > 1) ? argv[1] : "localhost";
+  char *port = (argc > 2) ? argv[2] : SERVE_PORT;
+  int connections = (argc > 3) ? atoi(argv[3]) : SERVE_CONNECTIONS;
+  int requests = (argc > 4) ? atoi(argv[4]) : 10000;
+  int batch = (argc > 5) ? atoi(argv[5]) : 1;
+  assert(batch > 0 && batch <= SERVE_MAX_BATCH);
+  set_loader_t *set = init_set_loader(TEST_IMAGES, TEST_LABELS);
+  client_t *clients = (client_t*) calloc(connections, sizeof(client_t));
+
+  double start = now();
+  for (int i = 0; i < connections; i++) {
+    clients[i].host = host;
+    clients[i].port = port;
+    clients[i].set = set;
+    clients[i].first = (size_t)i * requests * batch;
+    clients[i].requests = requests;
+    clients[i].batch = batch;
+    Pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]);
+  }
+  int correct = 0;
+  for (int i = 0; i < connections; i++) {
+    Pthread_join(clients[i].tid, NULL);
+    correct += clients[i].correct;
+  }
+  double elapsed = now() - start;
+
+  double total = (double)connections * requests;
+  printf("\n%d connections, %.0f requests of %d images in %.3fs\n",
+            connections, total, batch, elapsed);
+  printf("%.0f requests/s, %.0f images/s, accuracy %.4f\n",
+            total / elapsed, total * batch / elapsed, correct / (total * batch));
+  print_stats(host, port);
+  free(clients);
+  set_loader_free(set);
+  return 0;
+}
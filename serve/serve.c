@@ -0,0 +1,212 @@
+#include "serve.h"
+
+/*
+  annc-serve loads a checkpoint and answers inference requests over TCP.
+  It is a prethreaded server: the main thread accepts connections into a
+  bounded buffer and a pool of connection threads reads the requests and
+  submits them to the batcher, which runs the requests of every connection
+  through the model together.
+
+  usage: annc-serve [-p port] [-c connection threads] [-b max batch]
+                    [-d deadline ms] [-w batcher threads] [-q] <checkpoint>
+
+  -q serves the network quantized to int8, calibrated on the first
+  CALIBRATION_SAMPLES images of the training set.
+*/
+
+typedef struct sbuf {
+  int *buf;       // connected descriptors
+  int n;          // number of slots
+  int front;      // buf[(front+1)%n] is the first item
+  int rear;       // buf[rear%n] is the last item
+  sem_t mutex;    // protects buf
+  sem_t slots;    // available slots
+  sem_t items;    // available items
+} sbuf_t;
+
+typedef struct connection_thread {
+  sbuf_t *sbuf;
+  batcher_t *batcher;
+  size_t input_size;
+  size_t outputs;
+  uint8_t *pixels;  // one request worth of images
+  float *scores;    // one response worth of scores
+} connection_thread_t;
+
+static void sbuf_init(sbuf_t *sp, int n) {
+  sp->buf = (int*) calloc(n, sizeof(int));
+  sp->n = n;
+  sp->front = sp->rear = 0;
+  Sem_init(&sp->mutex, 0, 1);
+  Sem_init(&sp->slots, 0, n);
+  Sem_init(&sp->items, 0, 0);
+}
+
+static void sbuf_insert(sbuf_t *sp, int item) {
+  P(&sp->slots);
+  P(&sp->mutex);
+  sp->buf[(++sp->rear) % (sp->n)] = item;
+  V(&sp->mutex);
+  V(&sp->items);
+}
+
+static int sbuf_remove(sbuf_t *sp) {
+  int item;
+  P(&sp->items);
+  P(&sp->mutex);
+  item = sp->buf[(++sp->front) % (sp->n)];
+  V(&sp->mutex);
+  V(&sp->slots);
+  return item;
+}
+
+/*
+  send_stats answers a SERVE_STATS request with the batcher histograms
+*/
+static int send_stats(connection_thread_t *c, int connfd) {
+  char buf[4096];
+  uint32_t len = batcher_stats(c->batcher, buf, sizeof(buf));
+  uint32_t header = htonl(len);
+  if (rio_writen(connfd, &header, 4) < 0) return -1;
+  return (rio_writen(connfd, buf, len) < 0) ? -1 : 0;
+}
+
+/*
+  serve answers requests on connfd until the client hangs up or sends a
+  bad request
+*/
+static void serve(connection_thread_t *c, int connfd) {
+  rio_t rio;
+  uint32_t header[2];
+  request_t req;
+  rio_readinitb(&rio, connfd);
+  while (rio_readnb(&rio, header, 4) == 4) {
+    size_t n = ntohl(header[0]);
+    if (n == SERVE_STATS) {
+      if (send_stats(c, connfd) < 0) break;
+      continue;
+    }
+    if (n == 0 || n > SERVE_MAX_BATCH) break;
+    if (rio_readnb(&rio, c->pixels, n * c->input_size) != n * c->input_size) break;
+    req.pixels = c->pixels;
+    req.n = n;
+    req.scores = c->scores;
+    batcher_submit(c->batcher, &req);
+    header[0] = htonl(n);
+    header[1] = htonl(c->outputs);
+    if (rio_writen(connfd, header, sizeof(header)) < 0) break;
+    if (rio_writen(connfd, c->scores, n * c->outputs * sizeof(float)) < 0) break;
+  }
+}
+
+static void *connection_thread(void *vargp) {
+  connection_thread_t *c = (connection_thread_t*) vargp;
+  Pthread_detach(pthread_self());
+  while (1) {
+    int connfd = sbuf_remove(c->sbuf);
+    serve(c, connfd);
+    // a reset connection can fail to close, that must not stop the server
+    close(connfd);
+  }
+  return NULL;
+}
+
+/*
+  quantize_checkpoint loads the network in path and quantizes it to int8,
+  calibrated on the first CALIBRATION_SAMPLES training images
+*/
+static qmodel_t *quantize_checkpoint(const char *path) {
+  network_t *net = load_network(path);
+  if (net == NULL) return NULL;
+  set_loader_t *train_set = init_set_loader(TRAIN_IMAGES, TRAIN_LABELS);
+  size_t len = train_set->width * train_set->height;
+  size_t n = (train_set->total < CALIBRATION_SAMPLES) ? train_set->total : CALIBRATION_SAMPLES;
+  assert(len == net->layers[0]);
+  gsl_matrix *calibration = gsl_matrix_alloc(len, n);
+  for (size_t j = 0; j < n; j++) {
+    for (size_t i = 0; i < len; i++) {
+      gsl_matrix_set(calibration, i, j, PIXEL_SCALE * train_set->data[j * len + i]);
+    }
+  }
+  qmodel_t *qm = quantize_network(net, PIXEL_SCALE, calibration);
+  gsl_matrix_free(calibration);
+  set_loader_free(train_set);
+  free_network(net);
+  return qm;
+}
+
+int main(int argc, char **argv) {
+  char *port = SERVE_PORT;
+  int connections = SERVE_CONNECTIONS;
+  size_t max_batch = BATCH_MAX;
+  double deadline_ms = BATCH_DEADLINE_MS;
+  int batchers = BATCHERS;
+  bool quantize = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:c:b:d:w:q")) != -1) {
+    switch (opt) {
+      case 'p': port = optarg; break;
+      case 'c': connections = atoi(optarg); break;
+      case 'b': max_batch = atoi(optarg); break;
+      case 'd': deadline_ms = atof(optarg); break;
+      case 'w': batchers = atoi(optarg); break;
+      case 'q': quantize = true; break;
+      default: optind = argc + 1;
+    }
+  }
+  if (optind != argc - 1 || connections < 1 || max_batch < 1 || batchers < 1) {
+    fprintf(stderr, "usage: %s [-p port] [-c connection threads] [-b max batch] "
+                      "[-d deadline ms] [-w batcher threads] [-q] <checkpoint>\n", argv[0]);
+    exit(1);
+  }
+  model_t *model = NULL;
+  qmodel_t *qmodel = NULL;
+  if (quantize) qmodel = quantize_checkpoint(argv[optind]);
+  else model = load_model(argv[optind]);
+  if (model == NULL && qmodel == NULL) exit(1);
+  int num_layers = quantize ? qmodel->num_layers : model->num_layers;
+  size_t input_size = quantize ? qmodel->layers[0] : model->layers[0];
+  size_t outputs = quantize ? qmodel->layers[num_layers-1] : model->layers[num_layers-1];
+  printf("Serving %s (%d layers, %zu inputs, %zu outputs%s) on port %s\n",
+            argv[optind], num_layers, input_size, outputs, quantize ? ", int8" : "", port);
+  printf("%d connection threads, %d batcher threads, batches of up to %zu images "
+            "or %.3f ms\n", connections, batchers, max_batch, deadline_ms);
+
+  // a client hanging up mid response must not kill the server
+  Signal(SIGPIPE, SIG_IGN);
+  batcher_t *batcher = init_batcher(model, qmodel, max_batch, deadline_ms, batchers);
+  sbuf_t sbuf;
+  sbuf_init(&sbuf, SERVE_QUEUE);
+  for (int i = 0; i < connections; i++) {
+    pthread_t tid;
+    connection_thread_t *c = (connection_thread_t*) malloc(sizeof(connection_thread_t));
+    c->sbuf = &sbuf;
+    c->batcher = batcher;
+    c->input_size = input_size;
+    c->outputs = outputs;
+    c->pixels = (uint8_t*) malloc(SERVE_MAX_BATCH * input_size);
+    c->scores = (float*) malloc(SERVE_MAX_BATCH * outputs * sizeof(float));
+    Pthread_create(&tid, NULL, connection_thread, c);
+  }
+
+  int listenfd = Open_listenfd(port);
+  while (1) {
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+    int connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+    if (connfd < 0) {
+      // clients that hang up before they are accepted are routine, running
+      // out of descriptors passes once connections close
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      fprintf(stderr, "accept error: %s\n", strerror(errno));
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+        usleep(SERVE_ACCEPT_BACKOFF_MS * 1000);
+      }
+      continue;
+    }
+    // responses are small, send them without waiting for more data
+    int one = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    sbuf_insert(&sbuf, connfd);
+  }
+}
@@ -0,0 +1,80 @@
+#ifndef __SERVE_H__
+#define  __SERVE_H__
+
+#include "../network/network.h"
+#include "../mnist/mnist.h"
+#include <netinet/tcp.h>
+
+/*
+  annc-serve protocol, one request and one response at a time per
+  connection, a connection carries any number of requests:
+
+  request:  uint32 n (network byte order), then n images of input_size
+            uint8 pixels each
+  response: uint32 n, uint32 outputs (network byte order), then n rows of
+            outputs float32 class scores in host byte order
+
+  A request with n == SERVE_STATS is answered with a uint32 length and the
+  batcher histograms as text. A request with n == 0 or n > SERVE_MAX_BATCH
+  closes the connection.
+*/
+
+#define SERVE_PORT "15213"
+#define SERVE_STATS 0xffffffff
+// connection threads, each serves one connection at a time
+#define SERVE_CONNECTIONS 64
+// accepted connections waiting for a connection thread
+#define SERVE_QUEUE 64
+#define SERVE_MAX_BATCH 1024
+// pause before accepting again when out of descriptors or memory
+#define SERVE_ACCEPT_BACKOFF_MS 10
+
+// batcher defaults, a batch is flushed when it holds BATCH_MAX images or
+// its oldest request has waited BATCH_DEADLINE_MS
+#define BATCH_MAX 128
+#define BATCH_DEADLINE_MS 2.0
+#define BATCHERS 1
+// power of two histogram buckets
+#define HIST_BUCKETS 24
+// training images the int8 activation scales are calibrated on (-q)
+#define CALIBRATION_SAMPLES 1000
+
+typedef struct request {
+  const uint8_t *pixels; // n images
+  size_t n;
+  float *scores;         // n rows of scores, filled by the batcher
+  double enqueued;       // seconds, CLOCK_MONOTONIC
+  sem_t done;
+  struct request *next;
+} request_t;
+
+/*
+  A batcher queues the requests of every connection and runs them through
+  the model together. The batcher threads share the read-only model, or
+  its int8 quantization, and each keeps one scratch sized for max_batch
+  images, so flushing a batch never reallocates.
+*/
+typedef struct batcher {
+  model_t *model;           // exactly one of model and qmodel is set
+  qmodel_t *qmodel;
+  size_t input_size;
+  size_t outputs;
+  size_t max_batch;
+  double deadline;          // seconds
+  int num_threads;
+  pthread_t *tids;
+  pthread_mutex_t lock;     // protects the queue
+  pthread_cond_t ready;
+  request_t *head;
+  request_t *tail;
+  size_t queued;            // images in the queue
+  size_t batch_hist[HIST_BUCKETS]; // flushed batches by log2 of their size
+  size_t wait_hist[HIST_BUCKETS];  // requests by log2 of their queue wait in us
+} batcher_t;
+
+// batcher.c
+batcher_t *init_batcher(model_t *m, qmodel_t *qm, size_t max_batch, double deadline_ms, int num_threads);
+void batcher_submit(batcher_t *b, request_t *req);
+size_t batcher_stats(batcher_t *b, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,518 @@
+#include "training.h"
+
+/*
+  Data parallel training. Every mini batch is split into one slice per
+  worker thread and each worker runs feedforward and backprop on its slice
+  with its own replica of the network. The workers then reduce the
+  gradients and apply the optimizer update on disjoint segments of the
+  parameter slab, so the parameters are only written between two barriers
+  and no locks are needed.
+
+  In Hogwild mode there is no barrier at all: workers claim mini batches
+  from the loader through an atomic index and write their updates straight
+  into the shared parameters while the other workers read them. An update
+  is plain SGD on the parameters the batch gradient touches, for a sparse
+  input only the first layer columns of its nonzero pixels, so workers
+  only collide where their batches overlap. The weight decay is applied
+  once per epoch instead of on every update.
+*/
+
+#define PHASE_COMPUTE 0
+#define PHASE_UPDATE 1
+#define PHASE_HOGWILD 2
+#define PHASE_EXIT 3
+
+typedef struct pool pool_t;
+
+typedef struct worker {
+  pthread_t tid;
+  int id;
+  pool_t *pool;
+  network_t *replica;
+  size_t first;        // first position of the slice in the access order
+  size_t count;        // number of samples in the slice
+  size_t seg_start;    // slab segment reduced and updated by this worker
+  size_t seg_end;
+  double cost;         // cost of the last slice
+  double compute_time; // seconds spent in feedforward/backprop this epoch
+  double update_time;  // seconds spent reducing and updating this epoch
+  size_t samples;      // samples processed this epoch
+  bool *seen;          // inputs of the Hogwild batch with a nonzero pixel
+  int *columns;        // the same inputs as a list
+  sem_t go;
+} worker_t;
+
+struct pool {
+  network_t *net;
+  set_loader_t *loader;
+  slab_t *velocity;
+  int num_threads;
+  int phase;
+  double weight_decay;
+  double eta_scaler;
+  double mu_scaler;
+  int mini_batch_size;
+  sem_t done;
+  worker_t *workers;
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+  compute_slice runs feedforward and backprop on the slice of a worker,
+  leaving the summed gradients in its replica's delta_grads
+*/
+static void compute_slice(worker_t *w) {
+  network_t *rep = w->replica;
+  w->cost = 0;
+  if (w->count == 0) return;
+  load_batch(rep, w->pool->loader, w->first, w->count);
+  feedforward(rep, rep->activations->data[0]);
+  w->cost = backprop(rep, rep->ws->target);
+  w->samples += w->count;
+}
+
+/*
+  update_segment sums the gradients of every worker over the segment of the
+  slab owned by w and runs the optimizer kernel on it
+*/
+static void update_segment(worker_t *w) {
+  pool_t *pool = w->pool;
+  network_t *net = pool->net;
+  size_t a = w->seg_start;
+  size_t b = w->seg_end;
+  double *g = net->grads->block->data;
+  bool first = true;
+  for (int t = 0; t < pool->num_threads; t++) {
+    worker_t *src = &pool->workers[t];
+    if (src->count == 0) continue;
+    double *d = src->replica->delta_grads->block->data;
+    if (first) {
+      memcpy(g + a, d + a, (b - a) * sizeof(double));
+      first = false;
+    } else {
+      for (size_t i = a; i < b; i++) g[i] += d[i];
+    }
+  }
+  // weights come first in the slab, biases are not regularized
+  size_t weights_size = net->params->weights->slab->size;
+  double *p = net->params->block->data;
+  double *v = pool->velocity->block->data;
+  if (a < weights_size) {
+    size_t end = (b < weights_size) ? b : weights_size;
+    sgd_update(net->optimizer, p + a, v + a, g + a, end - a,
+                pool->weight_decay, pool->mu_scaler, pool->eta_scaler);
+  }
+  if (b > weights_size) {
+    size_t start = (a > weights_size) ? a : weights_size;
+    sgd_update(net->optimizer, p + start, v + start, g + start, b - start,
+                1.0, pool->mu_scaler, pool->eta_scaler);
+  }
+  apply_mask(net, a, b - a);
+}
+
+/*
+  sgd_step takes a plain SGD step on n contiguous parameters and keeps the
+  pruned ones at zero
+*/
+static void sgd_step(network_t *net, size_t first, const double *g, size_t n, double eta) {
+  double *p = net->params->block->data + first;
+  for (size_t i = 0; i < n; i++) p[i] -= eta * g[i];
+  apply_mask(net, first, n);
+}
+
+/*
+  sgd_step_columns takes a plain SGD step on the given columns of the first
+  layer weights only, g holds their gradients laid out like the weights
+*/
+static void sgd_step_columns(network_t *net, const double *g, const int *columns,
+      size_t num_columns, double eta) {
+  gsl_matrix *w = net->weights[0];
+  const double *m = net->mask ? net->mask->block->data : NULL;
+  for (size_t r = 0; r < w->size1; r++) {
+    double *wr = w->data + r * w->tda;
+    const double *gr = g + r * w->tda;
+    const double *mr = m ? m + r * w->tda : NULL;
+    for (size_t c = 0; c < num_columns; c++) {
+      int i = columns[c];
+      wr[i] -= eta * gr[i];
+      if (mr) wr[i] *= mr[i];
+    }
+  }
+}
+
+/*
+  hogwild_slices claims mini batches from the loader until the epoch is
+  exhausted and applies each update to the shared parameters without
+  waiting for the other workers. The first layer weights of inputs that
+  are zero in the whole batch have no gradient and are left alone.
+*/
+static void hogwild_slices(worker_t *w) {
+  pool_t *pool = w->pool;
+  network_t *net = pool->net;
+  set_loader_t *loader = pool->loader;
+  size_t n = pool->mini_batch_size;
+  double *p = net->params->block->data;
+  double *g = w->replica->delta_grads->block->data;
+  // the first layer weights lead the slab, everything after them is dense
+  size_t rest = ((net->num_layers > 2) ? net->weights[1] : net->biases[0])->data - p;
+  size_t total = net->params->block->size;
+  double cost = 0;
+  while (1) {
+    size_t first = __atomic_fetch_add(&loader->idx, n, __ATOMIC_RELAXED);
+    if (first + n > loader->total) break;
+    w->first = first;
+    w->count = n;
+    compute_slice(w);
+    cost += w->cost;
+    sparse_t *x = w->replica->sparse_input;
+    if (x == NULL) {
+      sgd_step(net, 0, g, rest, pool->eta_scaler);
+    } else {
+      size_t num_columns = 0;
+      for (size_t q = 0; q < x->start[x->n]; q++) {
+        int i = x->index[q];
+        if (!w->seen[i]) {
+          w->seen[i] = true;
+          w->columns[num_columns++] = i;
+        }
+      }
+      sgd_step_columns(net, g, w->columns, num_columns, pool->eta_scaler);
+      for (size_t c = 0; c < num_columns; c++) w->seen[w->columns[c]] = false;
+    }
+    sgd_step(net, rest, g + rest, total - rest, pool->eta_scaler);
+  }
+  w->cost = cost;
+}
+
+static void *worker_thread(void *vargp) {
+  worker_t *w = (worker_t*) vargp;
+  pool_t *pool = w->pool;
+  while (1) {
+    P(&w->go);
+    if (pool->phase == PHASE_EXIT) break;
+    double start = now();
+    if (pool->phase == PHASE_COMPUTE) {
+      compute_slice(w);
+      w->compute_time += now() - start;
+    } else if (pool->phase == PHASE_HOGWILD) {
+      hogwild_slices(w);
+      w->compute_time += now() - start;
+    } else {
+      update_segment(w);
+      w->update_time += now() - start;
+    }
+    V(&pool->done);
+  }
+  return NULL;
+}
+
+/*
+  run_phase wakes every worker for one phase and waits for all of them
+*/
+static void run_phase(pool_t *pool, int phase) {
+  pool->phase = phase;
+  for (int t = 0; t < pool->num_threads; t++) {
+    V(&pool->workers[t].go);
+  }
+  if (phase == PHASE_EXIT) return;
+  for (int t = 0; t < pool->num_threads; t++) {
+    P(&pool->done);
+  }
+}
+
+static pool_t *init_pool(network_t *net, set_loader_t *loader, int num_threads) {
+  pool_t *pool = (pool_t*) malloc(sizeof(pool_t));
+  pool->net = net;
+  pool->loader = loader;
+  pool->velocity = init_slab(net);
+  pool->num_threads = num_threads;
+  pool->workers = (worker_t*) calloc(num_threads, sizeof(worker_t));
+  Sem_init(&pool->done, 0, 0);
+
+  // split the slab into aligned segments so workers never share a cache line
+  size_t align = SLAB_ALIGN / sizeof(double);
+  size_t total = net->params->block->size;
+  for (int t = 0; t < num_threads; t++) {
+    worker_t *w = &pool->workers[t];
+    w->id = t;
+    w->pool = pool;
+    w->replica = init_network_replica(net);
+    w->seg_start = (total * t / num_threads) / align * align;
+    w->seg_end = (t == num_threads - 1) ? total : (total * (t + 1) / num_threads) / align * align;
+    Sem_init(&w->go, 0, 0);
+    Pthread_create(&w->tid, NULL, worker_thread, w);
+  }
+  return pool;
+}
+
+static void free_pool(pool_t *pool) {
+  run_phase(pool, PHASE_EXIT);
+  for (int t = 0; t < pool->num_threads; t++) {
+    Pthread_join(pool->workers[t].tid, NULL);
+    free_network(pool->workers[t].replica);
+    free(pool->workers[t].seen);
+    free(pool->workers[t].columns);
+  }
+  free_slab(pool->velocity);
+  free(pool->workers);
+  free(pool);
+}
+
+static void set_scalers(pool_t *pool, int mini_batch_size, double eta) {
+  pool->mini_batch_size = mini_batch_size;
+  pool->weight_decay = 1.0 - (((double)eta * (double)LAMBDA)/((double)mini_batch_size));
+  pool->eta_scaler = eta / ((double)mini_batch_size);
+  pool->mu_scaler = MU / ((double)mini_batch_size);
+}
+
+static void reset_stats(pool_t *pool) {
+  for (int t = 0; t < pool->num_threads; t++) {
+    pool->workers[t].compute_time = 0;
+    pool->workers[t].update_time = 0;
+    pool->workers[t].samples = 0;
+  }
+}
+
+static void print_stats(pool_t *pool, double elapsed) {
+  size_t samples = 0;
+  for (int t = 0; t < pool->num_threads; t++) samples += pool->workers[t].samples;
+  printf("\nEpoch time: %.3fs with %d threads, %.0f samples/s\n", elapsed, pool->num_threads,
+            (double)samples / elapsed);
+  for (int t = 0; t < pool->num_threads; t++) {
+    worker_t *w = &pool->workers[t];
+    printf("  thread %d: %zu samples, compute %.3fs, update %.3fs, idle %.3fs\n", t,
+              w->samples, w->compute_time, w->update_time,
+              elapsed - w->compute_time - w->update_time);
+  }
+}
+
+/*
+  parallel_update_mini_batch is update_mini_batch with the mini batch split
+  across the worker threads of the pool
+*/
+static void parallel_update_mini_batch(pool_t *pool, int mini_batch_size, double eta) {
+  network_t *net = pool->net;
+  set_loader_t *loader = pool->loader;
+  int n = pool->num_threads;
+  assert(loader->idx + mini_batch_size <= loader->total);
+  for (int t = 0; t < n; t++) {
+    worker_t *w = &pool->workers[t];
+    w->first = loader->idx + (size_t)mini_batch_size * t / n;
+    w->count = loader->idx + (size_t)mini_batch_size * (t + 1) / n - w->first;
+  }
+  loader->idx += mini_batch_size;
+  run_phase(pool, PHASE_COMPUTE);
+
+  double mbc = 0;
+  for (int t = 0; t < n; t++) mbc += pool->workers[t].cost;
+  net->obj_fun += (mbc / (double)(mini_batch_size));
+
+  set_scalers(pool, mini_batch_size, eta);
+  run_phase(pool, PHASE_UPDATE);
+}
+
+/*
+  parallel_stochastic_gradient_descent is stochastic_gradient_descent with
+  every mini batch split across num_threads worker threads. It prints the
+  epoch time and the time each thread spent computing and updating.
+*/
+void parallel_stochastic_gradient_descent(network_t *net, set_loader_t *train_loader,
+      set_loader_t *test_loader, int mini_batch_size, int epochs, double eta, int num_threads) {
+  int mini_batches = (train_loader->total/mini_batch_size);
+  pool_t *pool = init_pool(net, train_loader, num_threads);
+  evaluator_t *ev = init_evaluator(net, num_threads);
+
+  for (size_t e = 0; e < epochs; e++) {
+    shuffle(train_loader);
+    reset_stats(pool);
+    double start = now();
+    for (int m = 0; m < mini_batches; m++) {
+      parallel_update_mini_batch(pool, mini_batch_size, eta);
+    }
+    double elapsed = now() - start;
+    slab_set_zero(pool->velocity);
+    print_stats(pool, elapsed);
+    printf("\n%s\n", "evaluating...");
+    printf("%s: %4f\n", "cost", net->obj_fun);
+    int correct = run_evaluator(ev, test_loader, NULL);
+    printf("Epoch: %zu, accuracy %d / %zu\n", e, correct, test_loader->total);
+    shuffle(test_loader);
+    net->obj_fun = 0;
+  }
+  free_evaluator(ev);
+  free_pool(pool);
+}
+
+typedef struct eval_task {
+  pthread_t tid;
+  evaluator_t *ev;
+  network_t *replica;
+  set_loader_t *loader;
+  size_t first;
+  size_t count;
+  int correct;
+  int confusion[NUM_CLASSES][NUM_CLASSES];
+  sem_t go;
+} eval_task_t;
+
+/*
+  An evaluator keeps one replica of the network and, with more than one
+  thread, one thread per chunk of the test set alive between epochs. The
+  threads wait on their semaphore like the workers of the training pool,
+  so the trainers score the test set after every epoch without allocating
+  or creating threads.
+*/
+struct evaluator {
+  int num_threads;
+  bool exit;
+  eval_task_t *tasks;
+  sem_t done;
+};
+
+static void score_chunk(eval_task_t *task) {
+  task->correct = evaluate_range(task->replica, task->loader, task->first, task->count,
+                                  task->confusion);
+}
+
+static void *eval_thread(void *vargp) {
+  eval_task_t *task = (eval_task_t*) vargp;
+  evaluator_t *ev = task->ev;
+  while (1) {
+    P(&task->go);
+    if (ev->exit) break;
+    score_chunk(task);
+    V(&ev->done);
+  }
+  return NULL;
+}
+
+evaluator_t *init_evaluator(network_t *net, int num_threads) {
+  evaluator_t *ev = (evaluator_t*) malloc(sizeof(evaluator_t));
+  ev->num_threads = num_threads;
+  ev->exit = false;
+  ev->tasks = (eval_task_t*) calloc(num_threads, sizeof(eval_task_t));
+  Sem_init(&ev->done, 0, 0);
+  for (int t = 0; t < num_threads; t++) {
+    eval_task_t *task = &ev->tasks[t];
+    task->ev = ev;
+    task->replica = init_network_replica(net);
+    Sem_init(&task->go, 0, 0);
+    if (num_threads > 1) Pthread_create(&task->tid, NULL, eval_thread, task);
+  }
+  return ev;
+}
+
+void free_evaluator(evaluator_t *ev) {
+  ev->exit = true;
+  for (int t = 0; t < ev->num_threads; t++) {
+    eval_task_t *task = &ev->tasks[t];
+    if (ev->num_threads > 1) {
+      V(&task->go);
+      Pthread_join(task->tid, NULL);
+    }
+    free_network(task->replica);
+  }
+  free(ev->tasks);
+  free(ev);
+}
+
+/*
+  run_evaluator scores test_loader with the test set split into one chunk
+  per thread of ev and waits for the threads to finish, a single thread
+  scores it on the calling thread. When
+  confusion is not NULL the predictions are added to it, see
+  evaluate_range.
+*/
+int run_evaluator(evaluator_t *ev, set_loader_t *test_loader, int confusion[][NUM_CLASSES]) {
+  int num_threads = ev->num_threads;
+  size_t total = test_loader->total;
+  for (int t = 0; t < num_threads; t++) {
+    eval_task_t *task = &ev->tasks[t];
+    task->loader = test_loader;
+    task->first = total * t / num_threads;
+    task->count = total * (t + 1) / num_threads - task->first;
+    memset(task->confusion, 0, sizeof(task->confusion));
+    if (num_threads > 1) {
+      V(&task->go);
+    } else {
+      score_chunk(task);
+    }
+  }
+  for (int t = 0; t < num_threads && num_threads > 1; t++) {
+    P(&ev->done);
+  }
+  int correct = 0;
+  for (int t = 0; t < num_threads; t++) {
+    eval_task_t *task = &ev->tasks[t];
+    correct += task->correct;
+    if (confusion) {
+      for (int i = 0; i < NUM_CLASSES; i++) {
+        for (int j = 0; j < NUM_CLASSES; j++) confusion[i][j] += task->confusion[i][j];
+      }
+    }
+  }
+  return correct;
+}
+
+/*
+  parallel_evaluate scores the test set once with num_threads threads, see
+  run_evaluator
+*/
+int parallel_evaluate(network_t *net, set_loader_t *test_loader, int num_threads,
+      int confusion[][NUM_CLASSES]) {
+  evaluator_t *ev = init_evaluator(net, num_threads);
+  int correct = run_evaluator(ev, test_loader, confusion);
+  free_evaluator(ev);
+  return correct;
+}
+
+/*
+  hogwild_stochastic_gradient_descent trains with num_threads workers that
+  each run whole mini batches and update the shared weights and biases
+  without locks or barriers, racing updates to the same parameter are
+  simply allowed to overwrite each other. There is no momentum, and the
+  weight decay the synchronous trainer applies on every mini batch is
+  applied to the weights all at once after every epoch.
+*/
+void hogwild_stochastic_gradient_descent(network_t *net, set_loader_t *train_loader,
+      set_loader_t *test_loader, int mini_batch_size, int epochs, double eta, int num_threads) {
+  pool_t *pool = init_pool(net, train_loader, num_threads);
+  for (int t = 0; t < num_threads; t++) {
+    pool->workers[t].seen = (bool*) calloc(net->layers[0], sizeof(bool));
+    pool->workers[t].columns = (int*) malloc(net->layers[0] * sizeof(int));
+  }
+  set_scalers(pool, mini_batch_size, eta);
+  size_t weights_size = net->params->weights->slab->size;
+  evaluator_t *ev = init_evaluator(net, num_threads);
+
+  for (size_t e = 0; e < epochs; e++) {
+    shuffle(train_loader);
+    reset_stats(pool);
+    double start = now();
+    run_phase(pool, PHASE_HOGWILD);
+    double elapsed = now() - start;
+    size_t samples = 0;
+    for (int t = 0; t < num_threads; t++) {
+      net->obj_fun += pool->workers[t].cost / (double)(mini_batch_size);
+      samples += pool->workers[t].samples;
+    }
+    // the decay of every mini batch of the epoch, pruned weights stay zero
+    double decay = pow(pool->weight_decay, (double)(samples / mini_batch_size));
+    double *p = net->params->block->data;
+    for (size_t i = 0; i < weights_size; i++) p[i] *= decay;
+    print_stats(pool, elapsed);
+    printf("\n%s\n", "evaluating...");
+    printf("%s: %4f\n", "cost", net->obj_fun);
+    int correct = run_evaluator(ev, test_loader, NULL);
+    printf("Epoch: %zu, accuracy %d / %zu\n", e, correct, test_loader->total);
+    shuffle(test_loader);
+    net->obj_fun = 0;
+  }
+  free_evaluator(ev);
+  free_pool(pool);
+}
@@ -0,0 +1,107 @@
+#include "training.h"
+#include <sched.h>
+
+/*
+  The pipeline overlaps data preparation with compute. For every epoch a
+  loader thread walks the access order of the set loader and fills the
+  free batches of the ring while the trainer computes on the oldest full
+  one. Both sides spin with sched_yield when the ring is full or empty,
+  which only happens when one of them is much slower than the other.
+*/
+
+static void *producer_thread(void *vargp) {
+  pipeline_t *pipe = (pipeline_t*) vargp;
+  size_t n = pipe->batch_size;
+  for (size_t b = 0; b < pipe->batches; b++) {
+    // wait for the trainer to release a slot
+    while (b - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) == PIPELINE_DEPTH) {
+      sched_yield();
+    }
+    batch_t *batch = &pipe->slots[b % PIPELINE_DEPTH];
+    if (batch->sparse) {
+      fill_sparse_batch(pipe->loader, b * n, n, batch->sparse, batch->target);
+    } else {
+      fill_batch(pipe->loader, b * n, n, batch->input, batch->target);
+    }
+    batch->n = n;
+    __atomic_store_n(&pipe->head, b + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/*
+  init_pipeline preallocates the ring for mini batches of batch_size
+  images of loader, sparse ones if the loader has indexed its nonzero
+  pixels
+*/
+pipeline_t *init_pipeline(set_loader_t *loader, size_t batch_size) {
+  pipeline_t *pipe = (pipeline_t*) calloc(1, sizeof(pipeline_t));
+  size_t len = loader->width * loader->height;
+  pipe->loader = loader;
+  pipe->batch_size = batch_size;
+  for (int i = 0; i < PIPELINE_DEPTH; i++) {
+    if (loader->nz_index) {
+      pipe->slots[i].sparse = sparse_alloc(batch_size, batch_size * loader->nz_max);
+    } else {
+      pipe->slots[i].input = gsl_matrix_alloc(len, batch_size);
+    }
+    pipe->slots[i].target = gsl_matrix_alloc(NUM_CLASSES, batch_size);
+  }
+  return pipe;
+}
+
+void free_pipeline(pipeline_t *pipe) {
+  if (pipe->running) pipeline_stop(pipe);
+  for (int i = 0; i < PIPELINE_DEPTH; i++) {
+    if (pipe->slots[i].input) gsl_matrix_free(pipe->slots[i].input);
+    if (pipe->slots[i].sparse) sparse_free(pipe->slots[i].sparse);
+    gsl_matrix_free(pipe->slots[i].target);
+  }
+  free(pipe);
+}
+
+/*
+  pipeline_start launches the loader thread for the first batches mini
+  batches of the current access order, the loader must not be shuffled
+  until pipeline_stop
+*/
+void pipeline_start(pipeline_t *pipe, size_t batches) {
+  assert(!pipe->running);
+  assert(batches * pipe->batch_size <= pipe->loader->total);
+  pipe->batches = batches;
+  pipe->head = 0;
+  pipe->tail = 0;
+  pipe->loader->idx = 0;
+  pipe->running = true;
+  Pthread_create(&pipe->tid, NULL, producer_thread, pipe);
+}
+
+/*
+  pipeline_next waits for the next mini batch and returns it, it stays
+  valid until pipeline_release
+*/
+batch_t *pipeline_next(pipeline_t *pipe) {
+  assert(pipe->tail < pipe->batches);
+  while (__atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == pipe->tail) {
+    sched_yield();
+  }
+  return &pipe->slots[pipe->tail % PIPELINE_DEPTH];
+}
+
+/*
+  pipeline_release hands the current mini batch back to the loader thread
+*/
+void pipeline_release(pipeline_t *pipe) {
+  pipe->loader->idx += pipe->batch_size;
+  __atomic_store_n(&pipe->tail, pipe->tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+  pipeline_stop waits for the loader thread to finish the epoch
+*/
+void pipeline_stop(pipeline_t *pipe) {
+  // let the loader thread run out if the trainer stopped early
+  __atomic_store_n(&pipe->tail, pipe->batches, __ATOMIC_RELEASE);
+  Pthread_join(pipe->tid, NULL);
+  pipe->running = false;
+}
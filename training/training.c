@@ -11,24 +11,60 @@
 void stochastic_gradient_descent(network_t *net, set_loader_t *train_loader,
       set_loader_t *test_loader, int mini_batch_size, int epochs, double eta) {
   int mini_batches = (train_loader->total/mini_batch_size);
-  gsl_matrix_list_t *vw = init_weight_grads(net);
-  gsl_matrix_list_t *vb = init_bias_grads(net);
+  // velocities of the momentum update, laid out like the parameters
+  slab_t *velocity = init_slab(net);
+  gsl_matrix_list_t *vw = velocity->weights;
+  gsl_matrix_list_t *vb = velocity->biases;
+  // a loader thread prepares the next mini batches while this one computes
+  pipeline_t *pipe = init_pipeline(train_loader, mini_batch_size);
+  evaluator_t *ev = init_evaluator(net, 1);
 
   for (size_t e = 0; e < epochs; e++) {
+    PROFILE_BEGIN(PROFILE_EPOCH);
+    PROFILE_BEGIN(PROFILE_SHUFFLE);
     shuffle(train_loader);
+    PROFILE_END(PROFILE_SHUFFLE);
+    pipeline_start(pipe, mini_batches);
+#ifdef ANNC_DEBUG_ALLOC
+    size_t allocs = 0;
+#endif
     for (int m = 0; m < mini_batches; m++) {
-      update_mini_batch(net, train_loader, vw, vb, mini_batch_size, eta);
+      PROFILE_BEGIN(PROFILE_FETCH);
+      batch_t *batch = pipeline_next(pipe);
+      gsl_matrix *input = batch->input;
+      if (batch->sparse) {
+        load_sparse(net, batch->sparse);
+        input = net->activations->data[0];
+      }
+      PROFILE_END(PROFILE_FETCH);
+      update_batch(net, input, batch->target, vw, vb, mini_batch_size, eta);
+      pipeline_release(pipe);
+#ifdef ANNC_DEBUG_ALLOC
+      // the first mini batch sizes the workspace, count allocations after it
+      if (m == 0) allocs = alloc_count();
+#endif
     }
-    gsl_matrix_list_set_zero(vw);
-    gsl_matrix_list_set_zero(vb);
+#ifdef ANNC_DEBUG_ALLOC
+    printf("allocations after the first mini batch: %zu\n", alloc_count() - allocs);
+#endif
+    pipeline_stop(pipe);
+    slab_set_zero(velocity);
     printf("\n%s\n", "evaluating...");
     printf("%s: %4f\n", "cost", net->obj_fun);
-    printf("Epoch: %zu, accuracy %d / %zu\n", e, evaluate(net, test_loader), test_loader->total);
+    PROFILE_BEGIN(PROFILE_EVALUATE);
+    int correct = run_evaluator(ev, test_loader, NULL);
+    PROFILE_END(PROFILE_EVALUATE);
+    printf("Epoch: %zu, accuracy %d / %zu\n", e, correct, test_loader->total);
+    PROFILE_BEGIN(PROFILE_SHUFFLE);
     shuffle(test_loader);
+    PROFILE_END(PROFILE_SHUFFLE);
     net->obj_fun = 0;
+    PROFILE_END(PROFILE_EPOCH);
+    PROFILE_REPORT(net, (size_t)mini_batches * mini_batch_size);
   }
-  gsl_matrix_list_free(vw);
-  gsl_matrix_list_free(vb);
+  free_slab(velocity);
+  free_pipeline(pipe);
+  free_evaluator(ev);
 }
 
 gsl_matrix *image_to_matrix(image_t *img, size_t width, size_t height) {
@@ -36,89 +72,411 @@ gsl_matrix *image_to_matrix(image_t *img, size_t width, size_t height) {
   size_t len = width * height;
   image_matrix = gsl_matrix_alloc(len, 1);
   for (size_t i = 0; i < len; i++) {
-    gsl_matrix_set (image_matrix, i, 0, (double)(img->data[i]));
+    gsl_matrix_set (image_matrix, i, 0, PIXEL_SCALE * img->data[i]);
   }
   return image_matrix;
 }
 
 gsl_matrix *mnist_target_matrix(image_t *img) {
   gsl_matrix *target_matrix;
-  target_matrix = gsl_matrix_calloc(10, 1);
+  target_matrix = gsl_matrix_calloc(NUM_CLASSES, 1);
   gsl_matrix_set (target_matrix, (size_t)img->label, 0, 1);
   return target_matrix;
 }
 
+/*
+  load_mini_batch reads the next n images of the loader straight into the
+  input layer of the network and their one-hot labels into the workspace
+  target, one column per image
+*/
+void load_mini_batch(network_t *net, set_loader_t *loader, size_t n) {
+  assert(loader->idx + n <= loader->total);
+  load_batch(net, loader, loader->idx, n);
+  loader->idx += n;
+}
+
+/*
+  load_batch is load_mini_batch for the n images starting at position
+  first of the access order, it leaves the loader position alone. For a
+  loader with indexed nonzero pixels it loads a sparse input layer.
+*/
+void load_batch(network_t *net, set_loader_t *loader, size_t first, size_t n) {
+  set_batch_size(net, n);
+  if (loader->nz_index == NULL) {
+    fill_batch(loader, first, n, net->activations->data[0], net->ws->target);
+    net->sparse_input = NULL;
+    return;
+  }
+  if (net->ws->sparse == NULL || net->ws->sparse->capacity < n * loader->nz_max) {
+    if (net->ws->sparse) sparse_free(net->ws->sparse);
+    net->ws->sparse = sparse_alloc(n, n * loader->nz_max);
+  }
+  fill_sparse_batch(loader, first, n, net->ws->sparse, net->ws->target);
+  load_sparse(net, net->ws->sparse);
+}
+
+/*
+  fill_batch writes the scaled pixels of the n images starting at position
+  first of the access order into the columns of input and their one-hot
+  labels into target
+*/
+void fill_batch(set_loader_t *loader, size_t first, size_t n,
+      gsl_matrix *input, gsl_matrix *target) {
+  const int *idx = get_batch(loader, first, n);
+  size_t len = loader->width * loader->height;
+  if (loader->cache) {
+    // the rows are already scaled, gather them into the columns
+    for (size_t j = 0; j < n; j++) {
+      size_t k = idx[j];
+      const double *x = loader->cache + k * len;
+      const double *y = loader->targets + k * NUM_CLASSES;
+      for (size_t i = 0; i < len; i++) input->data[i * input->tda + j] = x[i];
+      for (size_t c = 0; c < NUM_CLASSES; c++) target->data[c * target->tda + j] = y[c];
+    }
+    return;
+  }
+  gsl_matrix_set_zero(target);
+  for (size_t j = 0; j < n; j++) {
+    const uint8_t *x = loader->data + idx[j] * len;
+    for (size_t i = 0; i < len; i++) {
+      input->data[i * input->tda + j] = PIXEL_SCALE * x[i];
+    }
+    gsl_matrix_set(target, loader->labels[idx[j]], j, 1);
+  }
+}
+
+/*
+  fill_sparse_batch is fill_batch for a sparse input, it writes the scaled
+  nonzero pixels of the n images
+*/
+void fill_sparse_batch(set_loader_t *loader, size_t first, size_t n,
+      sparse_t *input, gsl_matrix *target) {
+  const int *idx = get_batch(loader, first, n);
+  size_t len = loader->width * loader->height;
+  assert(loader->nz_index != NULL && n * loader->nz_max <= input->capacity);
+  gsl_matrix_set_zero(target);
+  size_t p = 0;
+  for (size_t j = 0; j < n; j++) {
+    size_t k = idx[j];
+    input->start[j] = p;
+    for (size_t q = loader->nz_start[k]; q < loader->nz_start[k+1]; q++, p++) {
+      size_t i = loader->nz_index[q];
+      input->index[p] = i;
+      input->value[p] = loader->cache ? loader->cache[k * len + i]
+                                      : PIXEL_SCALE * loader->data[k * len + i];
+    }
+    gsl_matrix_set(target, loader->labels[k], j, 1);
+  }
+  input->start[n] = p;
+  input->n = n;
+}
+
+/*
+  update_mini_batch pushes the whole mini batch through the network at once,
+  so every layer does one matrix-matrix product instead of one
+  matrix-vector product per sample. Every temporary comes from the network
+  workspace, so this does not allocate.
+*/
 void update_mini_batch(network_t *net, set_loader_t *loader,
       gsl_matrix_list_t *vw, gsl_matrix_list_t *vb, int mini_batch_size, double eta) {
+  load_mini_batch(net, loader, mini_batch_size);
+  update_batch(net, net->activations->data[0], net->ws->target, vw, vb, mini_batch_size, eta);
+}
 
-  gsl_matrix *input;
-  gsl_matrix *target;
-  image_t *img;
+/*
+  update_batch is update_mini_batch for a mini batch that is already laid
+  out as one column per image in input and target
+*/
+void update_batch(network_t *net, gsl_matrix *input, gsl_matrix *target,
+      gsl_matrix_list_t *vw, gsl_matrix_list_t *vb, int mini_batch_size, double eta) {
 
   // reset the delta gradients
-  gsl_matrix_list_set_zero(net->weight_grads);
-  gsl_matrix_list_set_zero(net->bias_grads);
-  gsl_matrix_list_set_zero(net->delta_bias_grads);
-  gsl_matrix_list_set_zero(net->delta_weight_grads);
-  double mbc = 0;
-  for (int m = 0; m < mini_batch_size; m++) {
-    img = get_next_image(loader);
-    input = image_to_matrix(img, loader->height, loader->width);
-    target = mnist_target_matrix(img);
-    feedforward(net, input);
-    backprop(net, target);
-    mbc += (*net->cost->f)(net->activations->data[net->num_layers-1], target);
-    gsl_matrix_free(input);
-    gsl_matrix_free(target);
-    for (int l = 0; l < net->num_layers-1; l++) {
-      gsl_matrix_add(net->weight_grads->data[l], net->delta_weight_grads->data[l]);
-      gsl_matrix_add(net->bias_grads->data[l], net->delta_bias_grads->data[l]);
-    }
-  }
+  PROFILE_BEGIN(PROFILE_ACCUMULATE);
+  slab_set_zero(net->grads);
+  slab_set_zero(net->delta_grads);
+  PROFILE_END(PROFILE_ACCUMULATE);
+  PROFILE_BEGIN(PROFILE_FORWARD);
+  feedforward(net, input);
+  PROFILE_END(PROFILE_FORWARD);
+  PROFILE_INPUTS(net);
+  PROFILE_BEGIN(PROFILE_BACKWARD);
+  double mbc = backprop(net, target);
+  PROFILE_END(PROFILE_BACKWARD);
+  PROFILE_BEGIN(PROFILE_ACCUMULATE);
+  slab_add(net->grads, net->delta_grads);
+  PROFILE_END(PROFILE_ACCUMULATE);
   // accumulate the cost
   net->obj_fun += (mbc / (double)(mini_batch_size));
 
-  // perform updates before completing mini-batch
-  for (int l = 0; l < net->num_layers-1; l++) {
-    double weight_decay;
-    double eta_scaler;
-    double mu_scaler;
+  // perform updates before completing mini-batch, one fused pass over the
+  // weights with L2 regularization and one over the biases without it
+  // v' = MU * v - eta/len(mini_batch) * delta_weight_grad
+  double weight_decay = 1.0 - (((double)eta * (double)LAMBDA)/((double)mini_batch_size));
+  double eta_scaler = eta / ((double)mini_batch_size);
+  double mu_scaler = MU / ((double)mini_batch_size);
+  assert(vw->slab != NULL && vb->slab != NULL);
+  PROFILE_BEGIN(PROFILE_UPDATE);
+  sgd_update(net->optimizer, net->params->weights->slab->data, vw->slab->data,
+              net->grads->weights->slab->data, vw->slab->size,
+              weight_decay, mu_scaler, eta_scaler);
+  sgd_update(net->optimizer, net->params->biases->slab->data, vb->slab->data,
+              net->grads->biases->slab->data, vb->slab->size,
+              1.0, mu_scaler, eta_scaler);
+  // keep pruned weights at zero
+  apply_mask(net, 0, net->params->block->size);
+  PROFILE_END(PROFILE_UPDATE);
+}
+
 
-    // L2 regularization
-    weight_decay = 1.0 - (((double)eta * (double)LAMBDA)/((double)mini_batch_size));
-    gsl_matrix_scale(net->weights[l], weight_decay);
+/*
+  evaluate returns the number of test images the network classifies
+  correctly. It scores batches of EVAL_BATCH_SIZE images on a replica of
+  the network, so the training buffers of net are left alone. The trainers
+  keep an evaluator instead of paying for the replica every epoch.
+*/
+int evaluate(network_t *net, set_loader_t *test_loader) {
+  return parallel_evaluate(net, test_loader, 1, NULL);
+}
+
+/*
+  evaluate_range scores the n images starting at position first of the
+  access order in batches on net, which should be a replica. It returns the
+  number of correct predictions and, when confusion is not NULL, adds every
+  prediction to confusion[label][prediction].
+*/
+int evaluate_range(network_t *net, set_loader_t *loader, size_t first, size_t n,
+      int confusion[][NUM_CLASSES]) {
+  const int *idx = get_batch(loader, first, n);
+  int sum = 0;
+  for (size_t i = 0; i < n; i += EVAL_BATCH_SIZE) {
+    size_t len = (n - i < EVAL_BATCH_SIZE) ? n - i : EVAL_BATCH_SIZE;
+    load_batch(net, loader, first + i, len);
+    feedforward(net, net->activations->data[0]);
+    gsl_matrix *out = net->activations->data[net->num_layers-1];
+    for (size_t j = 0; j < len; j++) {
+      size_t prediction = 0;
+      for (size_t k = 1; k < out->size1; k++) {
+        if (gsl_matrix_get(out, k, j) > gsl_matrix_get(out, prediction, j)) prediction = k;
+      }
+      size_t label = loader->labels[idx[i + j]];
+      sum += (prediction == label) ? 1 : 0;
+      if (confusion) confusion[label][prediction]++;
+    }
+  }
+  return sum;
+}
 
-    // weight and bias update with momentum
-    // v' = MU * v - eta/len(mini_batch) * delta_weight_grad
-    eta_scaler = eta / ((double)mini_batch_size);
-    mu_scaler = MU / ((double)mini_batch_size);
-    gsl_matrix_scale(net->weight_grads->data[l], eta_scaler);
-    gsl_matrix_scale(vw->data[l], mu_scaler);
-    gsl_matrix_sub(vw->data[l], net->weight_grads->data[l]);
-    gsl_matrix_add(net->weights[l], vw->data[l]);
-    gsl_matrix_scale(net->bias_grads->data[l], eta_scaler);
-    gsl_matrix_scale(vb->data[l], mu_scaler);
-    gsl_matrix_sub(vb->data[l], net->bias_grads->data[l]);
-    gsl_matrix_add(net->biases[l], vb->data[l]);
+/*
+  print_confusion prints a confusion matrix with one row per label and one
+  column per prediction
+*/
+void print_confusion(int confusion[][NUM_CLASSES]) {
+  printf("%9s", "label\\out");
+  for (int j = 0; j < NUM_CLASSES; j++) printf("%6d", j);
+  printf("\n");
+  for (int i = 0; i < NUM_CLASSES; i++) {
+    printf("%9d", i);
+    for (int j = 0; j < NUM_CLASSES; j++) printf("%6d", confusion[i][j]);
+    printf("\n");
   }
 }
 
+// BEGIN PROFILING
+
+#ifdef ANNC_PROFILE
+static const char *phase_names[PROFILE_PHASES] = {
+  "fetch", "forward", "backward", "accumulate", "update", "shuffle", "evaluate", "epoch"
+};
+static double phase_start[PROFILE_PHASES];
+static double phase_seconds[PROFILE_PHASES];
+// input entries the first layer multiplied, see profile_inputs
+static double profile_input_entries;
+
+static double profile_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void profile_begin(int phase) {
+  phase_start[phase] = profile_now();
+}
+
+void profile_end(int phase) {
+  phase_seconds[phase] += profile_now() - phase_start[phase];
+}
 
 /*
-  evaluate returns 1 if the network correctly predicts a test image
-  or returns 0 if otherwise.
+  profile_inputs counts the inputs the first layer of net multiplied in
+  its last forward pass, only the nonzero ones of a sparse input
 */
-int evaluate(network_t *net, set_loader_t *test_loader) {
-  gsl_matrix *input;
-  size_t imax, jmax;
-  image_t *img;
+void profile_inputs(network_t *net) {
+  sparse_t *x = net->sparse_input;
+  profile_input_entries += x ? x->start[x->n] : (double)net->layers[0] * net->batch_size;
+}
+
+/*
+  profile_report prints the time of every phase since the last report and
+  clears it. samples were trained on, the GFLOP/s count the matrix
+  products actually done, 2 flops per weight and sample forward and up to
+  4 backward. A sparse first layer only counts its nonzero inputs.
+*/
+void profile_report(network_t *net, size_t samples) {
+  double hidden_weights = 0;
+  for (int l = 2; l < net->num_layers; l++) {
+    hidden_weights += (double)net->layers[l] * net->layers[l-1];
+  }
+  // the first layer has no input error to propagate
+  double first = (double)net->layers[1] * profile_input_entries;
+  double forward = 2 * (hidden_weights * samples + first);
+  double backward = 2 * (2 * hidden_weights * samples + first);
+  double epoch = phase_seconds[PROFILE_EPOCH];
+  double other = epoch;
+  printf("%-10s %10s %6s\n", "phase", "seconds", "%");
+  for (int p = 0; p < PROFILE_EPOCH; p++) {
+    printf("%-10s %10.4f %6.1f\n", phase_names[p], phase_seconds[p], 100 * phase_seconds[p] / epoch);
+    other -= phase_seconds[p];
+  }
+  printf("%-10s %10.4f %6.1f\n", "other", other, 100 * other / epoch);
+  printf("%-10s %10.4f\n", phase_names[PROFILE_EPOCH], epoch);
+  printf("%.0f samples/s, %.2f GFLOP/s over the epoch, %.2f forward, %.2f backward\n",
+            samples / epoch, (forward + backward) / epoch * 1e-9,
+            forward / phase_seconds[PROFILE_FORWARD] * 1e-9,
+            backward / phase_seconds[PROFILE_BACKWARD] * 1e-9);
+  memset(phase_seconds, 0, sizeof(phase_seconds));
+  profile_input_entries = 0;
+}
+#endif
+
+// BEGIN SINGLE PRECISION TRAINING
+
+/*
+  stochastic_gradient_descent_float is stochastic_gradient_descent for a
+  single precision network
+*/
+void stochastic_gradient_descent_float(network_float_t *net, set_loader_t *train_loader,
+      set_loader_t *test_loader, int mini_batch_size, int epochs, double eta) {
+  int mini_batches = (train_loader->total/mini_batch_size);
+  // velocities of the momentum update, laid out like the parameters
+  slab_float_t *velocity = init_slab_float(net);
+  gsl_matrix_float_list_t *vw = velocity->weights;
+  gsl_matrix_float_list_t *vb = velocity->biases;
+
+  for (size_t e = 0; e < epochs; e++) {
+    shuffle(train_loader);
+    for (int m = 0; m < mini_batches; m++) {
+      update_mini_batch_float(net, train_loader, vw, vb, mini_batch_size, eta);
+    }
+    slab_set_zero_float(velocity);
+    printf("\n%s\n", "evaluating...");
+    printf("%s: %4f\n", "cost", net->obj_fun);
+    printf("Epoch: %zu, accuracy %d / %zu\n", e, evaluate_float(net, test_loader), test_loader->total);
+    shuffle(test_loader);
+    net->obj_fun = 0;
+  }
+  free_slab_float(velocity);
+}
+
+/*
+  load_mini_batch_float is load_mini_batch for a single precision network
+*/
+void load_mini_batch_float(network_float_t *net, set_loader_t *loader, size_t n) {
+  assert(loader->idx + n <= loader->total);
+  load_batch_float(net, loader, loader->idx, n);
+  loader->idx += n;
+}
+
+/*
+  load_batch_float is load_batch for a single precision network
+*/
+void load_batch_float(network_float_t *net, set_loader_t *loader, size_t first, size_t n) {
+  const int *idx = get_batch(loader, first, n);
+  set_batch_size_float(net, n);
+  gsl_matrix_float *input = net->activations->data[0];
+  gsl_matrix_float *target = net->ws->target;
+  size_t len = loader->width * loader->height;
+  if (loader->cache_float) {
+    for (size_t j = 0; j < n; j++) {
+      size_t k = idx[j];
+      const float *x = loader->cache_float + k * len;
+      const float *y = loader->targets_float + k * NUM_CLASSES;
+      for (size_t i = 0; i < len; i++) input->data[i * input->tda + j] = x[i];
+      for (size_t c = 0; c < NUM_CLASSES; c++) target->data[c * target->tda + j] = y[c];
+    }
+    return;
+  }
+  gsl_matrix_float_set_zero(target);
+  for (size_t j = 0; j < n; j++) {
+    const uint8_t *x = loader->data + idx[j] * len;
+    for (size_t i = 0; i < len; i++) {
+      input->data[i * input->tda + j] = (float)(PIXEL_SCALE * x[i]);
+    }
+    gsl_matrix_float_set(target, loader->labels[idx[j]], j, 1);
+  }
+}
+
+void update_mini_batch_float(network_float_t *net, set_loader_t *loader,
+      gsl_matrix_float_list_t *vw, gsl_matrix_float_list_t *vb, int mini_batch_size, double eta) {
+
+  // reset the delta gradients
+  slab_set_zero_float(net->grads);
+  slab_set_zero_float(net->delta_grads);
+  double mbc = 0;
+  load_mini_batch_float(net, loader, mini_batch_size);
+  feedforward_float(net, net->activations->data[0]);
+  backprop_float(net, net->ws->target);
+  mbc += (*net->cost->f_float)(net->activations->data[net->num_layers-1], net->ws->target);
+  slab_add_float(net->grads, net->delta_grads);
+  // accumulate the cost
+  net->obj_fun += (mbc / (double)(mini_batch_size));
+
+  // perform updates before completing mini-batch, one fused pass over the
+  // weights with L2 regularization and one over the biases without it
+  // v' = MU * v - eta/len(mini_batch) * delta_weight_grad
+  double weight_decay = 1.0 - (((double)eta * (double)LAMBDA)/((double)mini_batch_size));
+  double eta_scaler = eta / ((double)mini_batch_size);
+  double mu_scaler = MU / ((double)mini_batch_size);
+  assert(vw->slab != NULL && vb->slab != NULL);
+  sgd_update_float(net->optimizer, net->params->weights->slab->data, vw->slab->data,
+              net->grads->weights->slab->data, vw->slab->size,
+              weight_decay, mu_scaler, eta_scaler);
+  sgd_update_float(net->optimizer, net->params->biases->slab->data, vb->slab->data,
+              net->grads->biases->slab->data, vb->slab->size,
+              1.0, mu_scaler, eta_scaler);
+}
+
+gsl_matrix_float *image_to_matrix_float(image_t *img, size_t width, size_t height) {
+  gsl_matrix_float *image_matrix;
+  size_t len = width * height;
+  image_matrix = gsl_matrix_float_alloc(len, 1);
+  for (size_t i = 0; i < len; i++) {
+    gsl_matrix_float_set (image_matrix, i, 0, (float)(PIXEL_SCALE * img->data[i]));
+  }
+  return image_matrix;
+}
+
+/*
+  evaluate_float returns the number of test images the single precision
+  network classifies correctly. It scores batches of EVAL_BATCH_SIZE
+  images in the buffers of net, training reloads them for every mini
+  batch.
+*/
+int evaluate_float(network_float_t *net, set_loader_t *test_loader) {
+  size_t total = test_loader->total;
+  const int *idx = get_batch(test_loader, 0, total);
   int sum = 0;
-  for (size_t m = 0; m < test_loader->total; m++) {
-    img = get_next_image(test_loader);
-    input = image_to_matrix(img, test_loader->height, test_loader->width);
-    feedforward(net, input);
-    gsl_matrix_max_index(net->activations->data[net->num_layers-1], &imax, &jmax);
-    sum += (imax == (size_t)img->label) ? 1 : 0;
+  for (size_t i = 0; i < total; i += EVAL_BATCH_SIZE) {
+    size_t len = (total - i < EVAL_BATCH_SIZE) ? total - i : EVAL_BATCH_SIZE;
+    load_batch_float(net, test_loader, i, len);
+    feedforward_float(net, net->activations->data[0]);
+    gsl_matrix_float *out = net->activations->data[net->num_layers-1];
+    for (size_t j = 0; j < len; j++) {
+      size_t prediction = 0;
+      for (size_t k = 1; k < out->size1; k++) {
+        if (gsl_matrix_float_get(out, k, j) > gsl_matrix_float_get(out, prediction, j)) prediction = k;
+      }
+      sum += (prediction == test_loader->labels[idx[i + j]]) ? 1 : 0;
+    }
   }
   return sum;
 }
@@ -6,14 +6,122 @@
 
 #define MU 0.9
 #define LAMBDA 0.8
+#define EVAL_BATCH_SIZE 1000
+// mini batches the loader thread may prepare ahead of the trainer
+#define PIPELINE_DEPTH 2
+
+/*
+  Built with -DANNC_PROFILE, stochastic_gradient_descent times every phase
+  of an epoch with the monotonic clock and prints the breakdown after each
+  epoch, see profile_report. Otherwise the PROFILE_ macros compile to
+  nothing. The accumulators are global, only one thread may record.
+*/
+#define PROFILE_FETCH 0       // waiting for the next mini batch
+#define PROFILE_FORWARD 1
+#define PROFILE_BACKWARD 2
+#define PROFILE_ACCUMULATE 3  // zeroing and summing the gradients
+#define PROFILE_UPDATE 4      // optimizer kernel and pruning mask
+#define PROFILE_SHUFFLE 5
+#define PROFILE_EVALUATE 6
+#define PROFILE_EPOCH 7       // the whole epoch
+#define PROFILE_PHASES 8
+
+#ifdef ANNC_PROFILE
+#define PROFILE_BEGIN(phase) profile_begin(phase)
+#define PROFILE_END(phase) profile_end(phase)
+#define PROFILE_INPUTS(net) profile_inputs(net)
+#define PROFILE_REPORT(net, samples) profile_report(net, samples)
+#else
+#define PROFILE_BEGIN(phase)
+#define PROFILE_END(phase)
+#define PROFILE_INPUTS(net)
+#define PROFILE_REPORT(net, samples)
+#endif
+
+/*
+  A batch is one mini batch laid out for the network, one column per image
+*/
+typedef struct batch {
+  gsl_matrix *input;  // scaled pixels, one column per image
+  sparse_t *sparse;   // the nonzero scaled pixels instead, for an indexed loader
+  gsl_matrix *target; // one-hot labels, one column per image
+  size_t n;
+} batch_t;
+
+/*
+  A pipeline is a single producer, single consumer ring of preallocated
+  batches. The loader thread only writes head and the trainer only writes
+  tail, so the handoff needs no lock.
+*/
+typedef struct pipeline {
+  set_loader_t *loader;
+  size_t batch_size;
+  size_t batches;     // mini batches to produce this epoch
+  size_t head;        // batches produced
+  size_t tail;        // batches consumed
+  bool running;
+  pthread_t tid;
+  batch_t slots[PIPELINE_DEPTH];
+} pipeline_t;
+
+// replicas that score a test set, see parallel.c
+typedef struct evaluator evaluator_t;
 
 void stochastic_gradient_descent(network_t *net, set_loader_t *train_loader,
       set_loader_t *test_loader, int mini_batch_size, int epochs, double eta);
 gsl_matrix *image_to_matrix(image_t *img, size_t width, size_t height);
 gsl_matrix *mnist_target_matrix(image_t *img);
+void load_mini_batch(network_t *net, set_loader_t *loader, size_t n);
+void load_batch(network_t *net, set_loader_t *loader, size_t first, size_t n);
+void fill_batch(set_loader_t *loader, size_t first, size_t n,
+      gsl_matrix *input, gsl_matrix *target);
+void fill_sparse_batch(set_loader_t *loader, size_t first, size_t n,
+      sparse_t *input, gsl_matrix *target);
 void update_mini_batch(network_t *net, set_loader_t *loader,
                   gsl_matrix_list_t *vw, gsl_matrix_list_t *vb, int mini_batch_size, double eta);
+void update_batch(network_t *net, gsl_matrix *input, gsl_matrix *target,
+      gsl_matrix_list_t *vw, gsl_matrix_list_t *vb, int mini_batch_size, double eta);
 int evaluate(network_t *net, set_loader_t *test_loader);
+int evaluate_range(network_t *net, set_loader_t *loader, size_t first, size_t n,
+      int confusion[][NUM_CLASSES]);
+void print_confusion(int confusion[][NUM_CLASSES]);
+
+// per phase timing (-DANNC_PROFILE)
+#ifdef ANNC_PROFILE
+void profile_begin(int phase);
+void profile_end(int phase);
+void profile_inputs(network_t *net);
+void profile_report(network_t *net, size_t samples);
+#endif
+
+// prefetching mini batches (pipeline.c)
+pipeline_t *init_pipeline(set_loader_t *loader, size_t batch_size);
+void free_pipeline(pipeline_t *pipe);
+void pipeline_start(pipeline_t *pipe, size_t batches);
+batch_t *pipeline_next(pipeline_t *pipe);
+void pipeline_release(pipeline_t *pipe);
+void pipeline_stop(pipeline_t *pipe);
+
+// multi-threaded training (parallel.c)
+void parallel_stochastic_gradient_descent(network_t *net, set_loader_t *train_loader,
+      set_loader_t *test_loader, int mini_batch_size, int epochs, double eta, int num_threads);
+void hogwild_stochastic_gradient_descent(network_t *net, set_loader_t *train_loader,
+      set_loader_t *test_loader, int mini_batch_size, int epochs, double eta, int num_threads);
+int parallel_evaluate(network_t *net, set_loader_t *test_loader, int num_threads,
+      int confusion[][NUM_CLASSES]);
+evaluator_t *init_evaluator(network_t *net, int num_threads);
+void free_evaluator(evaluator_t *ev);
+int run_evaluator(evaluator_t *ev, set_loader_t *test_loader, int confusion[][NUM_CLASSES]);
+
+// single precision training
+void stochastic_gradient_descent_float(network_float_t *net, set_loader_t *train_loader,
+      set_loader_t *test_loader, int mini_batch_size, int epochs, double eta);
+void load_mini_batch_float(network_float_t *net, set_loader_t *loader, size_t n);
+void load_batch_float(network_float_t *net, set_loader_t *loader, size_t first, size_t n);
+gsl_matrix_float *image_to_matrix_float(image_t *img, size_t width, size_t height);
+void update_mini_batch_float(network_float_t *net, set_loader_t *loader,
+      gsl_matrix_float_list_t *vw, gsl_matrix_float_list_t *vb, int mini_batch_size, double eta);
+int evaluate_float(network_float_t *net, set_loader_t *test_loader);
 gsl_matrix *image_to_matrix(image_t *img, size_t width, size_t height);
 gsl_matrix *mnist_target_matrix(image_t *img);
 